@@ -38,18 +38,33 @@
 #include "fserve.h"
 #include "admin.h"
 #include "global.h"
+#include "util.h"
+#include "md5.h"
+#include "compat.h"
 
 #include "logging.h"
 #define CATMODULE "auth"
 
+#define AUTH_CACHE_MAX      10000
+
 struct _auth_thread_t
 {
     thread_type *thread;
     void *data;
     unsigned int id;
+    int in_flight;      /* changed under auth->lock, read by queue_auth_client */
     struct auth_tag *auth;
 };
 
+typedef struct
+{
+    time_t expire;
+    time_t discon_time;
+    unsigned int flags;
+    char *key;
+    char *mount;        /* where the listener was placed */
+} auth_cache_entry;
+
 static volatile int thread_id;
 static rwlock_t auth_lock;
 int allow_auth;
@@ -127,6 +142,177 @@ static auth_client *auth_client_setup (const char *mount, client_t *client)
 }
 
 
+static int compare_cache_entry (void *arg, void *a, void *b)
+{
+    auth_cache_entry *e1 = a, *e2 = b;
+
+    return strcmp (e1->key, e2->key);
+}
+
+
+static int free_cache_entry (void *key)
+{
+    free (key);
+    return 1;
+}
+
+
+/* build the cache key for the listener, the password is hashed so that it
+ * is not held in the cache. Returns NULL if the key cannot be made.
+ */
+static char *auth_cache_key (const char *mount, client_t *client)
+{
+    struct MD5Context context;
+    unsigned char digest[16];
+    const char *user = client->username ? client->username : "";
+    const char *pass = client->password ? client->password : "";
+    char *hash, *key;
+    int len;
+
+    MD5Init (&context);
+    MD5Update (&context, (const unsigned char *)pass, strlen (pass));
+    MD5Final (digest, &context);
+    hash = util_bin_to_hex (digest, 16);
+    if (hash == NULL)
+        return NULL;
+    len = strlen (mount) + strlen (user) + strlen (hash) + strlen (client->connection.ip) + 4;
+    key = malloc (len);
+    if (key)
+        snprintf (key, len, "%s\n%s\n%s\n%s", mount, user, hash, client->connection.ip);
+    free (hash);
+    return key;
+}
+
+
+/* remove any expired entries, caller has the cache write locked */
+static void auth_cache_purge (auth_t *auth, time_t now)
+{
+    avl_node *node = avl_get_first (auth->cache);
+
+    while (node)
+    {
+        auth_cache_entry *entry = node->key;
+
+        node = avl_get_next (node);
+        if (entry->expire <= now)
+            avl_delete (auth->cache, entry, free_cache_entry);
+    }
+}
+
+
+/* look for a recent result for this listener. Returns 1 if the listener
+ * was accepted and the client has been updated, -1 if rejected and 0 if
+ * there is no result cached. On a miss, the key is returned in keyp for
+ * when the result is known. On an accept, mountp is set to a copy of the
+ * mount the backend placed the listener on, if not the one requested.
+ */
+static int auth_cache_check (auth_t *auth, const char *mount, client_t *client, char **keyp, char **mountp)
+{
+    auth_cache_entry search, *entry;
+    time_t now = client->worker ? client->worker->current_time.tv_sec : time (NULL);
+    int ret = 0, expired = 0;
+
+    *keyp = NULL;
+    *mountp = NULL;
+    if (auth->cache == NULL)
+        return 0;
+    search.key = auth_cache_key (mount, client);
+    if (search.key == NULL)
+        return 0;
+    avl_tree_rlock (auth->cache);
+    if (avl_get_by_key (auth->cache, &search, (void**)&entry) == 0)
+    {
+        if (entry->expire > now)
+        {
+            ret = -1;
+            if (entry->flags & CLIENT_AUTHENTICATED)
+            {
+                /* the backend has not seen this one, so no listener_remove */
+                client->flags |= entry->flags | CLIENT_AUTH_CACHED;
+                if (entry->discon_time)
+                    client->connection.discon_time = entry->discon_time;
+                if (strcmp (entry->mount, mount) != 0)
+                    *mountp = strdup (entry->mount);
+                ret = 1;
+            }
+        }
+        else
+            expired = 1;
+    }
+    avl_tree_unlock (auth->cache);
+    if (expired)
+    {
+        avl_tree_wlock (auth->cache);
+        auth_cache_purge (auth, now);
+        avl_tree_unlock (auth->cache);
+    }
+    if (ret)
+    {
+        stats_counter_add (stats_counters.auth_cache_hits, 1);
+        DEBUG2 ("cached auth result (%d) for %s", ret, client->connection.ip);
+        free (search.key);
+        return ret;
+    }
+    stats_counter_add (stats_counters.auth_cache_misses, 1);
+    *keyp = search.key;
+    return 0;
+}
+
+
+/* record the result of the listener auth, called from the auth thread */
+static void auth_cache_store (auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_t *auth = auth_user->auth;
+    auth_cache_entry *entry;
+    time_t now = time (NULL), expire;
+    unsigned int flags = 0;
+    int len, mlen;
+
+    /* redirects and intro content are not cached */
+    if (client == NULL || client->respcode || (client->flags & CLIENT_HAS_INTRO_CONTENT))
+        return;
+    if (client->flags & CLIENT_AUTHENTICATED)
+    {
+        if (auth->cache_ttl <= 0)
+            return;
+        flags = client->flags & (CLIENT_AUTHENTICATED|CLIENT_IS_SLAVE|CLIENT_HIJACKER);
+        expire = now + auth->cache_ttl;
+        /* a time limit applies to later connections as well */
+        if (client->connection.discon_time && client->connection.discon_time < expire)
+            expire = client->connection.discon_time;
+    }
+    else
+    {
+        if (auth->cache_negative_ttl <= 0)
+            return;
+        expire = now + auth->cache_negative_ttl;
+    }
+    len = strlen (auth_user->cache_key) + 1;
+    mlen = strlen (auth_user->mount) + 1;
+    entry = malloc (sizeof (auth_cache_entry) + len + mlen);
+    if (entry == NULL)
+        return;
+    entry->expire = expire;
+    entry->discon_time = flags ? client->connection.discon_time : 0;
+    entry->flags = flags;
+    entry->key = (char *)(entry + 1);
+    memcpy (entry->key, auth_user->cache_key, len);
+    entry->mount = entry->key + len;
+    memcpy (entry->mount, auth_user->mount, mlen);
+
+    avl_tree_wlock (auth->cache);
+    avl_delete (auth->cache, entry, free_cache_entry);
+    if (auth->cache->length >= AUTH_CACHE_MAX)
+        auth_cache_purge (auth, now);
+    if (auth->cache->length < AUTH_CACHE_MAX)
+        avl_insert (auth->cache, entry);
+    else
+        free (entry);
+    avl_tree_unlock (auth->cache);
+}
+
+
 static void queue_auth_client (auth_client *auth_user, mount_proxy *mountinfo)
 {
     auth_t *auth;
@@ -157,6 +343,13 @@ static void queue_auth_client (auth_client *auth_user, mount_proxy *mountinfo)
             }
         }
     }
+    if (auth->wakeup)
+    {
+        int i;
+        for (i=0; i<auth->handlers; i++)
+            if (auth->handles [i].thread && auth->handles [i].in_flight)
+                auth->wakeup (auth, auth->handles [i].data);
+    }
     DEBUG2 ("auth on %s has %d pending", auth->mount, auth->pending_count);
     thread_mutex_unlock (&auth->lock);
 }
@@ -189,6 +382,8 @@ void auth_release (auth_t *authenticator)
         authenticator->handlers--;
     }
     free (authenticator->handles);
+    if (authenticator->cache)
+        avl_tree_free (authenticator->cache, free_cache_entry);
 
     if (authenticator->release)
         authenticator->release (authenticator);
@@ -217,6 +412,7 @@ static void auth_client_free (auth_client *auth_user)
     }
     free (auth_user->hostname);
     free (auth_user->mount);
+    free (auth_user->cache_key);
     free (auth_user);
 }
 
@@ -234,6 +430,16 @@ static int is_listener_connected (client_t *client)
 }
 
 
+/* completion of the listener auth, possibly after a pending request */
+static void auth_new_listener_complete (auth_client *auth_user)
+{
+    if (auth_user->cache_key && auth_user->cacheable)
+        auth_cache_store (auth_user);
+    if (auth_postprocess_listener (auth_user) < 0)
+        DEBUG0 ("listener connection failed");
+}
+
+
 /* wrapper function for auth thread to authenticate new listener
  * connection details
  */
@@ -251,7 +457,14 @@ static void auth_new_listener (auth_client *auth_user)
     }
     if (auth_user->auth->authenticate)
     {
-        switch (auth_user->auth->authenticate (auth_user))
+        auth_result ret = auth_user->auth->authenticate (auth_user);
+
+        if (auth_user->pending)
+        {
+            auth_user->process = auth_new_listener_complete;
+            return;
+        }
+        switch (ret)
         {
             case AUTH_OK:
             case AUTH_FAILED:
@@ -260,17 +473,12 @@ static void auth_new_listener (auth_client *auth_user)
                 return;
         }
     }
-    if (auth_postprocess_listener (auth_user) < 0)
-        DEBUG0 ("listener connection failed");
+    auth_new_listener_complete (auth_user);
 }
 
 
-/* wrapper function for auth thread to drop listener connections
- */
-static void auth_remove_listener (auth_client *auth_user)
+static void auth_remove_listener_complete (auth_client *auth_user)
 {
-    if (auth_user->auth->release_listener)
-        auth_user->auth->release_listener (auth_user);
     auth_user->auth = NULL;
 
     /* client is going, so auth is not an issue at this point */
@@ -289,15 +497,26 @@ static void auth_remove_listener (auth_client *auth_user)
 }
 
 
-/* Called from auth thread to process any request for source client
- * authentication. Only applies to source clients, not relays.
+/* wrapper function for auth thread to drop listener connections
  */
-static void stream_auth_callback (auth_client *auth_user)
+static void auth_remove_listener (auth_client *auth_user)
 {
-    client_t *client = auth_user->client;
+    if (auth_user->auth->release_listener)
+    {
+        auth_user->auth->release_listener (auth_user);
+        if (auth_user->pending)
+        {
+            auth_user->process = auth_remove_listener_complete;
+            return;
+        }
+    }
+    auth_remove_listener_complete (auth_user);
+}
 
-    if (auth_user->auth->stream_auth)
-        auth_user->auth->stream_auth (auth_user);
+
+static void stream_auth_complete (auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
 
     if (client->flags & CLIENT_AUTHENTICATED)
         auth_postprocess_source (auth_user);
@@ -306,6 +525,24 @@ static void stream_auth_callback (auth_client *auth_user)
 }
 
 
+/* Called from auth thread to process any request for source client
+ * authentication. Only applies to source clients, not relays.
+ */
+static void stream_auth_callback (auth_client *auth_user)
+{
+    if (auth_user->auth->stream_auth)
+    {
+        auth_user->auth->stream_auth (auth_user);
+        if (auth_user->pending)
+        {
+            auth_user->process = stream_auth_complete;
+            return;
+        }
+    }
+    stream_auth_complete (auth_user);
+}
+
+
 /* Callback from auth thread to handle a stream start event, this applies
  * to both source clients and relays.
  */
@@ -315,6 +552,7 @@ static void stream_start_callback (auth_client *auth_user)
 
     if (auth->stream_start)
         auth->stream_start (auth_user);
+    auth_user->process = NULL;
 }
 
 
@@ -327,6 +565,19 @@ static void stream_end_callback (auth_client *auth_user)
 
     if (auth->stream_end)
         auth->stream_end (auth_user);
+    auth_user->process = NULL;
+}
+
+
+/* A request left pending by the auth backend has finished, so run the
+ * rest of the processing and drop it. Called from the auth thread.
+ */
+void auth_client_complete (auth_client *auth_user)
+{
+    auth_user->pending = 0;
+    if (auth_user->process)
+        auth_user->process (auth_user);
+    auth_client_free (auth_user);
 }
 
 
@@ -342,7 +593,7 @@ static void *auth_run_thread (void *arg)
     while (1)
     {
         thread_mutex_lock (&auth->lock);
-        if (auth->head)
+        if (auth->head && handler->in_flight < auth->inflight_limit)
         {
             auth_client *auth_user = auth->head;
 
@@ -361,8 +612,26 @@ static void *auth_run_thread (void *arg)
             if (auth_user->process)
                 auth_user->process (auth_user);
 
-            auth_client_free (auth_user);
+            if (auth_user->pending)
+            {
+                thread_mutex_lock (&auth->lock);
+                handler->in_flight++;
+                thread_mutex_unlock (&auth->lock);
+            }
+            else
+                auth_client_free (auth_user);
+
+            continue;
+        }
+        if (handler->in_flight)
+        {
+            int in_flight;
 
+            thread_mutex_unlock (&auth->lock);
+            in_flight = auth->run_pending (auth, handler->data);
+            thread_mutex_lock (&auth->lock);
+            handler->in_flight = in_flight;
+            thread_mutex_unlock (&auth->lock);
             continue;
         }
         handler->thread = NULL;
@@ -602,9 +871,34 @@ int auth_add_listener (const char *mount, client_t *client)
             if (mountinfo->auth && mountinfo->auth->authenticate)
             {
                 auth_client *auth_user;
+                char *cache_key, *cache_mount;
 
+                switch (auth_cache_check (mountinfo->auth, mount, client, &cache_key, &cache_mount))
+                {
+                    case 1:
+                        if (cache_mount)
+                        {
+                            ret = add_authenticated_listener (cache_mount, config_find_mount (config, cache_mount), client);
+                            free (cache_mount);
+                        }
+                        else
+                            ret = add_authenticated_listener (mount, mountinfo, client);
+                        config_release_config ();
+                        return ret;
+                    case -1:
+                        if (mountinfo->auth->rejected_mount)
+                        {
+                            mount = mountinfo->auth->rejected_mount;
+                            ret = add_authenticated_listener (mount, config_find_mount (config, mount), client);
+                            config_release_config ();
+                            return ret;
+                        }
+                        config_release_config ();
+                        return client_send_401 (client, mountinfo->auth->realm);
+                }
                 if (mountinfo->auth->running == 0 || mountinfo->auth->pending_count > 300)
                 {
+                    free (cache_key);
                     config_release_config ();
                     WARN0 ("too many clients awaiting authentication");
                     if (global.new_connections_slowdown < 10)
@@ -612,6 +906,7 @@ int auth_add_listener (const char *mount, client_t *client)
                     return client_send_403 (client, "busy, please try again later");
                 }
                 auth_user = auth_client_setup (mount, client);
+                auth_user->cache_key = cache_key;
                 auth_user->process = auth_new_listener;
                 client->flags &= ~CLIENT_ACTIVE;
                 DEBUG0 ("adding client for authentication");
@@ -644,7 +939,8 @@ int auth_release_listener (client_t *client, const char *mount, mount_proxy *mou
     {
         client_set_queue (client, NULL);
 
-        if (mount && mountinfo && mountinfo->auth && mountinfo->auth->release_listener)
+        if (mount && mountinfo && mountinfo->auth && mountinfo->auth->release_listener &&
+                (client->flags & CLIENT_AUTH_CACHED) == 0)
         {
             auth_client *auth_user = auth_client_setup (mount, client);
             client->flags &= ~CLIENT_ACTIVE;
@@ -716,10 +1012,15 @@ static int get_authenticator (auth_t *auth, config_options_t *options)
             auth->rejected_mount = (char*)xmlStrdup (XMLSTR(options->value));
         else if (strcmp(options->name, "handlers") == 0)
             auth->handlers = atoi (options->value);
+        else if (strcmp(options->name, "cache_ttl") == 0)
+            auth->cache_ttl = atoi (options->value);
+        else if (strcmp(options->name, "cache_negative_ttl") == 0)
+            auth->cache_negative_ttl = atoi (options->value);
         options = options->next;
     }
     if (auth->handlers < 1) auth->handlers = 3;
     if (auth->handlers > 100) auth->handlers = 100;
+    if (auth->inflight_limit < 1) auth->inflight_limit = 1;
     return 0;
 }
 
@@ -773,6 +1074,8 @@ int auth_get_authenticator (xmlNodePtr node, void *x)
     {
         auth->tailp = &auth->head;
         thread_mutex_create (&auth->lock);
+        if (auth->cache_ttl > 0 || auth->cache_negative_ttl > 0)
+            auth->cache = avl_tree_new (compare_cache_entry, NULL);
 
         /* allocate N threads */
         auth->handles = calloc (auth->handlers, sizeof (auth_thread_t));
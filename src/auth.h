@@ -24,6 +24,7 @@ typedef struct _auth_thread_t auth_thread_t;
 #include <libxml/tree.h>
 #include "client.h"
 #include "thread/thread.h"
+#include "avl/avl.h"
 
 typedef enum
 {
@@ -44,6 +45,12 @@ typedef struct auth_client_tag
     client_t    *client;
     struct auth_tag *auth;
     void        *thread_data;
+    char        *cache_key;
+    /* set by the auth backend when the result is its own answer, results
+     * from backend errors or back-off are not cached */
+    int         cacheable;
+    /* set by the auth backend when the request completes later on */
+    int         pending;
     void        (*process)(struct auth_client_tag *auth_user);
     struct auth_client_tag *next;
 } auth_client;
@@ -75,6 +82,13 @@ typedef struct auth_tag
     /* call to freeup any per auth thread data */
     void (*release_thread_data)(struct auth_tag *self, void *data);
 
+    /* for backends that leave requests pending, progress those on the
+     * handler and return how many are still in flight */
+    int (*run_pending)(struct auth_tag *self, void *data);
+
+    /* wake up a handler waiting in run_pending, new requests are queued */
+    void (*wakeup)(struct auth_tag *self, void *data);
+
     auth_result (*adduser)(struct auth_tag *auth, const char *username, const char *password);
     auth_result (*deleteuser)(struct auth_tag *auth, const char *username);
     auth_result (*listuser)(struct auth_tag *auth, xmlNodePtr srcnode);
@@ -85,6 +99,12 @@ typedef struct auth_tag
     int allow_duplicate_users;
     int drop_existing_listener;
     int handlers;
+    int inflight_limit;
+
+    /* cache of recent listener auth results, NULL if not enabled */
+    avl_tree *cache;
+    int cache_ttl;
+    int cache_negative_ttl;
 
     /* mountpoint to send unauthenticated listeners */
     char *rejected_mount;
@@ -123,6 +143,9 @@ int auth_stream_authenticate (client_t *client, const char *mount, struct _mount
 
 void auth_check_http (client_t *client);
 
+/* called by the auth backend when a pending request has completed */
+void auth_client_complete (auth_client *auth_user);
+
 #endif
 
 
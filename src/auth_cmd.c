@@ -19,6 +19,12 @@
  * password\n
  * a return code of 0 indicates a valid user, authentication failure if
  * otherwise
+ *
+ * With the persistent option, each auth handler starts the program once and
+ * keeps it running. Each request is written as a block of header lines
+ * ending with a blank line, and the program must write back its response
+ * headers, again ending with a blank line, for each one. Intro content is
+ * not available in this mode.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -38,6 +44,9 @@
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "auth.h"
 #include "source.h"
@@ -52,12 +61,15 @@
 typedef struct {
     char *listener_add;
     char *listener_remove;
+    int persistent;
 } auth_cmd;
 
 
 typedef struct
 {
     char *location;
+    pid_t helper;
+    int to_helper, from_helper;
     char errormsg [100];
 } auth_thread_data;
 
@@ -188,7 +200,8 @@ static void process_body (int fd, pid_t pid, auth_client *auth_user)
     }
 }
 
-static void get_response (int fd, auth_client *auth_user, pid_t pid)
+/* returns 1 if the response headers were read, 0 on timeout or error */
+static int get_response (int fd, auth_client *auth_user, pid_t pid, int persistent)
 {
     client_t *client = auth_user->client;
     refbuf_t *r = client->refbuf;
@@ -209,7 +222,7 @@ static void get_response (int fd, auth_client *auth_user, pid_t pid)
         {
             kill (pid, SIGTERM);
             WARN1 ("command timeout triggered for %s", auth_user->mount);
-            return;
+            return 0;
         }
         if (ret < 0)
             continue;
@@ -227,6 +240,11 @@ static void get_response (int fd, auth_client *auth_user, pid_t pid)
                 process_header (p, auth_user);
                 p = nl+1;
             } while (*p != '\n');
+            if (persistent)
+            {
+                client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
+                return 1;
+            }
             if (client->flags & CLIENT_HAS_INTRO_CONTENT)
             {
                 r->len = (buf+ret) - (blankline + 2);
@@ -236,33 +254,134 @@ static void get_response (int fd, auth_client *auth_user, pid_t pid)
                 client->refbuf->next = r;
             }
             process_body (fd, pid, auth_user);
-            return;
+            return 1;
         }
         buf += ret;
         remaining -= ret;
     }
-    return;
+    return 0;
 }
 
 
-static auth_result auth_cmd_client (auth_client *auth_user)
+/* start the program for the handler, left running for later requests */
+static int helper_start (auth_cmd *cmd, auth_thread_data *atd)
 {
     int infd[2], outfd[2];
     pid_t pid;
-    client_t *client = auth_user->client;
-    auth_t *auth = auth_user->auth;
-    auth_cmd *cmd = auth->state;
+
+    if (pipe (infd) < 0)
+    {
+        ERROR1 ("pipe failed code %d", errno);
+        return -1;
+    }
+    if (pipe (outfd) < 0)
+    {
+        ERROR1 ("pipe failed code %d", errno);
+        close (infd[0]);
+        close (infd[1]);
+        return -1;
+    }
+    pid = fork();
+    switch (pid)
+    {
+        case 0: /* child */
+            {
+                sigset_t ss;
+                long fd, max = sysconf (_SC_OPEN_MAX);
+
+                dup2 (outfd[0], 0);
+                dup2 (infd[1], 1);
+                /* do not hold on to any other descriptors, sockets etc */
+                for (fd = 3; fd < max; fd++)
+                    close (fd);
+                sigemptyset (&ss);
+                sigprocmask (SIG_SETMASK, &ss, NULL);
+                signal (SIGPIPE, SIG_DFL);
+                execl (cmd->listener_add, cmd->listener_add, NULL);
+                _exit (-1);
+            }
+        case -1:
+            ERROR2 ("unable to fork \"%s\" (%s)", cmd->listener_add, strerror (errno));
+            close (infd[0]);
+            close (infd[1]);
+            close (outfd[0]);
+            close (outfd[1]);
+            return -1;
+        default: /* parent */
+            close (outfd[0]);
+            close (infd[1]);
+            atd->helper = pid;
+            atd->to_helper = outfd[1];
+            atd->from_helper = infd[0];
+            INFO2 ("started helper %ld for %s", (long)pid, cmd->listener_add);
+    }
+    return 0;
+}
+
+
+static void helper_stop (auth_thread_data *atd)
+{
+    int i;
+
+    if (atd->helper == 0)
+        return;
+    close (atd->to_helper);
+    close (atd->from_helper);
+    kill (atd->helper, SIGTERM);
+    for (i = 0; i < 20; i++)
+    {
+        if (waitpid (atd->helper, NULL, WNOHANG) != 0)
+            break;
+        thread_sleep (50000);
+    }
+    if (i == 20)
+    {
+        kill (atd->helper, SIGKILL);
+        waitpid (atd->helper, NULL, 0);
+    }
+    DEBUG1 ("helper %ld stopped", (long)atd->helper);
+    atd->helper = 0;
+}
+
+
+/* pass the request to the running helper, starting it if need be.
+ * returns 1 if the helper responded */
+static int helper_request (auth_client *auth_user, const char *str, int len)
+{
+    auth_cmd *cmd = auth_user->auth->state;
     auth_thread_data *atd = auth_user->thread_data;
-    int status, len;
-    const char *qargs;
-    char str[512];
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        if (atd->helper == 0 && helper_start (cmd, atd) < 0)
+            return 0;
+        if (write (atd->to_helper, str, len) == len)
+            break;
+        /* helper may have exited since the last request, so try a new one */
+        helper_stop (atd);
+    }
+    if (atd->helper == 0)
+        return 0;
+    if (get_response (atd->from_helper, auth_user, atd->helper, 1))
+        return 1;
+    helper_stop (atd);
+    return 0;
+}
+
+
+/* run the program for this request only, returns 1 if it responded */
+static int cmd_exec (auth_client *auth_user, const char *str, int len)
+{
+    int infd[2], outfd[2];
+    pid_t pid;
+    auth_cmd *cmd = auth_user->auth->state;
+    int status, ret = 0;
 
-    if (auth->running == 0)
-        return AUTH_FAILED;
     if (pipe (infd) < 0 || pipe (outfd) < 0)
     {
         ERROR1 ("pipe failed code %d", errno);
-        return AUTH_FAILED;
+        return 0;
     }
     pid = fork();
     switch (pid)
@@ -280,31 +399,58 @@ static auth_result auth_cmd_client (auth_client *auth_user)
         default: /* parent */
             close (outfd[0]);
             close (infd[1]);
-            qargs = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
-            len = snprintf (str, sizeof(str),
-                    "Mountpoint: %s%s\n"
-                    "User: %s\n"
-                    "Pass: %s\n"
-                    "IP: %s\n"
-                    "Agent: %s\n\n"
-                    , auth_user->mount, qargs ? qargs : "",
-                    client->username ? client->username : "",
-                    client->password ? client->password : "",
-                    client->connection.ip,
-                    httpp_getvar (client->parser, "user-agent"));
             write (outfd[1], str, len);
             close (outfd[1]);
-            get_response (infd[0], auth_user, pid);
+            ret = get_response (infd[0], auth_user, pid, 0);
             close (infd[0]);
             DEBUG1 ("Waiting on pid %ld", (long)pid);
             if (waitpid (pid, &status, 0) < 0)
-            {
                 DEBUG1("waitpid error %s", strerror(errno));
-                break;
-            }
-            if (client->flags & CLIENT_AUTHENTICATED)
-                return AUTH_OK;
     }
+    return ret;
+}
+
+
+static auth_result auth_cmd_client (auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_t *auth = auth_user->auth;
+    auth_cmd *cmd = auth->state;
+    auth_thread_data *atd = auth_user->thread_data;
+    int len;
+    const char *qargs;
+    char str[4096];
+
+    if (auth->running == 0)
+        return AUTH_FAILED;
+    /* the details are passed as lines so they cannot contain line breaks */
+    if ((client->username && strpbrk (client->username, "\r\n")) ||
+            (client->password && strpbrk (client->password, "\r\n")))
+    {
+        INFO1 ("listener %s has line breaks in user/pass", client->connection.ip);
+        return AUTH_FAILED;
+    }
+    atd->errormsg[0] = '\0';
+    qargs = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
+    len = snprintf (str, sizeof(str),
+            "Mountpoint: %s%s\n"
+            "User: %s\n"
+            "Pass: %s\n"
+            "IP: %s\n"
+            "Agent: %s\n\n"
+            , auth_user->mount, qargs ? qargs : "",
+            client->username ? client->username : "",
+            client->password ? client->password : "",
+            client->connection.ip,
+            httpp_getvar (client->parser, "user-agent"));
+    if (len < 0 || len >= (int)sizeof(str))
+        return AUTH_FAILED;
+    if (cmd->persistent)
+        auth_user->cacheable = helper_request (auth_user, str, len);
+    else
+        auth_user->cacheable = cmd_exec (auth_user, str, len);
+    if (client->flags & CLIENT_AUTHENTICATED)
+        return AUTH_OK;
     if (atd->errormsg[0])
     {
         INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, cmd->listener_add, atd->errormsg);
@@ -351,6 +497,8 @@ static void *alloc_thread_data (auth_t *auth)
 static void release_thread_data (auth_t *auth, void *thread_data)
 {
     auth_thread_data *atd = thread_data;
+    helper_stop (atd);
+    free (atd->location);
     free (atd);
     DEBUG1 ("...handler destroyed for %s", auth->mount);
 }
@@ -375,6 +523,8 @@ int auth_get_cmd_auth (auth_t *authenticator, config_options_t *options)
             state->listener_add = strdup (options->value);
         if (strcmp (options->name, "listener_remove") == 0)
             state->listener_remove = strdup (options->value);
+        if (strcmp (options->name, "persistent") == 0)
+            state->persistent = strcasecmp (options->value, "yes") ? 0 : 1;
         options = options->next;
     }
     if (state->listener_add == NULL)
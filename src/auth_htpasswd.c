@@ -207,6 +207,8 @@ static auth_result htpasswd_auth (auth_client *auth_user)
 
     htpasswd_recheckfile (htpasswd);
 
+    /* the answer comes from the file, so it can be cached */
+    auth_user->cacheable = 1;
     thread_rwlock_rlock (&htpasswd->file_rwlock);
     entry.name = client->username;
     if (avl_get_by_key (htpasswd->users, &entry, &result) == 0)
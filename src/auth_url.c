@@ -61,6 +61,10 @@
  * As admin requests can come in for a stream (eg metadata update) these requests
  * can be issued while stream is active. For these &admin=1 is added to the POST
  * details.
+ *
+ * Each auth handler runs its requests through a curl multi handle so that
+ * many can be in flight at once, up to requests_per_handler (default 100),
+ * each request limited by the timeout setting.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -91,13 +95,27 @@
 #include "logging.h"
 #define CATMODULE "auth_url"
 
-typedef struct
+/* a request in flight, the easy handles are kept for reuse by the handler */
+typedef struct auth_url_request
 {
-    int id;
     CURL *curl;
-    char *server_id;
+    auth_client *auth_user;
+    const char *url;
+    char *userpwd;
     char *location;
+    void (*finish)(struct auth_url_request *req, CURLcode res);
+    struct auth_url_request *next;
     char errormsg [CURL_ERROR_SIZE];
+    char post [4096];
+} auth_url_request;
+
+typedef struct
+{
+    int id;
+    CURLM *multi;
+    char *server_id;
+    int in_flight;
+    auth_url_request *spare;
 } auth_thread_data;
 
 typedef struct {
@@ -161,10 +179,10 @@ static int my_getpass(void *client, char *prompt, char *buffer, int buflen)
 
 static int handle_returned_header (void *ptr, size_t size, size_t nmemb, void *stream)
 {
-    auth_client *auth_user = stream;
+    auth_url_request *req = stream;
+    auth_client *auth_user = req->auth_user;
     unsigned bytes = size * nmemb;
     client_t *client = auth_user->client;
-    auth_thread_data *atd = auth_user->thread_data;
 
     if (bytes <= 1) // we should have the EOL at least
         return bytes;
@@ -182,8 +200,8 @@ static int handle_returned_header (void *ptr, size_t size, size_t nmemb, void *s
             if (retcode == 403)
             {
                 char *p = strchr (ptr, ' ') + 1;
-                snprintf (atd->errormsg, sizeof(atd->errormsg), "%s", p);
-                p = strchr (atd->errormsg, '\r');
+                snprintf (req->errormsg, sizeof(req->errormsg), "%s", p);
+                p = strchr (req->errormsg, '\r');
                 if (p) *p='\0';
             }
         }
@@ -217,10 +235,10 @@ static int handle_returned_header (void *ptr, size_t size, size_t nmemb, void *s
         if (strncasecmp (ptr, "icecast-auth-message: ", 22) == 0)
         {
             char *eol;
-            snprintf (atd->errormsg, sizeof (atd->errormsg), "%s", (char*)ptr+22);
-            eol = strchr (atd->errormsg, '\r');
+            snprintf (req->errormsg, sizeof (req->errormsg), "%s", (char*)ptr+22);
+            eol = strchr (req->errormsg, '\r');
             if (eol == NULL)
-                eol = strchr (atd->errormsg, '\n');
+                eol = strchr (req->errormsg, '\n');
             if (eol)
                 *eol = '\0';
         }
@@ -238,9 +256,9 @@ static int handle_returned_header (void *ptr, size_t size, size_t nmemb, void *s
         if (strncasecmp (ptr, "Location: ", 10) == 0)
         {
             int len = strcspn ((char*)ptr+10, "\r\n");
-            free (atd->location);
-            atd->location = malloc (len+1);
-            snprintf (atd->location, len+1, "%s", (char *)ptr+10);
+            free (req->location);
+            req->location = malloc (len+1);
+            snprintf (req->location, len+1, "%s", (char *)ptr+10);
         }
         if (strncasecmp (ptr, "Mountpoint: ", 12) == 0)
         {
@@ -273,9 +291,9 @@ static int handle_returned_header (void *ptr, size_t size, size_t nmemb, void *s
 
 static int handle_returned_data (void *ptr, size_t size, size_t nmemb, void *stream)
 {
-    auth_client *auth_user = stream;
+    auth_url_request *req = stream;
     unsigned bytes = size * nmemb;
-    client_t *client = auth_user->client;
+    client_t *client = req->auth_user->client;
 
     if (client && client->respcode == 0 &&
          client->flags & CLIENT_HAS_INTRO_CONTENT)
@@ -314,15 +332,139 @@ static int handle_returned_data (void *ptr, size_t size, size_t nmemb, void *str
 }
 
 
+static void url_request_release (auth_thread_data *atd, auth_url_request *req)
+{
+    free (req->userpwd);
+    req->userpwd = NULL;
+    free (req->location);
+    req->location = NULL;
+    req->auth_user = NULL;
+    req->next = atd->spare;
+    atd->spare = req;
+}
+
+
+/* get a request for the auth_user, reusing an easy handle previously
+ * used on this handler if available.
+ */
+static auth_url_request *url_request_get (auth_client *auth_user, const char *target)
+{
+    auth_thread_data *atd = auth_user->thread_data;
+    auth_url_request *req = atd->spare;
+
+    if (req)
+        atd->spare = req->next;
+    else
+    {
+        auth_url *url = auth_user->auth->state;
+
+        req = calloc (1, sizeof (auth_url_request));
+        req->curl = curl_easy_init ();
+        curl_easy_setopt (req->curl, CURLOPT_USERAGENT, atd->server_id);
+        curl_easy_setopt (req->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
+        curl_easy_setopt (req->curl, CURLOPT_WRITEFUNCTION, handle_returned_data);
+        curl_easy_setopt (req->curl, CURLOPT_WRITEHEADER, req);
+        curl_easy_setopt (req->curl, CURLOPT_WRITEDATA, req);
+        curl_easy_setopt (req->curl, CURLOPT_PRIVATE, req);
+        curl_easy_setopt (req->curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt (req->curl, CURLOPT_TIMEOUT, (long)url->timeout);
+#ifdef CURLOPT_PASSWDFUNCTION
+        curl_easy_setopt (req->curl, CURLOPT_PASSWDFUNCTION, my_getpass);
+#endif
+        curl_easy_setopt (req->curl, CURLOPT_ERRORBUFFER, &req->errormsg[0]);
+        curl_easy_setopt (req->curl, CURLOPT_FOLLOWLOCATION, 1);
+#ifdef CURLOPT_POSTREDIR
+        curl_easy_setopt (req->curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
+#endif
+    }
+    req->next = NULL;
+    req->auth_user = auth_user;
+    req->url = target;
+    req->errormsg[0] = '\0';
+    return req;
+}
+
+
+/* setup the user/pass to send. If no user/pass is configured then the
+ * client details are used if client is passed.
+ */
+static void url_request_userpwd (auth_url_request *req, client_t *client)
+{
+    auth_url *url = req->auth_user->auth->state;
+    const char *userpwd = "";
+
+    /* url may have user/pass but libcurl may need to clear any existing settings */
+    if (strchr (req->url, '@') == NULL)
+    {
+        if (url->userpwd)
+            userpwd = url->userpwd;
+        else if (client && client->username && client->password)
+        {
+            /* auth'd requests may not have a user/pass, but may use query args */
+            int len = strlen (client->username) + strlen (client->password) + 2;
+            req->userpwd = malloc (len);
+            snprintf (req->userpwd, len, "%s:%s", client->username, client->password);
+            userpwd = req->userpwd;
+        }
+    }
+    curl_easy_setopt (req->curl, CURLOPT_USERPWD, userpwd);
+}
+
+
+/* add the request to those in flight on the handler, the auth_user is left
+ * pending until the finish routine has been run on the response.
+ */
+static void url_request_submit (auth_url_request *req, void (*finish)(auth_url_request *req, CURLcode res))
+{
+    auth_client *auth_user = req->auth_user;
+    auth_thread_data *atd = auth_user->thread_data;
+
+    req->finish = finish;
+    curl_easy_setopt (req->curl, CURLOPT_URL, req->url);
+    curl_easy_setopt (req->curl, CURLOPT_POSTFIELDS, req->post);
+    if (curl_multi_add_handle (atd->multi, req->curl) != CURLM_OK)
+    {
+        snprintf (req->errormsg, sizeof (req->errormsg), "request could not be started");
+        finish (req, CURLE_FAILED_INIT);
+        url_request_release (atd, req);
+        return;
+    }
+    atd->in_flight++;
+    auth_user->pending = 1;
+    DEBUG2 ("handler %d sending request, %d in flight", auth_user->handler, atd->in_flight);
+}
+
+
+/* general completion, just report any failure */
+static void url_request_done (auth_url_request *req, CURLcode res)
+{
+    if (res)
+        WARN2 ("auth to server %s failed with %s", req->url, req->errormsg);
+}
+
+
+static void url_remove_listener_done (auth_url_request *req, CURLcode res)
+{
+    auth_url *url = req->auth_user->auth->state;
+
+    if (res)
+    {
+        WARN2 ("auth to server %s failed with %s", url->removeurl, req->errormsg);
+        url->stop_req_until = time (NULL) + url->stop_req_duration; /* prevent further attempts for a while */
+    }
+    else
+        DEBUG1 ("...handler %d request complete", req->auth_user->handler);
+}
+
+
 static auth_result url_remove_listener (auth_client *auth_user)
 {
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
-    auth_thread_data *atd = auth_user->thread_data;
+    auth_url_request *req;
     time_t now = time(NULL), duration = now - client->connection.con_time;
     char *username, *password, *mount, *server, *ipaddr;
     const char *qargs;
-    char *userpwd = NULL, post [4096];
 
     if (url->removeurl == NULL)
         return AUTH_OK;
@@ -332,6 +474,7 @@ static auth_result url_remove_listener (auth_client *auth_user)
             return AUTH_FAILED;
         url->stop_req_until = 0;
     }
+    req = url_request_get (auth_user, url->removeurl);
     server = util_url_escape (auth_user->hostname);
 
     if (client->username)
@@ -346,11 +489,11 @@ static auth_result url_remove_listener (auth_client *auth_user)
 
     /* get the full uri (with query params if available) */
     qargs = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
-    snprintf (post, sizeof post, "%s%s", auth_user->mount, qargs ? qargs : "");
-    mount = util_url_escape (post);
+    snprintf (req->post, sizeof req->post, "%s%s", auth_user->mount, qargs ? qargs : "");
+    mount = util_url_escape (req->post);
     ipaddr = util_url_escape (client->connection.ip);
 
-    snprintf (post, sizeof (post),
+    snprintf (req->post, sizeof (req->post),
             "action=listener_remove&server=%s&port=%d&client=%lu&mount=%s"
             "&user=%s&pass=%s&ip=%s&duration=%lu",
             server, auth_user->port, client->connection.id, mount, username,
@@ -361,46 +504,72 @@ static auth_result url_remove_listener (auth_client *auth_user)
     free (username);
     free (password);
 
-    if (strchr (url->removeurl, '@') == NULL)
+    url_request_userpwd (req, client);
+    url_request_submit (req, url_remove_listener_done);
+
+    return AUTH_OK;
+}
+
+
+static void url_add_listener_done (auth_url_request *req, CURLcode res)
+{
+    auth_client *auth_user = req->auth_user;
+    client_t *client = auth_user->client;
+    auth_url *url = auth_user->auth->state;
+    struct build_intro_contents *x = (void *)client->refbuf->data;
+
+    if (client->flags & CLIENT_AUTHENTICATED)
     {
-        if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
-        else
+        if (client->flags & CLIENT_HAS_INTRO_CONTENT)
         {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password)
-            {
-                int len = strlen (client->username) + strlen (client->password) + 2;
-                userpwd = malloc (len);
-                snprintf (userpwd, len, "%s:%s", client->username, client->password);
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, userpwd);
-            }
-            else
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+            client->refbuf->next = x->head;
+            DEBUG3 ("intro (%d) received %lu for %s", x->type, (unsigned long)x->intro_len, client->connection.ip);
         }
+        if (x->head == NULL)
+            client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
+        x->head = NULL;
     }
-    else
-    {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    }
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->removeurl);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
-
-    DEBUG1 ("...handler %d sending request", auth_user->handler);
-    if (curl_easy_perform (atd->curl))
+    if (res)
     {
-        WARN2 ("auth to server %s failed with %s", url->removeurl, atd->errormsg);
         url->stop_req_until = time (NULL) + url->stop_req_duration; /* prevent further attempts for a while */
+        WARN2 ("auth to server %s failed with %s", url->addurl, req->errormsg);
+        INFO1 ("will not auth new listeners for %d seconds", url->stop_req_duration);
+        if (url->presume_innocent)
+            client->flags |= CLIENT_AUTHENTICATED;
     }
     else
-        DEBUG1 ("...handler %d request complete", auth_user->handler);
-
-    free (userpwd);
+    {
+        long code = 0;
 
-    return AUTH_OK;
+        /* only an answer from the auth server itself is worth caching */
+        curl_easy_getinfo (req->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code > 0 && code < 500)
+            auth_user->cacheable = 1;
+    }
+    /* better cleanup memory */
+    while (x->head)
+    {
+        refbuf_t *n = x->head;
+        x->head = n->next;
+        n->next = NULL;
+        refbuf_release (n);
+    }
+    if (x->type)
+        mpeg_cleanup (&x->sync);
+    if (req->location)
+    {
+        client_send_302 (client, req->location);
+        auth_user->client = NULL;
+    }
+    else if (req->errormsg[0])
+    {
+        INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, url->addurl, req->errormsg);
+        if (atoi (req->errormsg) == 403)
+        {
+            auth_user->client = NULL;
+            client_send_403 (client, req->errormsg+4);
+        }
+    }
 }
 
 
@@ -409,27 +578,29 @@ static auth_result url_add_listener (auth_client *auth_user)
     client_t *client = auth_user->client;
     auth_t *auth = auth_user->auth;
     auth_url *url = auth->state;
-    auth_thread_data *atd = auth_user->thread_data;
-    int res = 0, port, ret = AUTH_FAILED;
+    auth_url_request *req;
+    int port;
     const char *agent, *qargs;
     char *user_agent, *username, *password;
     char *mount, *ipaddr, *server;
     ice_config_t *config;
     struct build_intro_contents *x;
-    char *userpwd = NULL, post [4096];
 
     if (url->addurl == NULL)
         return AUTH_OK;
 
     if (url->stop_req_until)
     {
-        if (url->presume_innocent)
-            client->flags |= CLIENT_AUTHENTICATED;
         if (url->stop_req_until >= time(NULL))
+        {
+            if (url->presume_innocent)
+                client->flags |= CLIENT_AUTHENTICATED;
             return AUTH_FAILED;
+        }
         url->stop_req_until = 0;
     }
 
+    req = url_request_get (auth_user, url->addurl);
     config = config_get_config ();
     server = util_url_escape (config->hostname);
     port = config->port;
@@ -449,11 +620,11 @@ static auth_result url_add_listener (auth_client *auth_user)
 
     /* get the full uri (with query params if available) */
     qargs = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
-    snprintf (post, sizeof post, "%s%s", auth_user->mount, qargs ? qargs : "");
-    mount = util_url_escape (post);
+    snprintf (req->post, sizeof req->post, "%s%s", auth_user->mount, qargs ? qargs : "");
+    mount = util_url_escape (req->post);
     ipaddr = util_url_escape (client->connection.ip);
 
-    snprintf (post, sizeof (post),
+    snprintf (req->post, sizeof (req->post),
             "action=listener_add&server=%s&port=%d&client=%lu&mount=%s"
             "&user=%s&pass=%s&ip=%s&agent=%s",
             server, port, client->connection.id, mount, username,
@@ -465,36 +636,7 @@ static auth_result url_add_listener (auth_client *auth_user)
     free (password);
     free (ipaddr);
 
-    if (strchr (url->addurl, '@') == NULL)
-    {
-        if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
-        else
-        {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password)
-            {
-                int len = strlen (client->username) + strlen (client->password) + 2;
-                userpwd = malloc (len);
-                snprintf (userpwd, len, "%s:%s", client->username, client->password);
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, userpwd);
-            }
-            else
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-        }
-    }
-    else
-    {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    }
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->addurl);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
-    atd->errormsg[0] = '\0';
-    free (atd->location);
-    atd->location = NULL;
+    url_request_userpwd (req, client);
     /* setup in case intro data is returned */
     x = (void *)client->refbuf->data;
     x->type = 0;
@@ -502,62 +644,8 @@ static auth_result url_add_listener (auth_client *auth_user)
     x->intro_len = 0;
     x->tailp = &x->head;
 
-    DEBUG1 ("handler %d sending request", auth_user->handler);
-    res = curl_easy_perform (atd->curl);
-    DEBUG1 ("handler %d request finished", auth_user->handler);
-
-    free (userpwd);
-
-    if (client->flags & CLIENT_AUTHENTICATED)
-    {
-        if (client->flags & CLIENT_HAS_INTRO_CONTENT)
-        {
-            client->refbuf->next = x->head;
-            DEBUG3 ("intro (%d) received %lu for %s", x->type, (unsigned long)x->intro_len, client->connection.ip);
-        }
-        if (x->head == NULL)
-            client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
-        x->head = NULL;
-        ret = AUTH_OK;
-    }
-    if (res)
-    {
-        url->stop_req_until = time (NULL) + url->stop_req_duration; /* prevent further attempts for a while */
-        WARN2 ("auth to server %s failed with %s", url->addurl, atd->errormsg);
-        INFO1 ("will not auth new listeners for %d seconds", url->stop_req_duration);
-        if (url->presume_innocent)
-        {
-            client->flags |= CLIENT_AUTHENTICATED;
-            ret = AUTH_OK;
-        }
-    }
-    /* better cleanup memory */
-    while (x->head)
-    {
-        refbuf_t *n = x->head;
-        x->head = n->next;
-        n->next = NULL;
-        refbuf_release (n);
-    }
-    if (x->type)
-        mpeg_cleanup (&x->sync);
-    if (atd->location)
-    {
-        client_send_302 (client, atd->location);
-        auth_user->client = NULL;
-        free (atd->location);
-        atd->location = NULL;
-    }
-    else if (atd->errormsg[0])
-    {
-        INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, url->addurl, atd->errormsg);
-        if (atoi (atd->errormsg) == 403)
-        {
-            auth_user->client = NULL;
-            client_send_403 (client, atd->errormsg+4);
-        }
-    }
-    return ret;
+    url_request_submit (req, url_add_listener_done);
+    return AUTH_OK;
 }
 
 
@@ -569,8 +657,7 @@ static void url_stream_start (auth_client *auth_user)
     char *mount, *server, *ipaddr;
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
-    auth_thread_data *atd = auth_user->thread_data;
-    char post [4096];
+    auth_url_request *req = url_request_get (auth_user, url->stream_start);
 
     server = util_url_escape (auth_user->hostname);
     mount = util_url_escape (auth_user->mount);
@@ -579,30 +666,14 @@ static void url_stream_start (auth_client *auth_user)
     else
         ipaddr = strdup("");
 
-    snprintf (post, sizeof (post),
+    snprintf (req->post, sizeof (req->post),
             "action=mount_add&mount=%s&server=%s&port=%d&ip=%s", mount, server, auth_user->port, ipaddr);
     free (ipaddr);
     free (server);
     free (mount);
 
-    if (strchr (url->stream_start, '@') == NULL)
-    {
-        if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
-        else
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    }
-    else
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->stream_start);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
-
-    DEBUG1 ("handler %d sending request", auth_user->handler);
-    if (curl_easy_perform (atd->curl))
-        WARN2 ("auth to server %s failed with %s", url->stream_start, atd->errormsg);
-    DEBUG1 ("handler %d request finished", auth_user->handler);
+    url_request_userpwd (req, NULL);
+    url_request_submit (req, url_request_done);
 }
 
 
@@ -611,8 +682,7 @@ static void url_stream_end (auth_client *auth_user)
     char *mount, *server, *ipaddr;
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
-    auth_thread_data *atd = auth_user->thread_data;
-    char post [4096];
+    auth_url_request *req = url_request_get (auth_user, url->stream_end);
 
     server = util_url_escape (auth_user->hostname);
     mount = util_url_escape (auth_user->mount);
@@ -621,30 +691,14 @@ static void url_stream_end (auth_client *auth_user)
     else
         ipaddr = strdup("");
 
-    snprintf (post, sizeof (post),
+    snprintf (req->post, sizeof (req->post),
             "action=mount_remove&mount=%s&server=%s&port=%d&ip=%s", mount, server, auth_user->port, ipaddr);
     free (ipaddr);
     free (server);
     free (mount);
 
-    if (strchr (url->stream_end, '@') == NULL)
-    {
-        if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
-        else
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    }
-    else
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->stream_end);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
-
-    DEBUG1 ("handler %d sending request", auth_user->handler);
-    if (curl_easy_perform (atd->curl))
-        WARN2 ("auth to server %s failed with %s", url->stream_end, atd->errormsg);
-    DEBUG1 ("handler %d request finished", auth_user->handler);
+    url_request_userpwd (req, NULL);
+    url_request_submit (req, url_request_done);
 }
 
 
@@ -652,23 +706,9 @@ static void url_stream_auth (auth_client *auth_user)
 {
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
-    auth_thread_data *atd = auth_user->thread_data;
+    auth_url_request *req = url_request_get (auth_user, url->stream_auth);
     char *mount, *host, *user, *pass, *ipaddr, *admin="";
-    char post [4096];
 
-    if (strchr (url->stream_auth, '@') == NULL)
-    {
-        if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
-        else
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    }
-    else
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->stream_auth);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
     if (strcmp (auth_user->mount, httpp_getvar (client->parser, HTTPP_VAR_URI)) != 0)
         admin = "&admin=1";
     mount = util_url_escape (auth_user->mount);
@@ -677,7 +717,7 @@ static void url_stream_auth (auth_client *auth_user)
     pass = util_url_escape (client->password);
     ipaddr = util_url_escape (client->connection.ip);
 
-    snprintf (post, sizeof (post),
+    snprintf (req->post, sizeof (req->post),
             "action=stream_auth&mount=%s&ip=%s&server=%s&port=%d&user=%s&pass=%s%s",
             mount, ipaddr, host, auth_user->port, user, pass, admin);
     free (ipaddr);
@@ -687,8 +727,59 @@ static void url_stream_auth (auth_client *auth_user)
     free (host);
 
     client->flags &= ~CLIENT_AUTHENTICATED;
-    if (curl_easy_perform (atd->curl))
-        WARN2 ("auth to server %s failed with %s", url->stream_auth, atd->errormsg);
+    url_request_userpwd (req, NULL);
+    url_request_submit (req, url_request_done);
+}
+
+
+/* run the requests in flight on the handler, waiting for a short time for
+ * any activity. Completed requests are processed here.
+ */
+static int url_run_pending (auth_t *auth, void *thread_data)
+{
+    auth_thread_data *atd = thread_data;
+    CURLMsg *msg;
+    int running, remaining;
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_poll (atd->multi, NULL, 0, 1000, NULL);
+#else
+    curl_multi_wait (atd->multi, NULL, 0, 100, NULL);
+#endif
+    curl_multi_perform (atd->multi, &running);
+
+    while ((msg = curl_multi_info_read (atd->multi, &remaining)))
+    {
+        auth_url_request *req;
+        auth_client *auth_user;
+        CURLcode res;
+        char *priv = NULL;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        res = msg->data.result;
+        curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        req = (auth_url_request *)priv;
+        curl_multi_remove_handle (atd->multi, req->curl);
+        atd->in_flight--;
+
+        auth_user = req->auth_user;
+        DEBUG2 ("handler %d request finished, %d in flight", auth_user->handler, atd->in_flight);
+        req->finish (req, res);
+        url_request_release (atd, req);
+        auth_client_complete (auth_user);
+    }
+    return atd->in_flight;
+}
+
+
+/* new requests are queued, so get the handler out of the poll */
+static void url_wakeup (auth_t *auth, void *thread_data)
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+    auth_thread_data *atd = thread_data;
+    curl_multi_wakeup (atd->multi);
+#endif
 }
 
 
@@ -712,23 +803,9 @@ static void *alloc_thread_data (auth_t *auth)
 {
     auth_thread_data *atd = calloc (1, sizeof (auth_thread_data));
     ice_config_t *config = config_get_config_unlocked();
-    auth_url *url = auth->state;
     atd->server_id = strdup (config->server_id);
 
-    atd->curl = curl_easy_init ();
-    curl_easy_setopt (atd->curl, CURLOPT_USERAGENT, atd->server_id);
-    curl_easy_setopt (atd->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEFUNCTION, handle_returned_data);
-    curl_easy_setopt (atd->curl, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt (atd->curl, CURLOPT_TIMEOUT, (long)url->timeout);
-#ifdef CURLOPT_PASSWDFUNCTION
-    curl_easy_setopt (atd->curl, CURLOPT_PASSWDFUNCTION, my_getpass);
-#endif
-    curl_easy_setopt (atd->curl, CURLOPT_ERRORBUFFER, &atd->errormsg[0]);
-    curl_easy_setopt (atd->curl, CURLOPT_FOLLOWLOCATION, 1);
-#ifdef CURLOPT_POSTREDIR
-    curl_easy_setopt (atd->curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
-#endif
+    atd->multi = curl_multi_init ();
     INFO0 ("...handler data initialized");
     return atd;
 }
@@ -737,7 +814,15 @@ static void *alloc_thread_data (auth_t *auth)
 static void release_thread_data (auth_t *auth, void *thread_data)
 {
     auth_thread_data *atd = thread_data;
-    curl_easy_cleanup (atd->curl);
+
+    while (atd->spare)
+    {
+        auth_url_request *req = atd->spare;
+        atd->spare = req->next;
+        curl_easy_cleanup (req->curl);
+        free (req);
+    }
+    curl_multi_cleanup (atd->multi);
     free (atd->server_id);
     free (atd);
     DEBUG1 ("...handler destroyed for %s", auth->mount);
@@ -754,6 +839,9 @@ int auth_get_url_auth (auth_t *authenticator, config_options_t *options)
     authenticator->listuser = auth_url_listuser;
     authenticator->alloc_thread_data = alloc_thread_data;
     authenticator->release_thread_data = release_thread_data;
+    authenticator->run_pending = url_run_pending;
+    authenticator->wakeup = url_wakeup;
+    authenticator->inflight_limit = 100;
 
     url_info = calloc(1, sizeof(auth_url));
     url_info->auth_header = strdup ("icecast-auth-user:");
@@ -817,6 +905,11 @@ int auth_get_url_auth (auth_t *authenticator, config_options_t *options)
             int timeout = atoi (options->value);
             url_info->timeout = timeout > 0 ? timeout : 1;
         }
+        if (strcmp(options->name, "requests_per_handler") == 0)
+        {
+            int count = atoi (options->value);
+            authenticator->inflight_limit = count > 0 ? (count < 1000 ? count : 1000) : 1;
+        }
         if (strcmp(options->name, "on_error_wait") == 0)
         {
             int seconds = atoi (options->value);
@@ -39,6 +39,7 @@
 #define CONFIG_DEFAULT_CLIENT_LIMIT 256
 #define CONFIG_DEFAULT_SOURCE_LIMIT 16
 #define CONFIG_DEFAULT_QUEUE_SIZE_LIMIT (500*1024)
+#define CONFIG_DEFAULT_SEND_BATCH_SIZE 16384
 #define CONFIG_DEFAULT_BURST_SIZE (64*1024)
 #define CONFIG_DEFAULT_CLIENT_TIMEOUT 30
 #define CONFIG_DEFAULT_HEADER_TIMEOUT 15
@@ -514,6 +515,8 @@ static void _set_defaults(ice_config_t *configuration)
     configuration->source_limit = CONFIG_DEFAULT_SOURCE_LIMIT;
     configuration->queue_size_limit = CONFIG_DEFAULT_QUEUE_SIZE_LIMIT;
     configuration->workers_count = 1;
+    configuration->accept_threads = 1;
+    configuration->send_batch_size = CONFIG_DEFAULT_SEND_BATCH_SIZE;
     configuration->client_timeout = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     configuration->header_timeout = CONFIG_DEFAULT_HEADER_TIMEOUT;
     configuration->source_timeout = CONFIG_DEFAULT_SOURCE_TIMEOUT;
@@ -1141,6 +1144,8 @@ static int _parse_limits (xmlNodePtr node, void *arg)
         { "min-queue-size", config_get_int,    &config->min_queue_size },
         { "burst-size",     config_get_int,    &config->burst_size },
         { "workers",        config_get_int,    &config->workers_count },
+        { "accept-threads", config_get_int,    &config->accept_threads },
+        { "send-batch-size",config_get_int,    &config->send_batch_size },
         { "client-timeout", config_get_int,    &config->client_timeout },
         { "header-timeout", config_get_int,    &config->header_timeout },
         { "source-timeout", config_get_int,    &config->source_timeout },
@@ -1151,6 +1156,10 @@ static int _parse_limits (xmlNodePtr node, void *arg)
         return -1;
     if (config->workers_count < 1)   config->workers_count = 1;
     if (config->workers_count > 400) config->workers_count = 400;
+    if (config->accept_threads < 1)  config->accept_threads = 1;
+    if (config->accept_threads > 32) config->accept_threads = 32;
+    if (config->send_batch_size < 1400)     config->send_batch_size = 1400;
+    if (config->send_batch_size > 262144)   config->send_batch_size = 262144;
     return 0;
 }
 
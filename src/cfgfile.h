@@ -246,6 +246,8 @@ typedef struct ice_config_tag
     unsigned int queue_size_limit;
     int min_queue_size;
     int workers_count;
+    int accept_threads;
+    int send_batch_size;
     unsigned int burst_size;
     int client_timeout;
     int header_timeout;
@@ -23,6 +23,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "thread/thread.h"
 #include "avl/avl.h"
@@ -46,6 +52,16 @@
 #undef CATMODULE
 #define CATMODULE "client"
 
+/* how often the worker refreshes the due times of all its clients, a safety
+ * net for any reschedule made by another thread without worker_wakeup_client */
+#define WORKER_SWEEP_INTERVAL       5000
+
+/* due time for a client that is not active on the worker */
+#define WORKER_PARKED               ((uint64_t)-1)
+
+static void worker_signal (worker_t *worker);
+static void worker_detach_client (worker_t *worker, client_t *client, worker_t *dest);
+
 int worker_count;
 
 void client_register (client_t *client)
@@ -237,7 +253,10 @@ int client_send_404 (client_t *client, const char *message)
     }
     client_set_queue (client, NULL);
     if (client->respcode)
+    {
         client->flags = CLIENT_ACTIVE | (client->flags & ~CLIENT_AUTHENTICATED);
+        worker_wakeup_client (client);
+    }
     else
     {
         if (message == NULL)
@@ -342,14 +361,58 @@ worker_t *find_least_busy_handler (void)
 }
 
 
-/* worker mutex should be already locked */
+/* workers in start order, so worker_table[worker_count-1] is the list head.
+ * workers_lock should be held */
+static worker_t **worker_table;
+static int worker_table_len;
+static unsigned int worker_choice;
+
+/* pick 2 workers at random and take the one with fewer clients, this avoids
+ * scanning every worker on each new client while still spreading the load.
+ * workers_lock should be held */
+worker_t *find_lightly_loaded_handler (void)
+{
+    worker_t *a, *b;
+    unsigned int r, n = worker_count;
+
+    if (n < 3)
+        return find_least_busy_handler();
+    r = atomic_add (&worker_choice, 1) * 2654435761u;
+    a = worker_table [(r >> 16) % n];
+    b = worker_table [((r >> 16) + 1 + (r & 0xFFFF) % (n-1)) % n];
+    return (b->count < a->count) ? b : a;
+}
+
+
+/* push a chain of clients, first to the one with next pointer at lastp, onto
+ * the pending stack of the worker. Any thread can push, only the worker
+ * itself takes them off so there is no need for a lock.
+ */
+static void worker_push_clients (worker_t *worker, client_t *first, client_t **lastp, int count)
+{
+#ifdef HAVE_ATOMIC_OPS
+    client_t *head;
+
+    atomic_add (&worker->pending_count, count);
+    do
+    {
+        head = atomic_load (&worker->pending_clients);
+        *lastp = head;
+    } while (atomic_cas (&worker->pending_clients, head, first) == 0);
+#else
+    thread_spin_lock (&worker->lock);
+    worker->pending_count += count;
+    *lastp = worker->pending_clients;
+    worker->pending_clients = first;
+    thread_spin_unlock (&worker->lock);
+#endif
+}
+
+
 static void worker_add_client (worker_t *worker, client_t *client)
 {
-    ++worker->pending_count;
-    client->next_on_worker = NULL;
-    *worker->pending_clients_tail = client;
-    worker->pending_clients_tail = &client->next_on_worker;
     client->worker = worker;
+    worker_push_clients (worker, client, &client->next_on_worker, 1);
 }
 
 
@@ -358,11 +421,11 @@ int client_change_worker (client_t *client, worker_t *dest_worker)
     if (dest_worker->running == 0)
         return 0;
     client->next_on_worker = NULL;
+    client->flags &= ~CLIENT_POLL_ADDED;
 
-    thread_spin_lock (&dest_worker->lock);
+    worker_detach_client (client->worker, client, dest_worker);
     worker_add_client (dest_worker, client);
-    thread_spin_unlock (&dest_worker->lock);
-    worker_wakeup (dest_worker);
+    worker_signal (dest_worker);
 
     return 1;
 }
@@ -372,15 +435,13 @@ void client_add_worker (client_t *client)
 {
     worker_t *handler;
 
+    /* worker cannot be removed while the read lock is held, so it will pick
+     * up the client before shutting down */
     thread_rwlock_rlock (&workers_lock);
-    /* add client to the handler with the least number of clients */
-    handler = find_least_busy_handler();
-    thread_spin_lock (&handler->lock);
-    thread_rwlock_unlock (&workers_lock);
-
+    handler = find_lightly_loaded_handler();
     worker_add_client (handler, client);
-    thread_spin_unlock (&handler->lock);
-    worker_wakeup (handler);
+    worker_signal (handler);
+    thread_rwlock_unlock (&workers_lock);
 }
 
 
@@ -397,42 +458,307 @@ void client_add_worker (client_t *client)
 
 static void worker_control_create (worker_t *worker)
 {
+#ifdef HAVE_SYS_EVENTFD_H
+    /* a counter rather than a byte stream, so any number of wakeups is
+     * cleared with one read */
+    worker->wakeup_fd[0] = worker->wakeup_fd[1] = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (worker->wakeup_fd[0] < 0)
+    {
+        ERROR0 ("eventfd failed, descriptor limit?");
+        abort();
+    }
+#else
     if (pipe_create (&worker->wakeup_fd[0]) < 0)
     {
         ERROR0 ("pipe failed, descriptor limit?");
         abort();
     }
     sock_set_blocking (worker->wakeup_fd[0], 0);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (worker->poll_fd >= 0)
+    {
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl (worker->poll_fd, EPOLL_CTL_ADD, worker->wakeup_fd[0], &ev) < 0)
+        {
+            WARN0 ("unable to poll on worker control feed, using timed sends");
+            close (worker->poll_fd);
+            worker->poll_fd = -1;
+        }
+    }
+#endif
+}
+
+
+static void worker_control_close (worker_t *worker)
+{
+    if (worker->wakeup_fd[1] != worker->wakeup_fd[0])
+        sock_close (worker->wakeup_fd[1]);
+    sock_close (worker->wakeup_fd[0]);
+}
+
+
+static void worker_timer_set (worker_t *worker, unsigned int pos, uint64_t due_ms, client_t *client)
+{
+    worker->timers [pos].due_ms = due_ms;
+    worker->timers [pos].client = client;
+    client->timer_pos = pos;
+}
+
+
+static void worker_timer_up (worker_t *worker, unsigned int pos)
+{
+    worker_timer t = worker->timers [pos];
+
+    while (pos)
+    {
+        unsigned int parent = (pos - 1) / 2;
+
+        if (worker->timers [parent].due_ms <= t.due_ms)
+            break;
+        worker_timer_set (worker, pos, worker->timers [parent].due_ms, worker->timers [parent].client);
+        pos = parent;
+    }
+    worker_timer_set (worker, pos, t.due_ms, t.client);
+}
+
+
+static void worker_timer_down (worker_t *worker, unsigned int pos)
+{
+    worker_timer t = worker->timers [pos];
+
+    while (1)
+    {
+        unsigned int child = pos * 2 + 1;
+
+        if (child >= worker->timer_count)
+            break;
+        if (child + 1 < worker->timer_count && worker->timers [child+1].due_ms < worker->timers [child].due_ms)
+            child++;
+        if (t.due_ms <= worker->timers [child].due_ms)
+            break;
+        worker_timer_set (worker, pos, worker->timers [child].due_ms, worker->timers [child].client);
+        pos = child;
+    }
+    worker_timer_set (worker, pos, t.due_ms, t.client);
+}
+
+
+/* place the client on the worker heap, to be processed at due_ms */
+static void worker_timer_add (worker_t *worker, client_t *client, uint64_t due_ms)
+{
+    if (worker->timer_count == worker->timer_alloc)
+    {
+        worker->timer_alloc = worker->timer_alloc ? worker->timer_alloc * 2 : 64;
+        worker->timers = realloc (worker->timers, worker->timer_alloc * sizeof (worker_timer));
+        if (worker->timers == NULL)
+            abort();
+    }
+    worker_timer_set (worker, worker->timer_count, due_ms, client);
+    worker_timer_up (worker, worker->timer_count++);
+}
+
+
+/* remove and return the client that is due first */
+static client_t *worker_timer_take (worker_t *worker)
+{
+    client_t *client = worker->timers [0].client;
+
+    if (--worker->timer_count)
+    {
+        worker_timer *last = &worker->timers [worker->timer_count];
+
+        worker_timer_set (worker, 0, last->due_ms, last->client);
+        worker_timer_down (worker, 0);
+    }
+    return client;
+}
+
+
+/* refresh the due time of a client already on the heap */
+static void worker_timer_reset (worker_t *worker, client_t *client)
+{
+    unsigned int pos = client->timer_pos;
+
+    if (pos >= worker->timer_count || worker->timers [pos].client != client)
+        return; /* being processed or still pending, it is re-added anyway */
+    worker->timers [pos].due_ms = (client->flags & CLIENT_ACTIVE) ? client->schedule_ms : WORKER_PARKED;
+    worker_timer_up (worker, pos);
+    worker_timer_down (worker, client->timer_pos);
+}
+
+
+/* refresh every due time and rebuild the heap, only to catch a client changed
+ * by another thread that did not hand it over with worker_wakeup_client. */
+static void worker_timer_sweep (worker_t *worker)
+{
+    unsigned int i;
+
+    for (i = 0; i < worker->timer_count; i++)
+    {
+        client_t *client = worker->timers [i].client;
+        worker->timers [i].due_ms = (client->flags & CLIENT_ACTIVE) ? client->schedule_ms : WORKER_PARKED;
+    }
+    for (i = worker->timer_count / 2; i > 0; i--)
+        worker_timer_down (worker, i-1);
+    worker->sweep_ms = worker->time_ms + WORKER_SWEEP_INTERVAL;
+}
+
+
+#ifdef HAVE_SYS_EPOLL_H
+/* max time a client waits for its socket to drain before being processed anyway */
+#define WORKER_POLL_FALLBACK        500
+
+/* the last send on this client filled the socket buffer, so rather than retry
+ * the write on a timer, park the client until the socket becomes writable.
+ */
+static void worker_poll_arm (worker_t *worker, client_t *client)
+{
+    struct epoll_event ev;
+    int op = (client->flags & CLIENT_POLL_ADDED) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    client->connection.send_blocked = 0;
+    if (worker->poll_fd < 0)
+        return;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.ptr = client;
+    if (epoll_ctl (worker->poll_fd, op, client->connection.sock, &ev) < 0)
+    {
+        /* may still be registered from an earlier stay on this worker */
+        op = (op == EPOLL_CTL_ADD) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl (worker->poll_fd, op, client->connection.sock, &ev) < 0)
+            return;
+    }
+    client->flags |= (CLIENT_POLL_ADDED|CLIENT_POLL_ARMED);
+    if (client->schedule_ms < worker->time_ms + WORKER_POLL_FALLBACK)
+        client->schedule_ms = worker->time_ms + WORKER_POLL_FALLBACK;
+}
+
+
+/* client is being processed without the socket reporting ready, so drop the
+ * registration, a client may leave this worker during processing.
+ */
+static void worker_poll_disarm (worker_t *worker, client_t *client)
+{
+    struct epoll_event ev;
+
+    if (worker->poll_fd >= 0)
+        epoll_ctl (worker->poll_fd, EPOLL_CTL_DEL, client->connection.sock, &ev);
+    client->flags &= ~(CLIENT_POLL_ADDED|CLIENT_POLL_ARMED);
+}
+
+
+/* wait on the epoll set, clients reported writable are scheduled to run now.
+ * returns > 0 if the control feed needs draining */
+static int worker_poll_wait (worker_t *worker, int duration)
+{
+    struct epoll_event events[64];
+    int i, feed = 0, ret = epoll_wait (worker->poll_fd, events, 64, duration);
+
+    for (i = 0; i < ret; i++)
+    {
+        client_t *client = events[i].data.ptr;
+
+        if (client == NULL)
+        {
+            feed = 1;
+            continue;
+        }
+        client->flags &= ~CLIENT_POLL_ARMED;
+        client->schedule_ms = 0;
+        worker_timer_reset (worker, client);
+    }
+    return feed;
 }
+#endif
 
 
-static client_t **worker_add_pending_clients (worker_t *worker)
+static void worker_add_pending_clients (worker_t *worker)
 {
-    if (worker->pending_clients)
+    if (atomic_load (&worker->pending_clients))
     {
-        unsigned count;
-        client_t **p;
+        int count = 0;
+        client_t *client, *list = NULL;
 
+#ifdef HAVE_ATOMIC_OPS
+        client = atomic_swap (&worker->pending_clients, NULL);
+#else
         thread_spin_lock (&worker->lock);
-        p = worker->last_p;
-        *worker->last_p = worker->pending_clients;
-        worker->last_p = worker->pending_clients_tail;
-        worker->count += worker->pending_count;
-        count = worker->pending_count;
+        client = worker->pending_clients;
         worker->pending_clients = NULL;
-        worker->pending_clients_tail = &worker->pending_clients;
-        worker->pending_count = 0;
+#endif
+        /* reverse the stack so clients are processed in order of arrival */
+        while (client)
+        {
+            client_t *next = client->next_on_worker;
+
+            client->next_on_worker = list;
+            list = client;
+            client = next;
+            count++;
+        }
+        worker->count += count;
+        /* pushers add to the count first so this never goes negative */
+        atomic_sub (&worker->pending_count, count);
+#ifndef HAVE_ATOMIC_OPS
         thread_spin_unlock (&worker->lock);
+#endif
+        for (client = list; client; client = client->next_on_worker)
+            worker_timer_add (worker, client, client->schedule_ms);
         DEBUG2 ("Added %d pending clients to %p", count, worker);
-        if (worker->wakeup_ms > worker->time_ms+5)
-            return p;  /* only these new ones scheduled so process from here */
     }
-    worker->wakeup_ms = worker->time_ms + 60000;
-    return &worker->clients;
 }
 
 
-static client_t **worker_wait (worker_t *worker)
+/* re-sift the clients handed over by worker_wakeup_client. Each is taken off
+ * the list under the lock before its schedule is read, so a change made after
+ * that hands it over again */
+static void worker_add_woken_clients (worker_t *worker)
+{
+    client_t *client;
+
+    if (atomic_load (&worker->woken_clients) == NULL)
+        return;
+    thread_spin_lock (&worker->lock);
+    client = worker->woken_clients;
+    worker->woken_clients = NULL;
+    thread_spin_unlock (&worker->lock);
+    while (client)
+    {
+        client_t *next = client->next_woken;
+
+        thread_spin_lock (&worker->lock);
+        client->woken = 0;
+        thread_spin_unlock (&worker->lock);
+        worker_timer_reset (worker, client);
+        client = next;
+    }
+}
+
+
+/* the client is leaving this worker for dest, or NULL if it is being released,
+ * so make sure it is not left on the woken list. Called by the worker only */
+static void worker_detach_client (worker_t *worker, client_t *client, worker_t *dest)
+{
+    thread_spin_lock (&worker->lock);
+    if (client->woken)
+    {
+        client_t **prevp = &worker->woken_clients;
+
+        while (*prevp != client)
+            prevp = &(*prevp)->next_woken;
+        *prevp = client->next_woken;
+        client->woken = 0;
+    }
+    client->worker = dest;
+    thread_spin_unlock (&worker->lock);
+}
+
+
+static void worker_wait (worker_t *worker)
 {
     int ret, duration = 2;
 
@@ -447,10 +773,21 @@ static client_t **worker_wait (worker_t *worker)
             duration = 2;
     }
 
-    ret = util_timed_wait_for_fd (worker->wakeup_fd[0], duration);
+#ifdef HAVE_SYS_EPOLL_H
+    if (worker->poll_fd >= 0)
+        ret = worker_poll_wait (worker, duration);
+    else
+#endif
+        ret = util_timed_wait_for_fd (worker->wakeup_fd[0], duration);
     if (ret > 0) /* may of been several wakeup attempts */
     {
         char ca[30];
+
+        /* reset before looking at the pending clients, so a wakeup after
+         * this point triggers another write */
+#ifdef HAVE_ATOMIC_OPS
+        atomic_swap (&worker->wakeup_pending, 0);
+#endif
         do
         {
             ret = pipe_read (worker->wakeup_fd[0], ca, sizeof ca);
@@ -458,10 +795,9 @@ static client_t **worker_wait (worker_t *worker)
                 break;
             if (ret < 0 && sock_recoverable (sock_error()))
                 break;
-            sock_close (worker->wakeup_fd[1]);
-            sock_close (worker->wakeup_fd[0]);
+            worker_control_close (worker);
             worker_control_create (worker);
-            worker_wakeup (worker);
+            worker_signal (worker);
             WARN0 ("Had to recreate worker control feed");
         } while (1);
     }
@@ -469,7 +805,10 @@ static client_t **worker_wait (worker_t *worker)
     worker->time_ms = timing_get_time();
     worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
 
-    return worker_add_pending_clients (worker);
+    worker_add_woken_clients (worker);
+    if (worker->time_ms >= worker->sweep_ms)
+        worker_timer_sweep (worker);
+    worker_add_pending_clients (worker);
 }
 
 
@@ -479,35 +818,34 @@ static void worker_relocate_clients (worker_t *worker)
         return;
     while (worker->count || worker->pending_count)
     {
-        client_t *client = worker->clients, **prevp = &worker->clients;
+        client_t *moving = NULL, **prevp = &moving;
+        int count = 0;
 
         worker->wakeup_ms = worker->time_ms + 150;
-        while (client)
+        while (worker->timer_count)
         {
+            client_t *client = worker->timers [--worker->timer_count].client;
+
+#ifdef HAVE_SYS_EPOLL_H
+            if (client->flags & CLIENT_POLL_ARMED)
+                worker_poll_disarm (worker, client);
+            client->flags &= ~CLIENT_POLL_ADDED;
+#endif
+            worker->count--;
             if (client->flags & CLIENT_ACTIVE)
             {
-                client->worker = workers;
+                worker_detach_client (worker, client, workers);
+                *prevp = client;
                 prevp = &client->next_on_worker;
+                count++;
             }
             else
-            {
-                *prevp = client->next_on_worker;
                 worker_add_client (worker, client);
-                worker->count--;
-            }
-            client = *prevp;
         }
-        if (worker->clients)
+        if (moving)
         {
-            thread_spin_lock (&workers->lock);
-            *workers->pending_clients_tail = worker->clients;
-            workers->pending_clients_tail = prevp;
-            workers->pending_count += worker->count;
-            thread_spin_unlock (&workers->lock);
-            worker_wakeup (workers);
-            worker->clients = NULL;
-            worker->last_p = &worker->clients;
-            worker->count = 0;
+            worker_push_clients (workers, moving, prevp, count);
+            worker_signal (workers);
         }
         worker_wait (worker);
     }
@@ -517,50 +855,67 @@ void *worker (void *arg)
 {
     worker_t *worker = arg;
     long prev_count = -1;
-    client_t **prevp = &worker->clients;
 
     worker->running = 1;
     worker->wakeup_ms = (int64_t)0;
     worker->time_ms = timing_get_time();
+    worker->sweep_ms = worker->time_ms + WORKER_SWEEP_INTERVAL;
 
     while (1)
     {
-        client_t *client = *prevp;
+        client_t *client, *due = NULL, **due_p = &due;
         uint64_t sched_ms = worker->time_ms+6;
 
-        while (client)
+        if (worker->running == 0)
+            sched_ms = WORKER_PARKED;  /* shutting down, so process all */
+
+        /* take off all those due first, so each is processed once per pass */
+        while (worker->timer_count && worker->timers [0].due_ms <= sched_ms)
+        {
+            client = worker_timer_take (worker);
+            *due_p = client;
+            due_p = &client->next_on_worker;
+        }
+        *due_p = NULL;
+
+        while ((client = due))
         {
+            int ret;
+
+            due = client->next_on_worker;
             if (client->worker != worker) abort();
-            /* process client details but skip those that are not ready yet */
-            if (client->flags & CLIENT_ACTIVE)
+            /* skip those not active, a sweep puts them back when woken */
+            if ((client->flags & CLIENT_ACTIVE) == 0)
+            {
+                worker_timer_add (worker, client, WORKER_PARKED);
+                continue;
+            }
+#ifdef HAVE_SYS_EPOLL_H
+            if (client->flags & CLIENT_POLL_ARMED)
+                worker_poll_disarm (worker, client);
+#endif
+            ret = client->ops->process (client);
+            if (ret < 0)
             {
-                int ret = 0;
-                client_t *nx = client->next_on_worker;
-
-                if (worker->running == 0 || client->schedule_ms <= sched_ms)
-                {
-                    ret = client->ops->process (client);
-                    if (ret < 0)
-                    {
-                        client->worker = NULL;
-                        if (client->ops->release)
-                            client->ops->release (client);
-                    }
-                    if (ret)
-                    {
-                        worker->count--;
-                        if (nx == NULL) /* is this the last client */
-                            worker->last_p = prevp;
-                        client = *prevp = nx;
-                        continue;
-                    }
-                }
-                if (client->schedule_ms < worker->wakeup_ms)
-                    worker->wakeup_ms = client->schedule_ms;
+                worker_detach_client (worker, client, NULL);
+                if (client->ops->release)
+                    client->ops->release (client);
             }
-            prevp = &client->next_on_worker;
-            client = *prevp;
+            if (ret)
+            {
+                worker->count--;
+                continue;
+            }
+#ifdef HAVE_SYS_EPOLL_H
+            if (client->connection.send_blocked)
+                worker_poll_arm (worker, client);
+#endif
+            worker_timer_add (worker, client, client->schedule_ms);
         }
+        worker->wakeup_ms = worker->time_ms + 60000;
+        if (worker->timer_count && worker->timers [0].due_ms < worker->wakeup_ms)
+            worker->wakeup_ms = worker->timers [0].due_ms;
+
         if (prev_count != worker->count)
         {
             DEBUG2 ("%p now has %d clients", worker, worker->count);
@@ -573,7 +928,7 @@ void *worker (void *arg)
             if (worker->count == 0 && worker->pending_count == 0)
                 break;
         }
-        prevp = worker_wait (worker);
+        worker_wait (worker);
     }
     worker_relocate_clients (worker);
     INFO0 ("shutting down");
@@ -585,14 +940,23 @@ static void worker_start (void)
 {
     worker_t *handler = calloc (1, sizeof(worker_t));
 
+#ifdef HAVE_SYS_EPOLL_H
+    handler->poll_fd = epoll_create (64);
+    if (handler->poll_fd < 0)
+        WARN0 ("epoll unavailable, worker using timed sends");
+#endif
     worker_control_create (handler);
 
-    handler->pending_clients_tail = &handler->pending_clients;
     thread_spin_create (&handler->lock);
     thread_rwlock_wlock (&workers_lock);
-    handler->last_p = &handler->clients;
     handler->next = workers;
     workers = handler;
+    if (worker_count >= worker_table_len)
+    {
+        worker_table_len += 8;
+        worker_table = realloc (worker_table, worker_table_len * sizeof (worker_t*));
+    }
+    worker_table [worker_count] = handler;
     worker_count++;
     handler->thread = thread_create ("worker", worker, handler, THREAD_ATTACHED);
     thread_rwlock_unlock (&workers_lock);
@@ -608,16 +972,26 @@ static void worker_stop (void)
     handler = workers;
     workers = handler->next;
     worker_count--;
+    if (worker_count == 0)
+    {
+        free (worker_table);
+        worker_table = NULL;
+        worker_table_len = 0;
+    }
     thread_rwlock_unlock (&workers_lock);
 
     handler->running = 0;
-    worker_wakeup (handler);
+    worker_signal (handler);
 
     thread_join (handler->thread);
     thread_spin_destroy (&handler->lock);
 
-    sock_close (handler->wakeup_fd[1]);
-    sock_close (handler->wakeup_fd[0]);
+    worker_control_close (handler);
+#ifdef HAVE_SYS_EPOLL_H
+    if (handler->poll_fd >= 0)
+        close (handler->poll_fd);
+#endif
+    free (handler->timers);
     free (handler);
 }
 
@@ -633,7 +1007,46 @@ void workers_adjust (int new_count)
     }
 }
 
-void worker_wakeup (worker_t *worker)
+/* several wakeups before the worker gets to run only need one signal */
+static void worker_signal (worker_t *worker)
 {
+#ifdef HAVE_ATOMIC_OPS
+    if (atomic_swap (&worker->wakeup_pending, 1))
+        return;
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+    eventfd_write (worker->wakeup_fd[1], 1);
+#else
     pipe_write (worker->wakeup_fd[1], "W", 1);
+#endif
+}
+
+
+/* hand the client to its worker after changing it from another thread, such
+ * as bringing its schedule forward or making it active again, so that only
+ * this client is re-sifted. The caller must stop the client being released
+ * while here, usually by holding the lock of the list it was found on */
+void worker_wakeup_client (client_t *client)
+{
+    worker_t *worker = client->worker;
+
+    while (worker)
+    {
+        thread_spin_lock (&worker->lock);
+        if (client->worker == worker)
+        {
+            if (client->woken == 0)
+            {
+                client->woken = 1;
+                client->next_woken = worker->woken_clients;
+                worker->woken_clients = client;
+            }
+            thread_spin_unlock (&worker->lock);
+            worker_signal (worker);
+            return;
+        }
+        /* moved to another worker in the meantime */
+        thread_spin_unlock (&worker->lock);
+        worker = client->worker;
+    }
 }
@@ -28,22 +28,48 @@ typedef struct _worker_t worker_t;
 #include "compat.h"
 #include "thread/thread.h"
 
+#define WORKER_IOV_SCRATCH      16
+
+typedef struct
+{
+    uint64_t due_ms;
+    client_t *client;
+} worker_timer;
+
 struct _worker_t
 {
     int running;
     int count, pending_count;
     spin_t lock;
     int wakeup_fd[2];
+    int wakeup_pending;
+#ifdef HAVE_SYS_EPOLL_H
+    int poll_fd;
+#endif
 
+    /* newest first, pushed by any thread, taken as a whole by the worker */
     client_t *pending_clients;
-    client_t **pending_clients_tail,
-             *clients;
-    client_t **last_p;
+
+    /* clients changed by other threads that need re-sifting, under lock */
+    client_t *woken_clients;
+
+    /* clients on this worker, a heap ordered on when each is next due */
+    worker_timer *timers;
+    unsigned int timer_count, timer_alloc;
+    uint64_t sweep_ms;
+
     thread_type *thread;
     struct timespec current_time;
     uint64_t time_ms;
     uint64_t wakeup_ms;
     struct _worker_t *next;
+
+    /* sent bytes not yet added to the global rate, see global_add_bitrates */
+    unsigned long out_bytes;
+    uint64_t out_flush_ms;
+
+    /* for building write vectors while processing a client */
+    IOVEC iov_scratch [WORKER_IOV_SCRATCH];
 };
 
 
@@ -69,6 +95,13 @@ struct _client_tag
 
     client_t *next_on_worker;
 
+    /* position in the worker timer heap */
+    unsigned int timer_pos;
+
+    /* link on the worker woken list, set if on it, see worker_wakeup_client */
+    client_t *next_woken;
+    int woken;
+
     /* functions to process client */
     struct _client_functions *ops;
 
@@ -139,8 +172,9 @@ int  client_compare (void *compare_arg, void *a, void *b);
 int  client_change_worker (client_t *client, worker_t *dest_worker);
 void client_add_worker (client_t *client);
 worker_t *find_least_busy_handler (void);
+worker_t *find_lightly_loaded_handler (void);
 void workers_adjust (int new_count);
-void worker_wakeup (worker_t *worker);
+void worker_wakeup_client (client_t *client);
 
 
 /* client flags bitmask */
@@ -155,6 +189,9 @@ void worker_wakeup (worker_t *worker);
 #define CLIENT_IP_BAN_LIFT          (1<<8)
 #define CLIENT_META_INSTREAM        (1<<9)
 #define CLIENT_HIJACKER             (1<<10)
+#define CLIENT_POLL_ADDED           (1<<11)
+#define CLIENT_POLL_ARMED           (1<<12)
+#define CLIENT_AUTH_CACHED          (1<<13)
 #define CLIENT_FORMAT_BIT           (1<<16)
 
 #endif  /* __CLIENT_H__ */
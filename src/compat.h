@@ -50,6 +50,45 @@
 #  define PATH_SEPARATOR "/"
 #endif
 
+/* atomic operations for data shared between threads without a lock.
+ * atomic_add/atomic_sub return the new value and order both ways,
+ * atomic_load is an acquire, atomic_store and atomic_or are a release.
+ * atomic_barrier is a full fence, for a store that must be seen before a
+ * following load.
+ * atomic_swap (returns the old value) and atomic_cas (true if *P was O and
+ * is now N) are fully ordered and only exist with HAVE_ATOMIC_OPS
+ */
+#if defined(__ATOMIC_ACQUIRE)
+#  define HAVE_ATOMIC_OPS 1
+#  define atomic_add(P,V)       __atomic_add_fetch((P),(V),__ATOMIC_ACQ_REL)
+#  define atomic_sub(P,V)       __atomic_sub_fetch((P),(V),__ATOMIC_ACQ_REL)
+#  define atomic_or(P,V)        __atomic_or_fetch((P),(V),__ATOMIC_RELEASE)
+#  define atomic_load(P)        __atomic_load_n((P),__ATOMIC_ACQUIRE)
+#  define atomic_store(P,V)     __atomic_store_n((P),(V),__ATOMIC_RELEASE)
+#  define atomic_barrier()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#  define atomic_swap(P,V)      __atomic_exchange_n((P),(V),__ATOMIC_SEQ_CST)
+#  define atomic_cas(P,O,N)     __extension__ ({ __typeof__(*(P)) _o = (O); \
+            __atomic_compare_exchange_n((P),&_o,(N),0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST); })
+#elif defined(__GNUC__)
+#  define HAVE_ATOMIC_OPS 1
+#  define atomic_add(P,V)       __sync_add_and_fetch((P),(V))
+#  define atomic_sub(P,V)       __sync_sub_and_fetch((P),(V))
+#  define atomic_or(P,V)        __sync_or_and_fetch((P),(V))
+#  define atomic_load(P)        __sync_fetch_and_add((P),0)
+#  define atomic_store(P,V)     do { __sync_synchronize(); *(P) = (V); } while (0)
+#  define atomic_barrier()      __sync_synchronize()
+#  define atomic_swap(P,V)      __extension__ ({ __sync_synchronize(); __sync_lock_test_and_set((P),(V)); })
+#  define atomic_cas(P,O,N)     __sync_bool_compare_and_swap((P),(O),(N))
+#else
+/* no atomics, callers must hold a lock */
+#  define atomic_add(P,V)       (*(P) += (V))
+#  define atomic_sub(P,V)       (*(P) -= (V))
+#  define atomic_or(P,V)        (*(P) |= (V))
+#  define atomic_load(P)        (*(P))
+#  define atomic_store(P,V)     (*(P) = (V))
+#  define atomic_barrier()
+#endif
+
 #if defined(HAVE_INTTYPES_H)
 #    include <inttypes.h>
 #elif defined(HAVE_STDINT_H)
@@ -46,6 +46,9 @@
 #include <sys/signalfd.h>
 #include <signal.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "compat.h"
 
@@ -127,6 +130,9 @@ static SSL_CTX *ssl_ctx;
 
 int header_timeout;
 
+/* max connections accepted from one listening socket per wakeup */
+#define ACCEPT_BATCH            32
+
 struct _client_functions shoutcast_source_ops =
 {
     shoutcast_source_client,
@@ -306,14 +312,18 @@ int connection_send_ssl (connection_t *con, const void *buf, size_t len)
     {
         switch (SSL_get_error (con->ssl, bytes))
         {
-            case SSL_ERROR_WANT_READ:
             case SSL_ERROR_WANT_WRITE:
+                con->send_blocked = 1;
+            case SSL_ERROR_WANT_READ:
                 return -1;
         }
         con->error = 1;
     }
     else
+    {
+        con->send_blocked = ((size_t)bytes < len);
         con->sent_bytes += bytes;
+    }
     return bytes;
 }
 #else
@@ -347,13 +357,45 @@ int connection_send (connection_t *con, const void *buf, size_t len)
     {
         if (!sock_recoverable (sock_error()))
             con->error = 1;
+        else
+            con->send_blocked = 1;
     }
     else
+    {
+        con->send_blocked = ((size_t)bytes < len);
         con->sent_bytes += bytes;
+    }
     return bytes;
 }
 
 
+#ifdef HAVE_SYS_SENDFILE_H
+/* send len bytes of file from offset, which is updated. The kernel copies
+ * the data so it is not for ssl connections. Returns as connection_send
+ * but -2 if the file cannot be used this way.
+ */
+int connection_sendfile (connection_t *con, int fd, off_t *offset, size_t len)
+{
+    ssize_t bytes = sendfile (con->sock, fd, offset, len);
+    if (bytes < 0)
+    {
+        if (errno == EINVAL || errno == ENOSYS)
+            return -2;
+        if (!sock_recoverable (sock_error()))
+            con->error = 1;
+        else
+            con->send_blocked = 1;
+    }
+    else
+    {
+        con->send_blocked = ((size_t)bytes < len);
+        con->sent_bytes += bytes;
+    }
+    return (int)bytes;
+}
+#endif
+
+
 #ifdef WIN32
 #define IO_VECTOR_LEN(x) ((x)->len)
 #define IO_VECTOR_BASE(x) ((x)->buf)
@@ -364,19 +406,39 @@ int connection_send (connection_t *con, const void *buf, size_t len)
 
 void connection_bufs_init (struct connection_bufs *v, short start)
 {
-    memset (v, 0, sizeof (struct connection_bufs));
-    if (start && start < 500)
+    v->count = 0;
+    v->total = 0;
+    v->allocated = 0;
+    v->block = v->inline_block;
+    v->max = CONNECTION_BUFS_INLINE;
+    if (start > CONNECTION_BUFS_INLINE && start < 500)
     {
         v->block = calloc (start, sizeof (IOVEC));
         v->max = start;
+        v->allocated = 1;
     }
 }
 
 
+/* use the caller provided array, which must outlive the vectors */
+void connection_bufs_init_scratch (struct connection_bufs *v, IOVEC *scratch, short count)
+{
+    v->count = 0;
+    v->total = 0;
+    v->allocated = 0;
+    v->block = scratch;
+    v->max = count;
+}
+
+
 void connection_bufs_release (struct connection_bufs *v)
 {
-    free (v->block);
-    memset (v, 0, sizeof (struct connection_bufs));
+    if (v->allocated)
+        free (v->block);
+    v->block = NULL;
+    v->count = v->max = 0;
+    v->total = 0;
+    v->allocated = 0;
 }
 
 
@@ -392,9 +454,21 @@ int connection_bufs_append (struct connection_bufs *v, void *buf, unsigned int l
     if (v->count >= v->max)
     {
        int len = v->max + 16;
-       IOVEC *arr = realloc (v->block, (len*sizeof(IOVEC)));
+       IOVEC *arr;
+
+       if (v->allocated)
+           arr = realloc (v->block, (len*sizeof(IOVEC)));
+       else
+       {
+           arr = malloc (len*sizeof(IOVEC));
+           if (arr && v->count)
+               memcpy (arr, v->block, v->count * sizeof(IOVEC));
+       }
+       if (arr == NULL)
+           return v->total;
        v->max = len;
        v->block = arr;
+       v->allocated = 1;
     }
     IO_VECTOR_BASE (v->block + v->count) = buf;
     IO_VECTOR_LEN (v->block + v->count) = len;
@@ -447,8 +521,15 @@ int connection_bufs_send (connection_t *con, struct connection_bufs *vectors, in
         if (not_ssl_connection (con))
         {
             ret = sock_writev (con->sock, p, vectors->count - i);
-            if (ret < 0 && !sock_recoverable (sock_error()))
-                con->error = 1;
+            if (ret < 0)
+            {
+                if (sock_recoverable (sock_error()))
+                    con->send_blocked = 1;
+                else
+                    con->error = 1;
+            }
+            else
+                con->send_blocked = (ret < vectors->total - skip);
         }
 #ifdef HAVE_OPENSSL
         else
@@ -683,32 +764,68 @@ void connection_close_sigfd (void)
 #define connection_close_sigfd()    do {}while(0);
 #endif
 
-static sock_t wait_for_serversock (void)
-{
 #ifdef HAVE_POLL
-    int i, ret;
-    struct pollfd ufds [global.server_sockets + 1];
+static int serversock_count (void)
+{
+    int count;
 
-    for(i=0; i < global.server_sockets; i++) {
+    global_lock();
+    count = global.server_sockets;
+    global_unlock();
+    return count;
+}
+
+
+/* copy up to max listening sockets into ufds, returns the number copied. The
+ * main connection thread may drop failed sockets from the list while acceptor
+ * threads are polling, so each works on its own copy.
+ */
+static int serversock_snapshot (struct pollfd *ufds, int max)
+{
+    int i;
+
+    global_lock();
+    if (max > global.server_sockets)
+        max = global.server_sockets;
+    for (i = 0; i < max; i++)
+    {
         ufds[i].fd = global.serversock[i];
         ufds[i].events = POLLIN;
         ufds[i].revents = 0;
     }
+    global_unlock();
+    return max;
+}
+#endif
+
+
+/* wait for a listening socket to have a connection pending. Only the main
+ * connection thread handles signals and the closing of failed sockets, any
+ * other acceptor threads just skip them.
+ */
+static sock_t wait_for_serversock (int main_thread)
+{
+#ifdef HAVE_POLL
+    int i, ret, count = serversock_count();
+    struct pollfd ufds [count + 1];
+
+    i = count = serversock_snapshot (ufds, count);
 #ifdef HAVE_SIGNALFD
     ufds[i].fd = sigfd;
     ufds[i].events = POLLIN;
     ufds[i].revents = 0;
-    ret = poll(ufds, i+1, 4000);
-#else
-    ret = poll(ufds, global.server_sockets, 333);
+    if (main_thread)
+        ret = poll(ufds, i+1, 4000);
+    else
 #endif
+    ret = poll(ufds, count, 333);
 
     if (ret <= 0)
         return SOCK_ERROR;
     else {
         int dst;
 #ifdef HAVE_SIGNALFD
-        if (ufds[i].revents & POLLIN)
+        if (main_thread && (ufds[i].revents & POLLIN))
         {
             struct signalfd_siginfo fdsi;
             int ret  = read (sigfd, &fdsi, sizeof(struct signalfd_siginfo));
@@ -732,35 +849,42 @@ static sock_t wait_for_serversock (void)
                 }
             }
         }
-        if (ufds[i].revents & (POLLNVAL|POLLERR))
+        if (main_thread && (ufds[i].revents & (POLLNVAL|POLLERR)))
         {
             ERROR0 ("signalfd descriptor became invalid, doing thread restart");
             slave_restart(); // something odd happened
         }
 #endif
-        for(i=0; i < global.server_sockets; i++) {
+        for(i=0; i < count; i++) {
             if(ufds[i].revents & POLLIN)
                 return ufds[i].fd;
-            if(ufds[i].revents & (POLLHUP|POLLERR|POLLNVAL))
+        }
+        if (main_thread == 0)
+            return SOCK_ERROR;
+        /* remove any failed sockets. Only this thread changes the list while
+         * the acceptors run, so it still matches the copy polled */
+        global_lock();
+        for(i=0, dst=0; i < global.server_sockets; i++)
+        {
+            if (i < count && (ufds[i].revents & (POLLHUP|POLLERR|POLLNVAL)))
             {
                 if (ufds[i].revents & (POLLHUP|POLLERR))
                 {
                     sock_close (global.serversock[i]);
                     WARN0("Had to close a listening socket");
                 }
-                global.serversock[i] = SOCK_ERROR;
-            }
-        }
-        /* remove any closed sockets */
-        for(i=0, dst=0; i < global.server_sockets; i++)
-        {
-            if (global.serversock[i] == SOCK_ERROR)
+                config_clear_listener (global.server_conn[i]);
                 continue;
+            }
             if (i!=dst)
+            {
                 global.serversock[dst] = global.serversock[i];
+                global.server_conn[dst] = global.server_conn[i];
+            }
             dst++;
         }
         global.server_sockets = dst;
+        global_unlock();
         return SOCK_ERROR;
     }
 #else
@@ -798,15 +922,12 @@ static sock_t wait_for_serversock (void)
 }
 
 
-static client_t *accept_client (void)
+static client_t *accept_client (sock_t serversock)
 {
     client_t *client = NULL;
-    sock_t sock, serversock = wait_for_serversock ();
+    sock_t sock;
     char addr [200];
 
-    if (serversock == SOCK_ERROR)
-        return NULL;
-
     sock = sock_accept (serversock, addr, 200);
     if (sock == SOCK_ERROR)
     {
@@ -818,14 +939,16 @@ static client_t *accept_client (void)
     }
     do
     {
-        int i, num;
+        int i;
         refbuf_t *r;
 
+#ifndef HAVE_ACCEPT4
         if (sock_set_blocking (sock, 0)) // || sock_set_nodelay (sock))
         {
             WARN0 ("failed to set tcp options on client connection, dropping");
             break;
         }
+#endif
         client = calloc (1, sizeof (client_t));
         if (client == NULL || connection_init (&client->connection, sock, addr) < 0)
             break;
@@ -834,26 +957,29 @@ static client_t *accept_client (void)
         r->len = 0; // for building up the request coming in
 
         global_lock ();
-        client_register (client);
-
         for (i=0; i < global.server_sockets; i++)
         {
             if (global.serversock[i] == serversock)
-            {
-                client->server_conn = global.server_conn[i];
-                client->server_conn->refcount++;
-                if (client->server_conn->ssl && ssl_ok)
-                    connection_uses_ssl (&client->connection);
-                if (client->server_conn->shoutcast_compat)
-                    client->ops = &shoutcast_source_ops;
-                else
-                    client->ops = &http_request_ops;
                 break;
-            }
         }
-        num = global.clients;
+        if (i == global.server_sockets)
+        {
+            /* the listening socket was dropped after it was polled */
+            global_unlock ();
+            refbuf_release (r);
+            free (client->connection.ip);
+            break;
+        }
+        client_register (client);
+        client->server_conn = global.server_conn[i];
+        client->server_conn->refcount++;
+        if (client->server_conn->ssl && ssl_ok)
+            connection_uses_ssl (&client->connection);
+        if (client->server_conn->shoutcast_compat)
+            client->ops = &shoutcast_source_ops;
+        else
+            client->ops = &http_request_ops;
         global_unlock ();
-        stats_event_args (NULL, "clients", "%d", num);
         client->flags |= CLIENT_ACTIVE;
         return client;
     } while (0);
@@ -1065,9 +1191,55 @@ static int http_client_request (client_t *client)
 }
 
 
+/* accept the pending connections on serversock and pass them to the workers,
+ * up to a limit so other sockets are not starved. */
+static void accept_clients (sock_t serversock)
+{
+    int count = 0;
+
+    while (count < ACCEPT_BATCH)
+    {
+        client_t *client = accept_client (serversock);
+        if (client == NULL)
+            break;
+        /* do a small delay here so the client has chance to send the request after
+         * getting a connect. */
+        client->counter = client->schedule_ms = timing_get_time();
+        client->connection.con_time = client->schedule_ms/1000;
+        client->connection.discon_time = client->connection.con_time + header_timeout;
+        client->schedule_ms += 6;
+        client_add_worker (client);
+        count++;
+    }
+    if (count)
+    {
+        stats_event_args (NULL, "clients", "%d", global.clients);
+        stats_counter_add (stats_counters.connections, count);
+    }
+}
+
+
+/* extra acceptor thread, works on the same listening sockets as the main
+ * connection thread */
+static void *connection_acceptor (void *arg)
+{
+    while (connection_running)
+    {
+        sock_t serversock = wait_for_serversock (0);
+        if (serversock != SOCK_ERROR)
+            accept_clients (serversock);
+        if (global.new_connections_slowdown)
+            thread_sleep (global.new_connections_slowdown * 5000);
+    }
+    return NULL;
+}
+
+
 static void *connection_thread (void *arg)
 {
     ice_config_t *config;
+    thread_type *acceptors [32];
+    int i, acceptor_count;
 
 #ifdef HAVE_SIGNALFD
     sigset_t mask;
@@ -1105,25 +1277,24 @@ static void *connection_thread (void *arg)
     get_ssl_certificate (config);
     connection_setup_sockets (config);
     header_timeout = config->header_timeout;
+    acceptor_count = config->accept_threads - 1;
     config_release_config ();
 
+    for (i = 0; i < acceptor_count; i++)
+        acceptors [i] = thread_create ("acceptor", connection_acceptor, NULL, THREAD_ATTACHED);
+    if (acceptor_count)
+        INFO1 ("%d extra acceptor threads started", acceptor_count);
+
     while (connection_running)
     {
-        client_t *client = accept_client ();
-        if (client)
-        {
-            /* do a small delay here so the client has chance to send the request after
-             * getting a connect. */
-            client->counter = client->schedule_ms = timing_get_time();
-            client->connection.con_time = client->schedule_ms/1000;
-            client->connection.discon_time = client->connection.con_time + header_timeout;
-            client->schedule_ms += 6;
-            client_add_worker (client);
-            stats_event_inc (NULL, "connections");
-        }
+        sock_t serversock = wait_for_serversock (1);
+        if (serversock != SOCK_ERROR)
+            accept_clients (serversock);
         if (global.new_connections_slowdown)
             thread_sleep (global.new_connections_slowdown * 5000);
     }
+    for (i = 0; i < acceptor_count; i++)
+        thread_join (acceptors [i]);
 #ifdef HAVE_OPENSSL
     SSL_CTX_free (ssl_ctx);
 #endif
@@ -1202,6 +1373,7 @@ int connection_complete_source (source_t *source)
         format_type = FORMAT_TYPE_MPEG;
     }
 
+    source_wait_unlocked_senders (source);
     format_plugin_clear (source->format, client);
     source->format->type = format_type;
     source->format->mount = source->mount;
@@ -1507,7 +1679,7 @@ static int _handle_get_request (client_t *client)
     }
     config_release_config();
 
-    stats_event_inc(NULL, "client_connections");
+    stats_counter_add (stats_counters.client_connections, 1);
 
     if (strcmp (uri, "/admin.cgi") == 0 || strncmp("/admin/", uri, 7) == 0)
         ret = admin_handle_request (client, uri);
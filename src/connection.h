@@ -42,6 +42,7 @@ struct connection_tag
 
     sock_t sock;
     int error;
+    int send_blocked;   /* last send could not complete, socket buffer full */
 
 #ifdef HAVE_OPENSSL
     SSL *ssl;   /* SSL handler */
@@ -51,11 +52,17 @@ struct connection_tag
 };
 
 
+/* small vectors use the inline array, larger ones can be given scratch
+ * space, eg the worker iov_scratch, and only go to the heap beyond that */
+#define CONNECTION_BUFS_INLINE      4
+
 struct connection_bufs
 {
     short count, max;
     int total;
     IOVEC *block;
+    int allocated;
+    IOVEC inline_block [CONNECTION_BUFS_INLINE];
 };
 
 
@@ -78,6 +85,7 @@ void connection_release_banned_ip (const char *ip);
 void connection_stats (void);
 
 void connection_bufs_init (struct connection_bufs *vectors, short start);
+void connection_bufs_init_scratch (struct connection_bufs *v, IOVEC *scratch, short count);
 void connection_bufs_release (struct connection_bufs *v);
 void connection_bufs_flush (struct connection_bufs *v);
 int  connection_bufs_append (struct connection_bufs *vectors, void *buf, unsigned int len);
@@ -90,6 +98,9 @@ int  connection_send_ssl (connection_t *con, const void *buf, size_t len);
 #endif
 int  connection_read (connection_t *con, void *buf, size_t len);
 int  connection_send (connection_t *con, const void *buf, size_t len);
+#ifdef HAVE_SYS_SENDFILE_H
+int  connection_sendfile (connection_t *con, int fd, off_t *offset, size_t len);
+#endif
 void connection_thread_shutdown_req (void);
 
 int connection_check_pass (http_parser_t *parser, const char *user, const char *pass);
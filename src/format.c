@@ -91,6 +91,8 @@ void format_plugin_clear (format_plugin_t *format, client_t *client)
     rate_free (format->in_bitrate);
     rate_free (format->out_bitrate);
     free (format->charset);
+    if (format->headers)
+        refbuf_release (format->headers);
     if (format->parser && format->parser != client->parser) // a relay client may have a new parser
         httpp_destroy (format->parser);
     memset (format, 0, sizeof (format_plugin_t));
@@ -122,7 +124,9 @@ int format_get_plugin (format_plugin_t *plugin, client_t *client)
 }
 
 
-int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp)
+/* read the next block of file for client, from the shared copy in cache if
+ * provided or else from fp */
+int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp, refbuf_t *cache)
 {
     refbuf_t *refbuf = client->refbuf;
     size_t bytes = -1;
@@ -132,7 +136,7 @@ int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp)
     {
         if (refbuf == NULL)
         {
-            if (fp == NULL)
+            if (fp == NULL && cache == NULL)
                 return -2;
             refbuf = client->refbuf = refbuf_new (4096);
             client->pos = refbuf->len;
@@ -141,7 +145,7 @@ int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp)
         }
         if (client->pos < refbuf->len)
             break;
-        if (fp == NULL || client->flags & CLIENT_HAS_INTRO_CONTENT)
+        if ((fp == NULL && cache == NULL) || client->flags & CLIENT_HAS_INTRO_CONTENT)
         {
             if (refbuf->next)
             {
@@ -160,10 +164,34 @@ int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp)
             continue;
         }
 
-        if (fseek (fp, client->intro_offset, SEEK_SET) < 0 ||
-                (bytes = fread (refbuf->data, 1, 4096, fp)) <= 0)
+        if (cache)
         {
-            return bytes < 0 ? -2 : -1;
+            if (client->intro_offset >= cache->len)
+                return -1;
+            bytes = cache->len - client->intro_offset;
+            if (bytes > 4096)
+                bytes = 4096;
+        }
+        if (cache && plugin->align_buffer == NULL)
+        {
+            /* nothing alters the data, so refer to the shared copy */
+            refbuf_release (refbuf);
+            refbuf = client->refbuf = refbuf_slice (cache, client->intro_offset, bytes);
+        }
+        else
+        {
+            if (refbuf->flags & REFBUF_SLICE)
+            {
+                refbuf_release (refbuf);
+                refbuf = client->refbuf = refbuf_new (4096);
+            }
+            if (cache)
+                memcpy (refbuf->data, cache->data + client->intro_offset, bytes);
+            else if (fseek (fp, client->intro_offset, SEEK_SET) < 0 ||
+                    (bytes = fread (refbuf->data, 1, 4096, fp)) <= 0)
+            {
+                return bytes < 0 ? -2 : -1;
+            }
         }
         refbuf->len = bytes;
         client->pos = 0;
@@ -197,63 +225,82 @@ int format_generic_write_to_client (client_t *client)
 }
 
 
-int format_general_headers (format_plugin_t *plugin, client_t *client)
+#define FORMAT_SEND_BLOCKS      WORKER_IOV_SCRATCH
+
+/* send from the client position on a source queue block, carrying on into
+ * the following blocks, up to limit bytes in one writev. If same_associated
+ * then stop at a block with different associated data. The client is moved
+ * along the queue by the amount sent, returns bytes sent.
+ */
+int format_send_queue_blocks (client_t *client, unsigned int limit, int same_associated)
 {
-    unsigned remaining = 4096 - client->refbuf->len;
-    char *ptr = client->refbuf->data + client->refbuf->len;
-    int bytes;
-    int bitrate_filtered = 0;
-    avl_node *node;
-    ice_config_t *config;
+    struct connection_bufs bufs;
+    refbuf_t *refbuf = client->refbuf, *associated = refbuf->associated;
+    unsigned int pos = client->pos, total = 0, left;
+    int ret;
 
-    if (client->respcode == 0)
+    connection_bufs_init_scratch (&bufs, client->worker->iov_scratch, FORMAT_SEND_BLOCKS);
+    while (refbuf && bufs.count < FORMAT_SEND_BLOCKS)
     {
-        const char *useragent = httpp_getvar (client->parser, "user-agent");
-        const char *protocol = "HTTP/1.0";
-        const char *contenttypehdr = "Content-Type";
-        const char *contenttype = plugin->contenttype;
+        unsigned int len = refbuf->len - pos;
 
-        if (useragent)
-        {
-            const char *resp = httpp_get_query_param (client->parser, "_hdr");
-            int fmtcode = 0;
-#define FMT_RETURN_ICY          1
-#define FMT_LOWERCASE_TYPE      2
-#define FMT_FORCE_AAC           4
+        if (same_associated && refbuf->associated != associated)
+            break;
+        if (len > limit - total)
+            len = limit - total;
+        if (len)
+            connection_bufs_append (&bufs, refbuf->data + pos, len);
+        total += len;
+        if (total >= limit)
+            break;
+        refbuf = refbuf_next (refbuf);
+        pos = 0;
+    }
+    ret = connection_bufs_send (&client->connection, &bufs, 0);
+    connection_bufs_release (&bufs);
+
+    if (ret < (int)total)
+        client->schedule_ms += 50;
+    if (ret <= 0)
+        return ret;
+    left = ret;
+    while (1)
+    {
+        unsigned int len;
 
-            if (resp)
-                fmtcode = atoi (resp);
-            else
-            {
-                if (strstr (useragent, "shoutcastsource")) /* hack for mpc */
-                    fmtcode = FMT_RETURN_ICY;
-                if (strstr (useragent, "Windows-Media-Player")) /* hack for wmp*/
-                    fmtcode = FMT_RETURN_ICY;
-                if (strstr (useragent, "RealMedia")) /* hack for rp (mainly mobile) */
-                    fmtcode = FMT_RETURN_ICY;
-                if (strstr (useragent, "Shoutcast Server")) /* hack for sc_serv */
-                    fmtcode = FMT_LOWERCASE_TYPE;
-                // if (strstr (useragent, "Sonos"))
-                //    contenttypehdr = "content-type";
-                if (plugin->type == FORMAT_TYPE_AAC)
-                {
-                    if (strstr (useragent, "BlackBerry"))
-                        fmtcode = FMT_FORCE_AAC;
-                }
-            }
-            if (fmtcode & FMT_RETURN_ICY)
-                protocol = "ICY";
-            if (fmtcode & FMT_LOWERCASE_TYPE)
-                contenttypehdr = "content-type";
-            if (fmtcode & FMT_FORCE_AAC) // ie for avoiding audio/aacp
-                contenttype = "audio/aac";
+        refbuf = client->refbuf;
+        len = refbuf->len - client->pos;
+        if (left <= len)
+        {
+            client->pos += left;
+            break;
         }
-        bytes = snprintf (ptr, remaining, "%s 200 OK\r\n"
-                "%s: %s\r\n", protocol, contenttypehdr, contenttype);
-        remaining -= bytes;
-        ptr += bytes;
-        client->respcode = 200;
+        left -= len;
+        client_set_queue (client, refbuf_next (refbuf));
     }
+    client->queue_pos += ret;
+    client->counter += ret;
+    return ret;
+}
+
+
+/* mark the shared response headers as out of date, they are rebuilt by the
+ * next listener to need them */
+void format_reset_headers (format_plugin_t *plugin)
+{
+    plugin->headers_version++;
+}
+
+
+/* the headers sent to each listener after the status and content-type,
+ * taken from the source headers and server settings */
+static int format_render_headers (format_plugin_t *plugin, char *ptr, unsigned remaining)
+{
+    unsigned start = remaining;
+    int bytes;
+    int bitrate_filtered = 0;
+    avl_node *node;
+    ice_config_t *config;
 
     if (plugin->parser)
     {
@@ -331,6 +378,95 @@ int format_general_headers (format_plugin_t *plugin, client_t *client)
     remaining -= bytes;
     ptr += bytes;
 
+    return start - remaining;
+}
+
+
+/* for a source, the caller holds the source lock so the shared headers can
+ * be rebuilt here */
+int format_general_headers (format_plugin_t *plugin, client_t *client)
+{
+    unsigned remaining = 4096 - client->refbuf->len;
+    char *ptr = client->refbuf->data + client->refbuf->len;
+    int bytes;
+
+    if (client->respcode == 0)
+    {
+        const char *useragent = httpp_getvar (client->parser, "user-agent");
+        const char *protocol = "HTTP/1.0";
+        const char *contenttypehdr = "Content-Type";
+        const char *contenttype = plugin->contenttype;
+
+        if (useragent)
+        {
+            const char *resp = httpp_get_query_param (client->parser, "_hdr");
+            int fmtcode = 0;
+#define FMT_RETURN_ICY          1
+#define FMT_LOWERCASE_TYPE      2
+#define FMT_FORCE_AAC           4
+
+            if (resp)
+                fmtcode = atoi (resp);
+            else
+            {
+                if (strstr (useragent, "shoutcastsource")) /* hack for mpc */
+                    fmtcode = FMT_RETURN_ICY;
+                if (strstr (useragent, "Windows-Media-Player")) /* hack for wmp*/
+                    fmtcode = FMT_RETURN_ICY;
+                if (strstr (useragent, "RealMedia")) /* hack for rp (mainly mobile) */
+                    fmtcode = FMT_RETURN_ICY;
+                if (strstr (useragent, "Shoutcast Server")) /* hack for sc_serv */
+                    fmtcode = FMT_LOWERCASE_TYPE;
+                // if (strstr (useragent, "Sonos"))
+                //    contenttypehdr = "content-type";
+                if (plugin->type == FORMAT_TYPE_AAC)
+                {
+                    if (strstr (useragent, "BlackBerry"))
+                        fmtcode = FMT_FORCE_AAC;
+                }
+            }
+            if (fmtcode & FMT_RETURN_ICY)
+                protocol = "ICY";
+            if (fmtcode & FMT_LOWERCASE_TYPE)
+                contenttypehdr = "content-type";
+            if (fmtcode & FMT_FORCE_AAC) // ie for avoiding audio/aacp
+                contenttype = "audio/aac";
+        }
+        bytes = snprintf (ptr, remaining, "%s 200 OK\r\n"
+                "%s: %s\r\n", protocol, contenttypehdr, contenttype);
+        remaining -= bytes;
+        ptr += bytes;
+        client->respcode = 200;
+    }
+
+    if (plugin->parser)
+    {
+        refbuf_t *headers = plugin->headers;
+
+        if (headers == NULL || plugin->headers_built != plugin->headers_version)
+        {
+            char buf [4096];
+            int version = plugin->headers_version;
+
+            bytes = format_render_headers (plugin, buf, sizeof buf);
+            if (bytes >= (int)sizeof buf)
+                bytes = sizeof buf - 1;
+            if (headers)
+                refbuf_release (headers);
+            headers = plugin->headers = refbuf_new (bytes);
+            memcpy (headers->data, buf, bytes);
+            plugin->headers_built = version;
+        }
+        bytes = headers->len;
+        if (bytes >= remaining)
+            bytes = remaining - 1;
+        memcpy (ptr, headers->data, bytes);
+        ptr [bytes] = '\0';
+    }
+    else
+        bytes = format_render_headers (plugin, ptr, remaining);
+    remaining -= bytes;
+
     client->refbuf->len = 4096 - remaining;
     client->refbuf->flags |= WRITE_BLOCK_GENERIC;
     return 0;
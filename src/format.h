@@ -51,6 +51,12 @@ struct _format_plugin_tag
     struct rate_calc *out_bitrate;
     http_parser_t *parser;
 
+    /* response headers from the source headers and server id, rendered once
+     * and copied to each listener. rebuilt when version changes */
+    refbuf_t *headers;
+    int headers_version;
+    int headers_built;
+
     refbuf_t *(*get_buffer)(struct source_tag *);
     int (*write_buf_to_client)(client_t *client);
     void (*write_buf_to_file)(struct source_tag *source, refbuf_t *refbuf);
@@ -69,14 +75,16 @@ struct _format_plugin_tag
 format_type_t format_get_type(const char *contenttype);
 int format_get_plugin (format_plugin_t *plugin, client_t *client);
 int format_generic_write_to_client (client_t *client);
+int format_send_queue_blocks (client_t *client, unsigned int limit, int same_associated);
 
-int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp);
+int format_file_read (client_t *client, format_plugin_t *plugin, FILE *fp, refbuf_t *cache);
 int format_general_headers (format_plugin_t *plugin, client_t *client);
 
 void format_send_general_headers(format_plugin_t *format, 
         struct source_tag *source, client_t *client);
 
 void format_plugin_clear (format_plugin_t *format, client_t *client);
+void format_reset_headers (format_plugin_t *format);
 
 #endif  /* __FORMAT_H__ */
 
@@ -517,20 +517,33 @@ static int send_icy_metadata (client_t *client, refbuf_t *refbuf)
  */
 static int format_mp3_write_buf_to_client (client_t *client) 
 {
-    int ret = -1, len;
+    int ret = -1, len, limit = 2900; // do not send a huge amount out in one go
     mp3_client_data *client_mp3 = client->format_data;
     refbuf_t *refbuf = client->refbuf;
+    int queue_block = refbuf_flags (refbuf) & SOURCE_QUEUE_BLOCK;
 
     if (client_mp3->interval && client_mp3->interval == client_mp3->since_meta_block)
         return send_icy_metadata (client, refbuf);
 
+    if (queue_block)
+    {
+        source_t *source = client->shared_data;
+        limit = source->send_batch_size;
+    }
+    if (client_mp3->interval && limit > client_mp3->interval - client_mp3->since_meta_block)
+        limit = client_mp3->interval - client_mp3->since_meta_block;
     len = refbuf->len - client->pos;
-    if (client_mp3->interval && len > client_mp3->interval - client_mp3->since_meta_block)
-        len = client_mp3->interval - client_mp3->since_meta_block;
-    if (len > 2900)
-        len = 2900; // do not send a huge amount out in one go
+    if (len > limit)
+        len = limit;
 
-    if (len)
+    if (queue_block && len < limit && refbuf_next (refbuf))
+    {
+        /* behind on the queue so send from the following blocks as well */
+        ret = format_send_queue_blocks (client, limit, 0);
+        if (ret > 0)
+            client_mp3->since_meta_block += ret;
+    }
+    else if (len)
     {
         char *buf = refbuf->data + client->pos;
 
@@ -580,6 +580,19 @@ static int write_buf_to_client (client_t *client)
             if (client_data->headers_sent == 0)
                 break;
         }
+        if (refbuf_flags (refbuf) & SOURCE_QUEUE_BLOCK)
+        {
+            source_t *source = client->shared_data;
+
+            if (len < source->send_batch_size && refbuf_next (refbuf))
+            {
+                /* behind on the queue, carry on into blocks with the same headers */
+                ret = format_send_queue_blocks (client, source->send_batch_size, 1);
+                if (ret > 0)
+                    written += ret;
+                break;
+            }
+        }
         ret = client_send_bytes (client, buf, len);
 
         if (ret > 0)
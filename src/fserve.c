@@ -70,6 +70,9 @@
 
 #define BUFSIZE 4096
 
+/* largest file kept in memory for sharing between clients */
+#define FSERVE_CACHE_MAX (32*1024*1024)
+
 static spin_t pending_lock;
 static avl_tree *mimetypes = NULL;
 static avl_tree *fh_cache = NULL;
@@ -86,7 +89,15 @@ typedef struct {
     int peak;
     int max;
     FILE *fp;
+    refbuf_t *cache;    /* shared copy of the file contents, see fh_file_read */
+    time_t cache_mtime;
+    time_t cache_check; /* next check for changes, see fserve_scan */
+    unsigned long out_bytes;    /* sent but not yet in the format bitrate */
+    time_t out_flush;
     time_t stats_update;
+    stats_counter_t stats_listeners;    /* fallback mount stats */
+    stats_counter_t stats_peak;
+    stats_counter_t stats_kbitrate;
     format_plugin_t *format;
     avl_tree *clients;
 } fh_node;
@@ -207,6 +218,10 @@ static int _delete_fh (void *mapping)
 
     if (fh->fp)
         fclose (fh->fp);
+    refbuf_release (fh->cache);
+    stats_slot_release (fh->stats_listeners);
+    stats_slot_release (fh->stats_peak);
+    stats_slot_release (fh->stats_kbitrate);
     if (fh->format)
     {
         free (fh->format->mount);
@@ -222,6 +237,18 @@ static int _delete_fh (void *mapping)
 }
 
 
+/* fallback mount stats updated by clients of this handle */
+static void fh_stats_slots (fh_node *fh, const char *mount)
+{
+    long stats = stats_handle (mount);
+
+    fh->stats_listeners = stats_slot (stats, "listeners", STATS_GENERAL|STATS_HIDDEN);
+    fh->stats_peak = stats_slot (stats, "listener_peak", STATS_GENERAL|STATS_HIDDEN);
+    fh->stats_kbitrate = stats_slot (stats, "outgoing_kbitrate", STATS_COUNTERS|STATS_HIDDEN);
+    stats_release (stats);
+}
+
+
 static int remove_fh_from_cache (fh_node *fh)
 {
     int ret = 0;
@@ -257,6 +284,208 @@ static fh_node *find_fh (fbinfo *finfo)
 }
 
 
+/* read the whole of the open file into a refbuf that clients can share, instead
+ * of each reading through the file handle. NULL if the file is unsuitable.
+ */
+refbuf_t *fserve_load_file (FILE *fp, time_t *mtime)
+{
+    struct stat st;
+    refbuf_t *cache;
+
+    if (fp == NULL || fstat (fileno (fp), &st) < 0)
+        return NULL;
+    if (mtime)
+        *mtime = st.st_mtime;
+    if (st.st_size == 0 || st.st_size > FSERVE_CACHE_MAX)
+        return NULL;
+    cache = refbuf_new (st.st_size);
+    if (fseeko (fp, 0, SEEK_SET) < 0 || fread (cache->data, 1, cache->len, fp) != cache->len)
+    {
+        refbuf_release (cache);
+        return NULL;
+    }
+    return cache;
+}
+
+
+/* fallback file handles due to be checked for changes, see fserve_scan */
+typedef struct _fh_check
+{
+    struct _fh_check *next;
+    fbinfo finfo;
+    time_t mtime;
+} fh_check;
+
+
+/* reload the shared copy of a fallback file if it has changed. The file is
+ * read without any lock held, the new copy and file handle are swapped in
+ * under the handle lock if the handle is still there and not already
+ * updated. Clients still on the old copy hold a reference on it.
+ */
+static void fh_recheck (fh_check *check)
+{
+    struct stat st;
+    char *fullpath = util_get_path_from_normalised_uri (check->finfo.mount, check->finfo.flags&FS_USE_ADMIN);
+    FILE *fp = NULL;
+    refbuf_t *cache = NULL;
+    time_t mtime = check->mtime;
+    fh_node *fh;
+
+    if (stat (fullpath, &st) == 0 && st.st_mtime != mtime)
+    {
+        mtime = st.st_mtime;
+        fp = fopen (fullpath, "rb");
+        if (fp)
+        {
+            INFO1 ("file \"%s\" has changed, reloading", check->finfo.mount);
+            cache = fserve_load_file (fp, &mtime);
+        }
+    }
+    free (fullpath);
+    if (fp == NULL)
+        return;
+
+    avl_tree_rlock (fh_cache);
+    fh = find_fh (&check->finfo);
+    if (fh)
+    {
+        thread_mutex_lock (&fh->lock);
+        if (fh->cache_mtime == check->mtime)
+        {
+            FILE *old_fp = fh->fp;
+            refbuf_t *old = fh->cache;
+
+            fh->fp = fp;
+            atomic_store (&fh->cache, cache);
+            fh->cache_mtime = mtime;
+            fp = old_fp;
+            cache = old;
+        }
+        thread_mutex_unlock (&fh->lock);
+    }
+    avl_tree_unlock (fh_cache);
+    if (fp)
+        fclose (fp);
+    refbuf_release (cache);
+}
+
+
+/* check fallback files in use for changes, called once a second from the
+ * slave thread so that no worker is held up reading them.
+ */
+void fserve_scan (time_t now)
+{
+    fh_check *list = NULL, **tailp = &list;
+    avl_node *node;
+
+    avl_tree_rlock (fh_cache);
+    node = avl_get_first (fh_cache);
+    while (node)
+    {
+        fh_node *fh = node->key;
+
+        node = avl_get_next (node);
+        if ((fh->finfo.flags & FS_FALLBACK) == 0 || fh->finfo.mount[0] == 0)
+            continue;
+        thread_mutex_lock (&fh->lock);
+        if (fh->cache_check <= now)
+        {
+            fh_check *check = calloc (1, sizeof (fh_check));
+
+            fh->cache_check = now + 5;
+            check->finfo = fh->finfo;
+            check->finfo.mount = strdup (fh->finfo.mount);
+            check->finfo.fallback = NULL;
+            check->mtime = fh->cache_mtime;
+            *tailp = check;
+            tailp = &check->next;
+        }
+        thread_mutex_unlock (&fh->lock);
+    }
+    avl_tree_unlock (fh_cache);
+
+    while (list)
+    {
+        fh_check *check = list;
+
+        list = check->next;
+        fh_recheck (check);
+        free (check->finfo.mount);
+        free (check);
+    }
+}
+
+
+/* read the next block for the client. Clients hold a reference on the copy
+ * of the file they read from, so that a reload can drop it at any time. A
+ * slice of the current copy from the last read already has one, so the lock
+ * is only taken to start on a copy or to read through the file handle.
+ */
+static int fh_file_read (client_t *client, fh_node *fh)
+{
+    refbuf_t *cache = atomic_load (&fh->cache), *held = client->refbuf;
+    int ret;
+
+    if (cache && held && held->_owner == cache)
+        refbuf_addref (cache);
+    else
+    {
+        thread_mutex_lock (&fh->lock);
+        cache = fh->cache;
+        if (cache == NULL)
+        {
+            ret = format_file_read (client, fh->format, fh->fp, NULL);
+            thread_mutex_unlock (&fh->lock);
+            return ret;
+        }
+        refbuf_addref (cache);
+        thread_mutex_unlock (&fh->lock);
+    }
+    ret = format_file_read (client, fh->format, NULL, cache);
+    refbuf_release (cache);
+    return ret;
+}
+
+
+/* count bytes sent on the handle, they are added to the format bitrate by
+ * fh_update_stats so that sends do not need the handle lock */
+static void fh_add_bytes (fh_node *fh, unsigned int bytes)
+{
+#ifdef HAVE_ATOMIC_OPS
+    atomic_add (&fh->out_bytes, bytes);
+#else
+    thread_mutex_lock (&fh->lock);
+    fh->out_bytes += bytes;
+    thread_mutex_unlock (&fh->lock);
+#endif
+}
+
+
+/* once a second add the bytes sent to the bitrate, and every 5 seconds update
+ * the stats */
+static void fh_update_stats (fh_node *fh, worker_t *worker, time_t now)
+{
+    unsigned long bytes;
+
+    thread_mutex_lock (&fh->lock);
+    if (fh->out_flush > now)
+    {
+        thread_mutex_unlock (&fh->lock);
+        return;
+    }
+    bytes = atomic_load (&fh->out_bytes);
+    atomic_sub (&fh->out_bytes, bytes);
+    rate_add (fh->format->out_bitrate, bytes, worker->time_ms);
+    atomic_store (&fh->out_flush, now + 1);
+    if (fh->stats_update <= now)
+    {
+        stats_counter_set (fh->stats_kbitrate, (long)((8 * rate_avg (fh->format->out_bitrate))/1024));
+        fh->stats_update = now + 5;
+    }
+    thread_mutex_unlock (&fh->lock);
+}
+
+
 /* find/create handle and return it with the structure in a locked state */
 static fh_node *open_fh (fbinfo *finfo, client_t *client)
 {
@@ -283,11 +512,13 @@ static fh_node *open_fh (fbinfo *finfo, client_t *client)
         {
             if (finfo->mount && (finfo->flags & FS_FALLBACK))
             {
-                stats_event_args (result->finfo.mount, "listeners", "%ld", result->refcount);
+                if (result->stats_listeners == NULL)
+                    fh_stats_slots (result, finfo->mount);
+                stats_counter_set (result->stats_listeners, result->refcount);
                 if (result->refcount > result->peak)
                 {
                     result->peak = result->refcount;
-                    stats_event_args (result->finfo.mount, "listener_peak", "%ld", result->peak);
+                    stats_counter_set (result->stats_peak, result->peak);
                 }
             }
             avl_insert (result->clients, client);
@@ -362,6 +593,7 @@ static fh_node *open_fh (fbinfo *finfo, client_t *client)
                 fh->format->create_client_data (fh->format, client);
             if (fh->format->write_buf_to_client)
                 client->check_buffer = fh->format->write_buf_to_client;
+            fh->cache = fserve_load_file (fh->fp, &fh->cache_mtime);
         }
     }
     thread_mutex_create (&fh->lock);
@@ -373,8 +605,9 @@ static fh_node *open_fh (fbinfo *finfo, client_t *client)
     {
         if (finfo->mount && (finfo->flags & FS_FALLBACK))
         {
-            stats_event_flags (fh->finfo.mount, "listeners", "1", STATS_GENERAL|STATS_HIDDEN);
-            stats_event_flags (fh->finfo.mount, "listener_peak", "1", STATS_GENERAL|STATS_HIDDEN);
+            stats_event_flags (finfo->mount, "listeners", "1", STATS_GENERAL|STATS_HIDDEN);
+            stats_event_flags (finfo->mount, "listener_peak", "1", STATS_GENERAL|STATS_HIDDEN);
+            fh_stats_slots (fh, finfo->mount);
         }
         avl_insert (fh->clients, client);
     }
@@ -635,7 +868,7 @@ int fserve_client_create (client_t *httpclient, const char *path)
     }
 
     thread_mutex_unlock (&fh->lock);
-    stats_event_inc (NULL, "file_connections");
+    stats_counter_add (stats_counters.file_connections, 1);
     return fserve_setup_client_fb (httpclient, NULL);
 }
 
@@ -679,7 +912,7 @@ static void file_release (client_t *client)
     {
         thread_mutex_lock (&fh->lock);
         if (fh->finfo.flags & FS_FALLBACK)
-            stats_event_dec (NULL, "listeners");
+            stats_counter_add (stats_counters.listeners, -1);
         remove_from_fh (fh, client);
         fh_release (fh);
     }
@@ -745,6 +978,9 @@ static int fserve_move_listener (client_t *client)
 }
 
 struct _client_functions throttled_file_content_ops;
+#ifdef HAVE_SYS_SENDFILE_H
+struct _client_functions sendfile_content_ops;
+#endif
 
 static int prefile_send (client_t *client)
 {
@@ -772,6 +1008,11 @@ static int prefile_send (client_t *client)
                         int len = 8192;
                         if (fh->finfo.flags & FS_FALLBACK)
                             client->ops = &throttled_file_content_ops;
+#ifdef HAVE_SYS_SENDFILE_H
+                        else if (not_ssl_connection (&client->connection) &&
+                                client->check_buffer == format_generic_write_to_client)
+                            client->ops = &sendfile_content_ops;
+#endif
                         else
                             client->ops = &file_content_ops;
                         refbuf_release (client->refbuf);
@@ -805,7 +1046,7 @@ static int prefile_send (client_t *client)
             return 0;
         }
         written += bytes;
-        global_add_bitrates (global.out_bitrate, bytes, worker->time_ms);
+        global_add_bitrates (worker, bytes);
         if (written > 30000)
             break;
     }
@@ -818,6 +1059,16 @@ static int read_file (client_t *client, int blksize)
     fh_node *fh = client->shared_data;
     int bytes = 0;
 
+#ifdef HAVE_PREAD
+    /* the offset is per client so the handle does not need locking */
+    bytes = pread (fileno (fh->fp), refbuf->data, blksize, client->intro_offset);
+    if (bytes < 0)
+    {
+        client->connection.error = 1;
+        bytes = 0;
+    }
+#else
+    thread_mutex_lock (&fh->lock);
     switch (fseeko (fh->fp, client->intro_offset, SEEK_SET))
     {
         case -1:
@@ -825,11 +1076,13 @@ static int read_file (client_t *client, int blksize)
             break;
         default:
             bytes = fread (refbuf->data, 1, blksize, fh->fp);
-            if (bytes > 0)
-            {
-                refbuf->len = bytes;
-                client->intro_offset += bytes;
-            }
+    }
+    thread_mutex_unlock (&fh->lock);
+#endif
+    if (bytes > 0)
+    {
+        refbuf->len = bytes;
+        client->intro_offset += bytes;
     }
     return bytes;
 }
@@ -840,7 +1093,6 @@ static int file_send (client_t *client)
 {
     refbuf_t *refbuf = client->refbuf;
     int loop = 6, bytes, written = 0, ret = 0;
-    fh_node *fh = client->shared_data;
     worker_t *worker = client->worker;
     time_t now;
 
@@ -862,9 +1114,7 @@ static int file_send (client_t *client)
             return -1;
         if (client->pos == refbuf->len)
         {
-            thread_mutex_lock (&fh->lock);
             ret = read_file (client, 8192);
-            thread_mutex_unlock (&fh->lock);
             if (ret == 0)
                 return -1;
             client->pos = 0;
@@ -879,6 +1129,49 @@ static int file_send (client_t *client)
 }
 
 
+#ifdef HAVE_SYS_SENDFILE_H
+/* zero copy version of file_send, the kernel sends straight from the file */
+static int file_sendfile (client_t *client)
+{
+    fh_node *fh = client->shared_data;
+    worker_t *worker = client->worker;
+    time_t now = worker->current_time.tv_sec;
+    off_t offset = client->intro_offset;
+    int bytes;
+
+    client->schedule_ms = worker->time_ms;
+    if (fserve_running == 0 || client->connection.error)
+        return -1;
+    if (client->connection.discon_time && now >= client->connection.discon_time)
+        return -1;
+    /* slowdown if max bandwidth is exceeded, as file_send */
+    if (throttle_sends > 1 && now - client->connection.con_time > 1)
+        client->schedule_ms += 300;
+
+    bytes = connection_sendfile (&client->connection, fileno (fh->fp), &offset, 65536);
+    if (bytes == -2)
+    {
+        DEBUG1 ("sendfile not usable on %s, reading instead", fh->finfo.mount);
+        client->ops = &file_content_ops;
+        return 0;
+    }
+    if (bytes == 0)
+        return -1;  /* end of file */
+    if (bytes > 0)
+        client->intro_offset = offset;
+    client->schedule_ms += 3;
+    return 0;
+}
+
+
+struct _client_functions sendfile_content_ops =
+{
+    file_sendfile,
+    file_release
+};
+#endif
+
+
 /* send routine for files sent at a target bitrate, eg fallback files. */
 static int throttled_file_send (client_t *client)
 {
@@ -906,42 +1199,33 @@ static int throttled_file_send (client_t *client)
     if (secs)
         rate = (client->counter+1400)/secs;
     // DEBUG3 ("counter %lld, duration %ld, limit %u", client->counter, secs, rate);
-    thread_mutex_lock (&fh->lock);
     if (rate > limit || secs < 3)
     {
         if (limit >= 1400)
             client->schedule_ms += 1000/(limit/1400);
         else
             client->schedule_ms += 50; // should not happen but guard against it
-        rate_add (fh->format->out_bitrate, 0, worker->time_ms);
         if (secs > 2)
         {
-            thread_mutex_unlock (&fh->lock);
-            global_add_bitrates (global.out_bitrate, 0, worker->time_ms);
+            global_add_bitrates (worker, 0);
             return 0;
         }
     }
-    if (fh->stats_update <= now)
-    {
-        stats_event_args (fh->finfo.mount, "outgoing_kbitrate", "%ld",
-                (long)((8 * rate_avg (fh->format->out_bitrate))/1024));
-        fh->stats_update = now + 5;
-    }
+    if (atomic_load (&fh->out_flush) <= now)
+        fh_update_stats (fh, worker, now);
     if (client->pos == refbuf->len)
     {
         //DEBUG1 ("reading another block from offset %ld", client->intro_offset);
-        int ret = format_file_read (client, fh->format, fh->fp);
+        int ret = fh_file_read (client, fh);
 
         switch (ret)
         {
             case -1: /* loop fallback file  */
-                thread_mutex_unlock (&fh->lock);
                 // DEBUG0 ("loop of file triggered");
                 client->intro_offset = 0;
                 client->schedule_ms += 150;
                 return 0;
             case -2: /* non-recoverable */
-                thread_mutex_unlock (&fh->lock);
                 // DEBUG0 ("major failure on read, better leave");
                 return -1;
             default:  ;
@@ -952,9 +1236,8 @@ static int throttled_file_send (client_t *client)
     if (bytes < 0)
         bytes = 0;
     //DEBUG3 ("bytes %d, counter %ld, %ld", bytes, client->counter, client->worker->time_ms - (client->timer_start*1000));
-    rate_add (fh->format->out_bitrate, bytes, worker->time_ms);
-    thread_mutex_unlock (&fh->lock);
-    global_add_bitrates (global.out_bitrate, bytes, worker->time_ms);
+    fh_add_bytes (fh, bytes);
+    global_add_bitrates (worker, bytes);
     if (limit > 2800)
         client->schedule_ms += (1000/(limit/1400*2));
     else
@@ -1029,9 +1312,8 @@ int fserve_setup_client_fb (client_t *client, fbinfo *finfo)
     }
     else
     {
-        worker_t *worker = client->worker;
         client->flags |= CLIENT_ACTIVE;
-        worker_wakeup (worker); /* worker may of already processed client but make sure */
+        worker_wakeup_client (client); /* worker may of already processed client but make sure */
     }
     return 0;
 }
@@ -46,6 +46,8 @@ int  fserve_list_clients (client_t *client, const char *mount, int response, int
 int  fserve_list_clients_xml (xmlNodePtr srcnode, fbinfo *finfo);
 int  fserve_kill_client (client_t *client, const char *mount, int response);
 int  fserve_query_count (fbinfo *finfo);
+refbuf_t *fserve_load_file (FILE *fp, time_t *mtime);
+void fserve_scan (time_t now);
 
 
 extern int fserve_running;
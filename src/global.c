@@ -72,12 +72,14 @@ void global_unlock(void)
     thread_mutex_unlock(&_global_mutex);
 }
 
-void global_add_bitrates (struct rate_calc *rate, unsigned long value, uint64_t milli)
+/* add to the server wide rate and work out how much sends are to be throttled
+ * by, global spinlock held */
+static void global_rate_update (unsigned long value, uint64_t milli)
 {
     float avg;
-    thread_spin_lock (&global.spinlock);
-    rate_add (rate, value, milli);
-    avg = rate_avg (rate);
+
+    rate_add (global.out_bitrate, value, milli);
+    avg = rate_avg (global.out_bitrate);
 
     if (global.max_rate)
     {
@@ -91,6 +93,28 @@ void global_add_bitrates (struct rate_calc *rate, unsigned long value, uint64_t
         else if (throttle_sends > 0)
             throttle_sends--;
     }
+}
+
+/* bytes sent to listeners are counted on the worker and added to the server
+ * wide rate at intervals, so that each send does not write to the shared rate */
+void global_add_bitrates (struct _worker_t *worker, unsigned long value)
+{
+    worker->out_bytes += value;
+    if (worker->time_ms < worker->out_flush_ms)
+        return;
+    worker->out_flush_ms = worker->time_ms + GLOBAL_RATE_INTERVAL;
+
+    thread_spin_lock (&global.spinlock);
+    global_rate_update (worker->out_bytes, worker->time_ms);
+    thread_spin_unlock (&global.spinlock);
+    worker->out_bytes = 0;
+}
+
+/* called periodically so the rate falls away when nothing is being sent */
+void global_update_bitrates (uint64_t milli)
+{
+    thread_spin_lock (&global.spinlock);
+    global_rate_update (0, milli);
     thread_spin_unlock (&global.spinlock);
 }
 
@@ -97,7 +97,13 @@ void global_initialize(void);
 void global_shutdown(void);
 void global_lock(void);
 void global_unlock(void);
-void global_add_bitrates (struct rate_calc *rate, unsigned long value, uint64_t milli);
+struct _worker_t;
+
+/* ms between each worker adding its sent bytes to the global rate */
+#define GLOBAL_RATE_INTERVAL    100
+
+void global_add_bitrates (struct _worker_t *worker, unsigned long value);
+void global_update_bitrates (uint64_t milli);
 void global_reduce_bitrate_sampling (struct rate_calc *rate);
 unsigned long global_getrate_avg (struct rate_calc *rate);
 
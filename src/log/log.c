@@ -26,6 +26,7 @@
 
 #ifndef _WIN32
 #include <pthread.h>
+#include <signal.h>
 #else
 #include <windows.h>
 #endif
@@ -33,8 +34,17 @@
 #include "log.h"
 
 #define LOG_MAXLOGS logs_allocated
+#define LOG_ID_BLOCK 20     /* loglist grows by this many */
 #define LOG_MAXLINELEN 1024
 
+/* lines can be queued for a writer thread when atomics and writev are
+ * available, otherwise they are written by the calling thread */
+#if defined(__ATOMIC_ACQUIRE) && defined(HAVE_WRITEV) && !defined(_WIN32)
+#define LOG_ASYNC 1
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
 #ifdef _WIN32
 #define mutex_t CRITICAL_SECTION
 // #define snprintf _snprintf
@@ -73,6 +83,8 @@ typedef struct log_tag
     unsigned int keep_entries;
     log_entry_t *log_head;
     log_entry_t *log_tail;
+
+    unsigned long dropped_reported; /* writer only, see log_drops_t */
     
     char *buffer;
 } log_t;
@@ -80,6 +92,57 @@ typedef struct log_tag
 int logs_allocated;
 static log_t *loglist;
 
+#ifdef LOG_ASYNC
+/* bounded queue of formatted lines, any thread can add, the writer thread
+ * takes them off. Each slot has a sequence number which says whether it is
+ * free for the producer at that position or ready for the writer.
+ */
+#define LOG_QUEUE_SLOTS     1024
+#define LOG_SLOTLEN         (LOG_MAXLINELEN + 256)
+#define LOG_WRITE_BATCH     64
+
+typedef struct
+{
+    unsigned long seq;
+    int log_id;
+    unsigned int len;
+    char line [LOG_SLOTLEN];
+} log_slot_t;
+
+/* lines lost with the queue full. The callers count these without the
+ * logger lock so they are kept in blocks, one per LOG_ID_BLOCK logs, which
+ * are not moved when loglist is reallocated */
+typedef struct log_drops_t
+{
+    struct log_drops_t *next;
+    unsigned long count [LOG_ID_BLOCK];
+} log_drops_t;
+
+static log_drops_t *_log_drops;
+static log_slot_t *_log_queue;
+static unsigned long _log_queue_head;   /* next position to fill */
+static unsigned long _log_queue_tail;   /* next position to write, writer only */
+static int _log_queue_users;            /* callers in log_queue_line */
+static int _log_writer_running;
+static int _log_writer_waiting;
+static pthread_t _log_writer;
+static pthread_mutex_t _log_wait_mutex;
+static pthread_cond_t _log_wait_cond;
+#endif
+
+/* the date strings for the current second, formatted once per thread each
+ * second instead of for every line */
+typedef struct
+{
+    time_t now;
+    int len [2];
+    char str [2][40];
+} log_time_cache_t;
+
+#ifndef _WIN32
+static pthread_key_t _log_time_key;
+#endif
+
 static int _get_log_id(void);
 static void _release_log_id(int log_id);
 static void _lock_logger(void);
@@ -154,6 +217,7 @@ static void log_init (log_t *log)
     log->keep_entries = 0;
     log->log_head = NULL;
     log->log_tail = NULL;
+    log->dropped_reported = 0;
 }
 
 void log_initialize(void)
@@ -165,6 +229,7 @@ void log_initialize(void)
     /* initialize mutexes */
 #ifndef _WIN32
     pthread_mutex_init(&_logger_mutex, NULL);
+    pthread_key_create (&_log_time_key, free);
 #else
     InitializeCriticalSection(&_logger_mutex);
 #endif
@@ -366,9 +431,20 @@ void log_close(int log_id)
 void log_shutdown(void)
 {
     free (loglist);
+#ifdef LOG_ASYNC
+    while (_log_drops)
+    {
+        log_drops_t *next = _log_drops->next;
+        free (_log_drops);
+        _log_drops = next;
+    }
+#endif
     /* destroy mutexes */
 #ifndef _WIN32
     pthread_mutex_destroy(&_logger_mutex);
+    free (pthread_getspecific (_log_time_key));
+    pthread_setspecific (_log_time_key, NULL);
+    pthread_key_delete (_log_time_key);
 #else
     DeleteCriticalSection(&_logger_mutex);
 #endif 
@@ -377,17 +453,14 @@ void log_shutdown(void)
 }
 
 
-static int create_log_entry (int log_id, const char *pre, const char *line)
+/* keep a copy of the line for log_contents, logger lock held */
+static log_entry_t *keep_log_entry (int log_id, const char *pre, const char *line, unsigned int len)
 {
-    log_entry_t *entry;
+    log_entry_t *entry = calloc (1, sizeof (log_entry_t));
 
-    if (loglist[log_id].keep_entries == 0)
-        return fprintf (loglist[log_id].logfile, "%s%s\n", pre, line); 
-    
-    entry = calloc (1, sizeof (log_entry_t));
-    entry->len = strlen (pre) + strlen (line);
+    entry->len = strlen (pre) + len;
     entry->line = malloc (entry->len+1);
-    snprintf (entry->line, entry->len+1, "%s%s", pre, line);
+    snprintf (entry->line, entry->len+1, "%s%.*s", pre, (int)len, line);
     loglist [log_id].total += entry->len;
 
     if (loglist [log_id].log_tail)
@@ -407,6 +480,18 @@ static int create_log_entry (int log_id, const char *pre, const char *line)
     }
     else
         loglist [log_id].entries++;
+    return entry;
+}
+
+
+static int create_log_entry (int log_id, const char *pre, const char *line)
+{
+    log_entry_t *entry;
+
+    if (loglist[log_id].keep_entries == 0)
+        return fprintf (loglist[log_id].logfile, "%s%s\n", pre, line); 
+    
+    entry = keep_log_entry (log_id, pre, line, strlen (line));
     return fprintf (loglist [log_id].logfile, "%s\n", entry->line);
 }
 
@@ -442,6 +527,329 @@ void log_contents (int log_id, char **_contents, unsigned int *_len)
 }
 
 
+#ifdef LOG_ASYNC
+static unsigned long *log_drops_counter (int log_id)
+{
+    log_drops_t *drops = __atomic_load_n (&_log_drops, __ATOMIC_ACQUIRE);
+
+    for (; log_id >= LOG_ID_BLOCK; log_id -= LOG_ID_BLOCK)
+        drops = __atomic_load_n (&drops->next, __ATOMIC_ACQUIRE);
+    return &drops->count [log_id];
+}
+
+
+/* queue a line for the writer, returns 0 if the writer is not running so the
+ * caller should write it */
+static int log_queue_line (int log_id, const char *pre, const char *line)
+{
+    unsigned long pos;
+    log_slot_t *slot;
+    int len;
+
+    /* log_stop_writer waits for the callers in here before the queue goes */
+    __atomic_add_fetch (&_log_queue_users, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&_log_writer_running, __ATOMIC_SEQ_CST) == 0)
+    {
+        __atomic_sub_fetch (&_log_queue_users, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    pos = __atomic_load_n (&_log_queue_head, __ATOMIC_RELAXED);
+    while (1)
+    {
+        long diff;
+
+        slot = &_log_queue [pos % LOG_QUEUE_SLOTS];
+        diff = (long)(__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n (&_log_queue_head, &pos, pos+1, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            /* writer is too far behind, the line is dropped rather than
+             * hold up the caller */
+            __atomic_add_fetch (log_drops_counter (log_id), 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch (&_log_queue_users, 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        else
+            pos = __atomic_load_n (&_log_queue_head, __ATOMIC_RELAXED);
+    }
+    len = snprintf (slot->line, LOG_SLOTLEN, "%s%s\n", pre, line);
+    if (len < 0 || len >= LOG_SLOTLEN)
+    {
+        len = LOG_SLOTLEN - 1;
+        slot->line [len-1] = '\n';
+    }
+    slot->len = len;
+    slot->log_id = log_id;
+    __atomic_store_n (&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n (&_log_writer_waiting, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n (&_log_writer_waiting, 0, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock (&_log_wait_mutex);
+        pthread_cond_signal (&_log_wait_cond);
+        pthread_mutex_unlock (&_log_wait_mutex);
+    }
+    __atomic_sub_fetch (&_log_queue_users, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+static int log_queue_ready (void)
+{
+    log_slot_t *slot = &_log_queue [_log_queue_tail % LOG_QUEUE_SLOTS];
+    return __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) == _log_queue_tail + 1;
+}
+
+
+/* write out the queued lines for a log, logger lock held */
+static void log_write_lines (int log_id, struct iovec *iov, int count, time_t now)
+{
+    log_t *log = &loglist [log_id];
+    unsigned long dropped;
+    int i;
+
+    if (_log_open (log_id, now) == 0)
+        return;
+    dropped = __atomic_load_n (log_drops_counter (log_id), __ATOMIC_RELAXED);
+    if (dropped != log->dropped_reported)
+    {
+        fprintf (log->logfile, "%lu log lines dropped\n", dropped - log->dropped_reported);
+        log->dropped_reported = dropped;
+    }
+    fflush (log->logfile);
+    for (i = 0; i < count; i++)
+    {
+        if (log->keep_entries)
+            keep_log_entry (log_id, "", iov[i].iov_base, iov[i].iov_len-1);
+        log->size += iov[i].iov_len;
+    }
+    while (count)
+    {
+        ssize_t ret = writev (fileno (log->logfile), iov, count);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        while (count && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count)
+        {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+
+/* take a batch of lines off the queue, writing runs of the same log with a
+ * single writev. returns the number of lines taken */
+static int log_write_queued (void)
+{
+    struct iovec iov [LOG_WRITE_BATCH];
+    unsigned long start = _log_queue_tail;
+    int count = 0, run = 0, log_id = -1;
+    time_t now = time (NULL);
+
+    _lock_logger();
+    while (count < LOG_WRITE_BATCH && log_queue_ready())
+    {
+        log_slot_t *slot = &_log_queue [_log_queue_tail % LOG_QUEUE_SLOTS];
+
+        if (slot->log_id != log_id && run)
+        {
+            log_write_lines (log_id, iov + count - run, run, now);
+            run = 0;
+        }
+        log_id = slot->log_id;
+        iov [count].iov_base = slot->line;
+        iov [count].iov_len = slot->len;
+        count++;
+        run++;
+        _log_queue_tail++;
+    }
+    if (run)
+        log_write_lines (log_id, iov + count - run, run, now);
+    _unlock_logger();
+
+    /* hand the slots back to the producers */
+    while (start != _log_queue_tail)
+    {
+        log_slot_t *slot = &_log_queue [start % LOG_QUEUE_SLOTS];
+        __atomic_store_n (&slot->seq, start + LOG_QUEUE_SLOTS, __ATOMIC_RELEASE);
+        start++;
+    }
+    return count;
+}
+
+
+static void *log_writer_thread (void *arg)
+{
+    sigset_t ss;
+
+    sigfillset (&ss);
+    pthread_sigmask (SIG_BLOCK, &ss, NULL);
+    while (1)
+    {
+        if (log_write_queued())
+            continue;
+        if (__atomic_load_n (&_log_writer_running, __ATOMIC_ACQUIRE) == 0)
+            break;
+        pthread_mutex_lock (&_log_wait_mutex);
+        __atomic_store_n (&_log_writer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (log_queue_ready() == 0)
+        {
+            struct timespec ts;
+
+            ts.tv_sec = time (NULL) + 1;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait (&_log_wait_cond, &_log_wait_mutex, &ts);
+        }
+        __atomic_store_n (&_log_writer_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock (&_log_wait_mutex);
+    }
+    return NULL;
+}
+#endif
+
+
+/* start a thread to do the log writes, callers only format and queue
+ * the lines. Lines are dropped, and counted, if the writer cannot keep up.
+ */
+int log_start_writer (void)
+{
+#ifdef LOG_ASYNC
+    unsigned long i;
+
+    if (_log_writer_running)
+        return 0;
+    _log_queue = malloc (LOG_QUEUE_SLOTS * sizeof (log_slot_t));
+    if (_log_queue == NULL)
+        return LOG_EINSANE;
+    for (i = 0; i < LOG_QUEUE_SLOTS; i++)
+        _log_queue[i].seq = i;
+    _log_queue_head = _log_queue_tail = 0;
+    pthread_mutex_init (&_log_wait_mutex, NULL);
+    pthread_cond_init (&_log_wait_cond, NULL);
+    _log_writer_running = 1;
+    if (pthread_create (&_log_writer, NULL, log_writer_thread, NULL) != 0)
+    {
+        _log_writer_running = 0;
+        pthread_cond_destroy (&_log_wait_cond);
+        pthread_mutex_destroy (&_log_wait_mutex);
+        free (_log_queue);
+        _log_queue = NULL;
+        return LOG_EINSANE;
+    }
+    return 0;
+#else
+    return LOG_ENOTIMPL;
+#endif
+}
+
+
+/* write out anything queued and return to writing from the callers */
+void log_stop_writer (void)
+{
+#ifdef LOG_ASYNC
+    if (_log_writer_running == 0)
+        return;
+    __atomic_store_n (&_log_writer_running, 0, __ATOMIC_SEQ_CST);
+    /* callers may still be filling a slot they claimed */
+    while (__atomic_load_n (&_log_queue_users, __ATOMIC_ACQUIRE))
+        usleep (1000);
+    pthread_mutex_lock (&_log_wait_mutex);
+    pthread_cond_signal (&_log_wait_cond);
+    pthread_mutex_unlock (&_log_wait_mutex);
+    pthread_join (_log_writer, NULL);
+    /* catch any that were queued as the writer was stopping */
+    while (log_write_queued())
+        ;
+    pthread_cond_destroy (&_log_wait_cond);
+    pthread_mutex_destroy (&_log_wait_mutex);
+    free (_log_queue);
+    _log_queue = NULL;
+#endif
+}
+
+
+static void log_time_format (log_time_cache_t *cache, time_t now)
+{
+    struct tm tm;
+#ifdef _WIN32
+    /* strftime %z is not the numeric offset here */
+    struct tm gmt;
+    long offset;
+    char fmt [40];
+
+    tm = *localtime (&now);
+    gmt = *gmtime (&now);
+    gmt.tm_isdst = tm.tm_isdst;
+    offset = (long)difftime (now, mktime (&gmt)) / 60;
+    snprintf (fmt, sizeof fmt, "%%d/%%b/%%Y:%%H:%%M:%%S %c%.2ld%.2ld",
+            offset < 0 ? '-' : '+', labs (offset) / 60, labs (offset) % 60);
+    cache->len [LOG_TIME_CLF] = strftime (cache->str [LOG_TIME_CLF], sizeof cache->str[0], fmt, &tm);
+#else
+    localtime_r (&now, &tm);
+    cache->len [LOG_TIME_CLF] = strftime (cache->str [LOG_TIME_CLF], sizeof cache->str[0],
+            "%d/%b/%Y:%H:%M:%S %z", &tm);
+#endif
+    cache->len [LOG_TIME_DATE] = strftime (cache->str [LOG_TIME_DATE], sizeof cache->str[0],
+            "[%Y-%m-%d  %H:%M:%S]", &tm);
+    cache->now = now;
+}
+
+
+/* read the clock and copy the date string of the type requested. Used for
+ * the error log prefix and the access log so lines in both agree, the
+ * string is only formatted when the second changes.
+ */
+time_t log_get_time (int type, char *buf, unsigned len, int *datelen)
+{
+    time_t now = time (NULL);
+    log_time_cache_t *cache;
+    int n;
+#ifndef _WIN32
+    cache = pthread_getspecific (_log_time_key);
+    if (cache == NULL)
+    {
+        cache = calloc (1, sizeof (log_time_cache_t));
+        if (cache == NULL)
+            abort();
+        pthread_setspecific (_log_time_key, cache);
+    }
+    if (cache->now != now)
+        log_time_format (cache, now);
+#else
+    log_time_cache_t local;
+
+    cache = &local;
+    log_time_format (cache, now);
+#endif
+    n = cache->len [type];
+    if (len == 0)
+        n = 0;
+    else if ((unsigned)n >= len)
+        n = len - 1;
+    memcpy (buf, cache->str [type], n);
+    buf [n] = '\0';
+    if (datelen)
+        *datelen = n;
+    return now;
+}
+
+
 void log_write(int log_id, unsigned priority, const char *cat, const char *func, 
         const char *fmt, ...)
 {
@@ -459,13 +867,17 @@ void log_write(int log_id, unsigned priority, const char *cat, const char *func,
     va_start(ap, fmt);
     vsnprintf(line, LOG_MAXLINELEN, fmt, ap);
 
-    now = time(NULL);
-
-    _lock_logger();
-    datelen = strftime (pre, sizeof (pre), "[%Y-%m-%d  %H:%M:%S]", localtime(&now)); 
-
+    now = log_get_time (LOG_TIME_DATE, pre, sizeof (pre), &datelen);
     snprintf (pre+datelen, sizeof (pre)-datelen, " %s %s%s ", prior [priority-1], cat, func);
 
+#ifdef LOG_ASYNC
+    if (log_queue_line (log_id, pre, line))
+    {
+        va_end(ap);
+        return;
+    }
+#endif
+    _lock_logger();
     if (_log_open (log_id, now))
     {
         int len = create_log_entry (log_id, pre, line);
@@ -489,8 +901,15 @@ void log_write_direct(int log_id, const char *fmt, ...)
 
     now = time(NULL);
 
-    _lock_logger();
     vsnprintf(line, LOG_MAXLINELEN, fmt, ap);
+#ifdef LOG_ASYNC
+    if (log_queue_line (log_id, "", line))
+    {
+        va_end(ap);
+        return;
+    }
+#endif
+    _lock_logger();
     if (_log_open (log_id, now))
     {
         int len = create_log_entry (log_id, "", line);
@@ -520,8 +939,24 @@ static int _get_log_id(void)
         }
     if (id == -1)
     {
-        int new_count = logs_allocated + 20;
-        log_t *new_list = realloc (loglist, new_count * sizeof (log_t));
+        int new_count = logs_allocated + LOG_ID_BLOCK;
+        log_t *new_list;
+#ifdef LOG_ASYNC
+        log_drops_t **drops = &_log_drops;
+        for (i = 0; i < logs_allocated; i += LOG_ID_BLOCK)
+            drops = &(*drops)->next;
+        if (*drops == NULL)
+        {
+            log_drops_t *block = calloc (1, sizeof (log_drops_t));
+            if (block == NULL)
+            {
+                _unlock_logger();
+                return -1;
+            }
+            __atomic_store_n (drops, block, __ATOMIC_RELEASE);
+        }
+#endif
+        new_list = realloc (loglist, new_count * sizeof (log_t));
         if (new_list)
         {
             for (i = logs_allocated; i < new_count; i++)
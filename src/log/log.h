@@ -9,6 +9,7 @@
 #define __LOG_H__
 
 #include <stdio.h>
+#include <time.h>
 
 #define LOG_EINSANE -1
 #define LOG_ENOMORELOGS -2
@@ -38,6 +39,12 @@ void log_reopen(int log_id);
 void log_close(int log_id);
 void log_shutdown(void);
 
+#define LOG_TIME_DATE   0       /* [YYYY-MM-DD  HH:MM:SS] error log prefix */
+#define LOG_TIME_CLF    1       /* DD/Mon/YYYY:HH:MM:SS +ZZZZ */
+time_t log_get_time (int type, char *buf, unsigned len, int *datelen);
+int  log_start_writer(void);
+void log_stop_writer(void);
+
 void log_write(int log_id, unsigned priority, const char *cat, const char *func, 
         const char *fmt, ...);
 void log_write_direct(int log_id, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
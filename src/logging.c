@@ -63,10 +63,8 @@ void logging_access_id (access_log *accesslog, client_t *client)
     if (client->flags & CLIENT_SKIP_ACCESSLOG)
         return;
 
-    now = time(NULL);
-
     /* build the data */
-    util_get_clf_time (datebuf, sizeof(datebuf), now);
+    now = log_get_time (LOG_TIME_CLF, datebuf, sizeof(datebuf), NULL);
     if (accesslog->qstr)
         req = httpp_getvar (client->parser, HTTPP_VAR_RAWURI);
     if (req == NULL)
@@ -129,16 +127,13 @@ void logging_access (client_t *client)
    you can assume that the log itself is UTF-8 encoded */
 void logging_playlist(const char *mount, const char *metadata, long listeners)
 {
-    time_t now;
     char datebuf[128];
 
     if (playlistlog == -1) {
         return;
     }
 
-    now = time(NULL);
-
-    util_get_clf_time (datebuf, sizeof(datebuf), now);
+    log_get_time (LOG_TIME_CLF, datebuf, sizeof(datebuf), NULL);
     /* This format MAY CHANGE OVER TIME.  We are looking into finding a good
        standard format for this, if you have any ideas, please let us know */
     log_write_direct (playlistlog, "%s|%s|%ld|%s",
@@ -263,6 +258,7 @@ int start_logging (ice_config_t *config)
         errorlog = log_open_file (stderr);
     if (strcmp(config->access_log.name, "-") == 0)
         config->access_log.logid = log_open_file (stderr);
+    log_start_writer();
     return restart_logging (config);
 }
 
@@ -270,6 +266,7 @@ int start_logging (ice_config_t *config)
 void stop_logging(void)
 {
     ice_config_t *config = config_get_config_unlocked();
+    log_stop_writer();
     log_close (errorlog);
     log_close (config->access_log.logid);
     log_close (config->playlist_log.logid);
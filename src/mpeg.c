@@ -18,6 +18,9 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
 
 #include "compat.h"
 #include "mpeg.h"
@@ -46,19 +49,33 @@ int mpeg_samplerates [4][4] = {
 #define LAYER_3     1
 
 
+/* a valid frame of len bytes at p has gap bytes of junk before it, move it
+ * down over them before any callback keeps pointers into it. A negative gap
+ * puts a rejected frame back so the scan resumes over the original bytes */
+static unsigned char *frame_close_gap (unsigned char *p, int len, int gap)
+{
+    if (gap)
+    {
+        memmove (p - gap, p, len);
+        p -= gap;
+    }
+    return p;
+}
+
 static int get_aac_frame_len (unsigned char *p)
 {
     return ((p[3] & 0x3) << 11) + (p[4] << 3) + ((p[5] & 0xE0) >> 5);
 }
 
-static int handle_aac_frame (struct mpeg_sync *mp, unsigned char *p, int len)
+static int handle_aac_frame (struct mpeg_sync *mp, unsigned char *p, int len, int gap)
 {
     int frame_len = get_aac_frame_len (p);
     int blocks, header_len = 9;
-    unsigned char *s = p;
+    unsigned char *s;
     if (len - frame_len < 0)
         return 0;
 
+    p = s = frame_close_gap (p, frame_len, gap);
     blocks = (p[6] & 0x3) + 1;
     if (p[1] & 0x1) // no crc
         header_len -= 2;
@@ -70,7 +87,10 @@ static int handle_aac_frame (struct mpeg_sync *mp, unsigned char *p, int len)
 
         if (mp->frame_callback)
             if (mp->frame_callback (mp, s, raw_frame_len) < 0)
+            {
+                frame_close_gap (p, frame_len, -gap);
                 return -1;
+            }
     }
     return frame_len;
 }
@@ -149,7 +169,7 @@ static int get_mpeg_frame_length (struct mpeg_sync *mp, unsigned char *p)
 }
 
 
-static int handle_mpeg_frame (struct mpeg_sync *mp, unsigned char *p, int remaining)
+static int handle_mpeg_frame (struct mpeg_sync *mp, unsigned char *p, int remaining, int gap)
 {
     int frame_len = get_mpeg_frame_length (mp, p);
 
@@ -170,22 +190,27 @@ static int handle_mpeg_frame (struct mpeg_sync *mp, unsigned char *p, int remain
     }
     if (remaining - frame_len < 0)
         return 0;
+    p = frame_close_gap (p, frame_len, gap);
     if (mp->raw)
     {
         if (mp->frame_callback)
             if (mp->frame_callback (mp, p, frame_len) < 0)
+            {
+                frame_close_gap (p, frame_len, -gap);
                 return -1;
+            }
     }
     return frame_len;
 }
 
 
-static int handle_ts_frame (struct mpeg_sync *mp, unsigned char *p, int remaining)
+static int handle_ts_frame (struct mpeg_sync *mp, unsigned char *p, int remaining, int gap)
 {
     int frame_len = mp->raw_offset;
 
     if (remaining - frame_len < 0)
         return 0;
+    frame_close_gap (p, frame_len, gap);
     return frame_len;
 }
 
@@ -378,7 +403,33 @@ static int match_syncbits (mpeg_sync *mp, unsigned char *p)
 }
 
 
-/* return number from 0 to remaining */
+/* locate the next byte that could start a frame when the stream type is
+ * not yet known, 0xFF for mpeg/aac or 0x47 for TS. NULL if none */
+static unsigned char *find_sync_start (unsigned char *p, int len)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+    __m128i ff = _mm_set1_epi8 ((char)0xFF), ts = _mm_set1_epi8 (0x47);
+
+    while (len >= 16)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+        int bits = _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (v, ff), _mm_cmpeq_epi8 (v, ts)));
+
+        if (bits)
+            return p + __builtin_ctz (bits);
+        p += 16;
+        len -= 16;
+    }
+#endif
+    for (; len; len--, p++)
+        if (*p == 0xFF || *p == 0x47)
+            return p;
+    return NULL;
+}
+
+
+/* return number of bytes from 0 to remaining before the next possible frame
+ * header. The bytes are not removed here */
 static int find_align_sync (mpeg_sync *mp, unsigned char *start, int remaining)
 {
     int skip = remaining, singlebyte = mp->mask & 0xFFFFFF ? 0 : 1;
@@ -406,26 +457,24 @@ static int find_align_sync (mpeg_sync *mp, unsigned char *start, int remaining)
             p = start + remaining;
     }
     else
-    {
-        int offset = remaining;
-        for (; offset && *p != 0xFF && *p != 0x47; offset--)
-            p++;
-        if (offset == 0) p = NULL;
-    }
+        p = find_sync_start (start, remaining);
     if (p)
     {
         skip = p - start;
-        memmove (start, p, remaining - skip);
         mp->resync_count += skip;
     }
     return skip;
 }
 
 
+/* Bytes that are not part of a frame are skipped over and the following
+ * frames moved down over them, so each byte is moved at most once however
+ * much is dropped.
+ */
 int mpeg_complete_frames (mpeg_sync *mp, refbuf_t *new_block, unsigned offset)
 {
     unsigned char *start, *end;
-    int remaining, frame_len = 0, ret, loop = 50;
+    int remaining, frame_len = 0, ret, loop = 50, dropped = 0, failed = 0, initial = 0;
 
     if (mp == NULL)
         return 0;  /* leave as-is */
@@ -449,16 +498,16 @@ int mpeg_complete_frames (mpeg_sync *mp, refbuf_t *new_block, unsigned offset)
         mp->surplus = NULL;
     }
     start = (unsigned char *)new_block->data + offset;
+    end = (unsigned char*)new_block->data + new_block->len;
     while (loop)
     {
-        end = (unsigned char*)new_block->data + new_block->len;
         remaining = end - start;
         //DEBUG2 ("block size %d, remaining now %d", new_block->len, remaining);
         if (remaining < 10) /* make sure we have some bytes to check */
             break;
         if (mp->mask && match_syncbits (mp, start) == 0) 
         {
-            frame_len = mp->process_frame (mp, start, remaining);
+            frame_len = mp->process_frame (mp, start, remaining, dropped);
             if (frame_len == 0)
                 break;
             if (frame_len > 0)
@@ -466,8 +515,8 @@ int mpeg_complete_frames (mpeg_sync *mp, refbuf_t *new_block, unsigned offset)
                 start += frame_len;
                 continue;
             }
-            memmove (start, start+1, remaining-1);
-            new_block->len--;
+            start++;
+            dropped++;
             continue;
         }
 
@@ -480,10 +529,12 @@ int mpeg_complete_frames (mpeg_sync *mp, refbuf_t *new_block, unsigned offset)
             if (mp->resync_count > 20000)
             {
                 INFO1 ("no frame sync after 20k on %s", mp->mount);
-                return -1;
+                failed = 1;
+                break;
             }
-            DEBUG2 ("no frame sync, re-checking after skipping %d (%d)", ret, new_block->len);
-            new_block->len -= ret;
+            DEBUG2 ("no frame sync, re-checking after skipping %d (%d)", ret, new_block->len - dropped - ret);
+            start += ret;
+            dropped += ret;
             continue;
         }
         if (mp->mask == 0)
@@ -498,13 +549,29 @@ int mpeg_complete_frames (mpeg_sync *mp, refbuf_t *new_block, unsigned offset)
             if (ret == 0)
             {
                 if (remaining > 20000)
-                    return -1;
-                new_block->len = offset;
-                return remaining;
+                    failed = 1;
+                initial = 1;
+                break;
             }
         }
         loop--;
     }
+    /* close the gap left by the dropped bytes */
+    if (dropped)
+    {
+        memmove (start - dropped, start, end - start);
+        start -= dropped;
+        end -= dropped;
+        new_block->len -= dropped;
+    }
+    if (failed)
+        return -1;
+    remaining = end - start;
+    if (initial)
+    {
+        new_block->len = offset;
+        return remaining;
+    }
     if (remaining < 0 || remaining > new_block->len)
     {
         ERROR2 ("block inconsistency (%d, %d)", remaining, new_block->len);
@@ -18,7 +18,7 @@
 
 typedef struct mpeg_sync
 {
-    int (*process_frame) (struct mpeg_sync *mp, unsigned char *p, int len);
+    int (*process_frame) (struct mpeg_sync *mp, unsigned char *p, int len, int gap);
     unsigned long mask;
     unsigned long match;
 
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifndef _WIN32
 #include <netdb.h>
@@ -59,6 +60,68 @@ static mutex_t _resolver_mutex;
 #endif
 static int _initialized = 0;
 
+#if defined (HAVE_GETNAMEINFO) && defined (HAVE_GETADDRINFO)
+
+/* recent lookups are kept for a short time, failures for less, so that
+ * many relays on the same host do not each wait on the same lookup.
+ */
+#define RESOLVER_CACHE_TTL      60
+#define RESOLVER_NEGATIVE_TTL   10
+#define RESOLVER_CACHE_MAX      256
+
+typedef struct resolver_entry
+{
+    struct resolver_entry *next;
+    char *key;
+    struct addrinfo *ai;
+    int error;
+    int pending;
+    time_t expire;
+} resolver_entry;
+
+static resolver_entry *_cache;
+static int _cache_count;
+
+#ifndef NO_THREAD
+static pthread_mutex_t _cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cache_cond = PTHREAD_COND_INITIALIZER;
+#define _cache_lock()   pthread_mutex_lock (&_cache_mutex)
+#define _cache_unlock() pthread_mutex_unlock (&_cache_mutex)
+#define _cache_wait()   pthread_cond_wait (&_cache_cond, &_cache_mutex)
+#define _cache_wakeup() pthread_cond_broadcast (&_cache_cond)
+#else
+#define _cache_lock()   do{}while(0)
+#define _cache_unlock() do{}while(0)
+#define _cache_wait()   do{}while(0)
+#define _cache_wakeup() do{}while(0)
+#endif
+
+/* lookups which cannot be answered straight away are queued for a small
+ * fixed pool of threads. A query is held by the caller and, until it has
+ * been run, by the queue. Both are under the queue lock.
+ */
+#define RESOLVER_THREADS        4
+
+struct resolver_query
+{
+    struct resolver_query *next;
+    char *name;
+    char *service;
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    int error;
+    int done;
+    int refs;
+};
+
+#ifndef NO_THREAD
+static resolver_query *_queue, **_queue_tail = &_queue;
+static int _threads, _threads_idle, _threads_stop;
+static pthread_mutex_t _queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _queue_cond = PTHREAD_COND_INITIALIZER;
+#endif
+#endif
+
 #ifdef HAVE_INET_PTON
 static int _isip(const char *what)
 {
@@ -84,6 +147,399 @@ static int _isip(const char *what)
 
 
 #if defined (HAVE_GETNAMEINFO) && defined (HAVE_GETADDRINFO)
+
+/* copy the list into memory we manage, so that it can be held in the
+ * cache and handed out to callers.
+ */
+static struct addrinfo *_copy_addrinfo (const struct addrinfo *ai)
+{
+    struct addrinfo *head = NULL, **tailp = &head;
+
+    for (; ai; ai = ai->ai_next)
+    {
+        struct addrinfo *n = malloc (sizeof (struct addrinfo) + ai->ai_addrlen);
+
+        if (n == NULL)
+        {
+            resolver_freeaddrinfo (head);
+            return NULL;
+        }
+        memcpy (n, ai, sizeof (struct addrinfo));
+        n->ai_addr = (struct sockaddr *)(n + 1);
+        memcpy (n->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        n->ai_canonname = NULL;
+        n->ai_next = NULL;
+        *tailp = n;
+        tailp = &n->ai_next;
+    }
+    return head;
+}
+
+
+static void _free_entry (resolver_entry *entry)
+{
+    resolver_freeaddrinfo (entry->ai);
+    free (entry->key);
+    free (entry);
+    _cache_count--;
+}
+
+
+/* drop expired entries, and the oldest if the cache is still full. Called
+ * with the cache locked.
+ */
+static void _trim_cache (time_t now)
+{
+    resolver_entry **prevp = &_cache, **lastp = NULL;
+
+    while (*prevp)
+    {
+        resolver_entry *entry = *prevp;
+
+        if (entry->pending == 0 && entry->expire <= now)
+        {
+            *prevp = entry->next;
+            _free_entry (entry);
+            continue;
+        }
+        if (entry->pending == 0)
+            lastp = prevp;
+        prevp = &entry->next;
+    }
+    if (_cache_count >= RESOLVER_CACHE_MAX && lastp)
+    {
+        resolver_entry *entry = *lastp;
+        *lastp = entry->next;
+        _free_entry (entry);
+    }
+}
+
+
+/* build the cache key for the lookup, returns -1 if it cannot be cached */
+static int _cache_key (char *key, int len, const char *name, const char *service,
+        const struct addrinfo *hints)
+{
+    if (name == NULL || _isip (name))
+        return -1;
+    if (snprintf (key, len, "%s/%s/%d/%d/%d/%d", name, service ? service : "",
+                hints ? hints->ai_family : 0, hints ? hints->ai_socktype : 0,
+                hints ? hints->ai_protocol : 0, hints ? hints->ai_flags : 0) >= len)
+        return -1;
+    return 0;
+}
+
+
+/* answer the lookup without waiting on DNS, for numeric addresses and
+ * recent results. Returns -1 if a lookup is needed, else 0 with the
+ * getaddrinfo result in errorp.
+ */
+static int _getaddrinfo_now (const char *name, const char *service,
+        const struct addrinfo *hints, struct addrinfo **res, int *errorp)
+{
+    resolver_entry *entry;
+    char key [300];
+    int ret = -1;
+
+    *res = NULL;
+    if (name && _isip (name))
+    {
+        struct addrinfo numeric, *head = NULL;
+
+        if (hints)
+            memcpy (&numeric, hints, sizeof (numeric));
+        else
+            memset (&numeric, 0, sizeof (numeric));
+        numeric.ai_flags |= AI_NUMERICHOST;
+        *errorp = getaddrinfo (name, service, &numeric, &head);
+        if (*errorp == 0)
+        {
+            *res = _copy_addrinfo (head);
+            freeaddrinfo (head);
+            if (*res == NULL)
+                *errorp = EAI_MEMORY;
+        }
+        return 0;
+    }
+    if (_cache_key (key, sizeof key, name, service, hints) < 0)
+        return -1;
+    _cache_lock();
+    for (entry = _cache; entry; entry = entry->next)
+    {
+        if (strcmp (entry->key, key) == 0)
+        {
+            if (entry->pending == 0 && entry->expire > time (NULL))
+            {
+                *errorp = entry->error;
+                if (entry->error == 0)
+                {
+                    *res = _copy_addrinfo (entry->ai);
+                    if (*res == NULL)
+                        *errorp = EAI_MEMORY;
+                }
+                ret = 0;
+            }
+            break;
+        }
+    }
+    _cache_unlock();
+    return ret;
+}
+
+
+/* getaddrinfo with a cache of recent results, including failures. Only one
+ * lookup for the same details is run at a time, others wait for that result.
+ * The result must be freed with resolver_freeaddrinfo.
+ */
+int resolver_getaddrinfo (const char *name, const char *service,
+        const struct addrinfo *hints, struct addrinfo **res)
+{
+    struct addrinfo *head = NULL;
+    resolver_entry *entry;
+    char key [300];
+    time_t now;
+    int ret;
+
+    *res = NULL;
+    if (_cache_key (key, sizeof key, name, service, hints) < 0)
+    {
+        ret = getaddrinfo (name, service, hints, &head);
+        if (ret == 0)
+        {
+            *res = _copy_addrinfo (head);
+            freeaddrinfo (head);
+            if (*res == NULL)
+                ret = EAI_MEMORY;
+        }
+        return ret;
+    }
+
+    _cache_lock();
+    while (1)
+    {
+        for (entry = _cache; entry; entry = entry->next)
+            if (strcmp (entry->key, key) == 0)
+                break;
+        if (entry == NULL || entry->pending == 0)
+            break;
+        _cache_wait();
+    }
+    now = time (NULL);
+    if (entry && entry->expire > now)
+    {
+        ret = entry->error;
+        if (ret == 0)
+        {
+            *res = _copy_addrinfo (entry->ai);
+            if (*res == NULL)
+                ret = EAI_MEMORY;
+        }
+        _cache_unlock();
+        return ret;
+    }
+    if (entry == NULL)
+    {
+        _trim_cache (now);
+        entry = calloc (1, sizeof (resolver_entry));
+        if (entry)
+            entry->key = strdup (key);
+        if (entry == NULL || entry->key == NULL)
+        {
+            free (entry);
+            _cache_unlock();
+            return EAI_MEMORY;
+        }
+        entry->next = _cache;
+        _cache = entry;
+        _cache_count++;
+    }
+    entry->pending = 1;
+    _cache_unlock();
+
+    ret = getaddrinfo (name, service, hints, &head);
+
+    _cache_lock();
+    resolver_freeaddrinfo (entry->ai);
+    entry->ai = NULL;
+    if (ret == 0)
+    {
+        entry->ai = _copy_addrinfo (head);
+        *res = _copy_addrinfo (head);
+        if (entry->ai == NULL || *res == NULL)
+            ret = EAI_MEMORY;
+    }
+    entry->error = ret;
+    entry->expire = time (NULL) + (ret ? RESOLVER_NEGATIVE_TTL : RESOLVER_CACHE_TTL);
+    if (ret == EAI_MEMORY)
+        entry->expire = 0;
+    entry->pending = 0;
+    _cache_wakeup();
+    _cache_unlock();
+    if (head)
+        freeaddrinfo (head);
+    if (ret && *res)
+    {
+        resolver_freeaddrinfo (*res);
+        *res = NULL;
+    }
+    return ret;
+}
+
+
+void resolver_freeaddrinfo (struct addrinfo *ai)
+{
+    while (ai)
+    {
+        struct addrinfo *next = ai->ai_next;
+        free (ai);
+        ai = next;
+    }
+}
+
+
+/* drop a reference, called with the queue locked */
+static void _query_release (resolver_query *query)
+{
+    if (--query->refs > 0)
+        return;
+    resolver_freeaddrinfo (query->ai);
+    free (query->name);
+    free (query->service);
+    free (query);
+}
+
+
+#ifndef NO_THREAD
+static void *_resolver_thread (void *arg)
+{
+    pthread_mutex_lock (&_queue_mutex);
+    while (_threads_stop == 0)
+    {
+        resolver_query *query = _queue;
+        struct addrinfo *ai = NULL;
+        int error;
+
+        if (query == NULL)
+        {
+            _threads_idle++;
+            pthread_cond_wait (&_queue_cond, &_queue_mutex);
+            _threads_idle--;
+            continue;
+        }
+        _queue = query->next;
+        if (_queue == NULL)
+            _queue_tail = &_queue;
+        pthread_mutex_unlock (&_queue_mutex);
+
+        error = resolver_getaddrinfo (query->name, query->service, &query->hints, &ai);
+
+        pthread_mutex_lock (&_queue_mutex);
+        query->ai = ai;
+        query->error = error;
+        query->done = 1;
+        _query_release (query);
+    }
+    _threads--;
+    pthread_cond_broadcast (&_queue_cond);
+    pthread_mutex_unlock (&_queue_mutex);
+    return NULL;
+}
+#endif
+
+
+/* start a lookup without blocking the caller. Numeric addresses and recent
+ * results are answered here, other names are looked up by the resolver
+ * threads. Poll with resolver_query_done, returns NULL on failure.
+ */
+resolver_query *resolver_query_start (const char *name, const char *service,
+        const struct addrinfo *hints)
+{
+    resolver_query *query = calloc (1, sizeof (resolver_query));
+
+    if (query == NULL)
+        return NULL;
+    query->refs = 1;
+    if (_getaddrinfo_now (name, service, hints, &query->ai, &query->error) == 0)
+    {
+        query->done = 1;
+        return query;
+    }
+    query->name = name ? strdup (name) : NULL;
+    query->service = service ? strdup (service) : NULL;
+    if (hints)
+        memcpy (&query->hints, hints, sizeof (query->hints));
+    query->hints.ai_next = NULL;
+    query->hints.ai_addr = NULL;
+    query->hints.ai_canonname = NULL;
+#ifndef NO_THREAD
+    pthread_mutex_lock (&_queue_mutex);
+    if (query->name && _threads_stop == 0)
+    {
+        if (_threads_idle == 0 && _threads < RESOLVER_THREADS)
+        {
+            if (thread_create ("resolver", _resolver_thread, NULL, THREAD_DETACHED))
+                _threads++;
+        }
+        if (_threads)
+        {
+            query->refs++;
+            *_queue_tail = query;
+            _queue_tail = &query->next;
+            pthread_cond_signal (&_queue_cond);
+            pthread_mutex_unlock (&_queue_mutex);
+            return query;
+        }
+    }
+    _query_release (query);
+    pthread_mutex_unlock (&_queue_mutex);
+    return NULL;
+#else
+    query->error = resolver_getaddrinfo (name, service, &query->hints, &query->ai);
+    query->done = 1;
+    return query;
+#endif
+}
+
+
+/* returns non-zero once the lookup has completed */
+int resolver_query_done (resolver_query *query)
+{
+    int done;
+
+#ifndef NO_THREAD
+    pthread_mutex_lock (&_queue_mutex);
+#endif
+    done = query->done;
+#ifndef NO_THREAD
+    pthread_mutex_unlock (&_queue_mutex);
+#endif
+    return done;
+}
+
+
+/* the getaddrinfo result of a completed lookup, the list is held by the
+ * query so is only valid until it is released.
+ */
+int resolver_query_result (resolver_query *query, const struct addrinfo **res)
+{
+    *res = query->ai;
+    return query->error;
+}
+
+
+void resolver_query_release (resolver_query *query)
+{
+    if (query == NULL)
+        return;
+#ifndef NO_THREAD
+    pthread_mutex_lock (&_queue_mutex);
+#endif
+    _query_release (query);
+#ifndef NO_THREAD
+    pthread_mutex_unlock (&_queue_mutex);
+#endif
+}
+
+
 char *resolver_getname(const char *ip, char *buff, int len)
 {
     struct addrinfo *head = NULL, hints;
@@ -129,7 +585,7 @@ char *resolver_getip(const char *name, char *buff, int len)
     memset (&hints, 0, sizeof (hints));
     hints . ai_family = AF_UNSPEC;
     hints . ai_socktype = SOCK_STREAM;
-    if (getaddrinfo (name, NULL, &hints, &head))
+    if (resolver_getaddrinfo (name, NULL, &hints, &head))
         return NULL;
 
     if (head)
@@ -137,7 +593,7 @@ char *resolver_getip(const char *name, char *buff, int len)
         if (getnameinfo(head->ai_addr, head->ai_addrlen, buff, len, NULL, 
                     0, NI_NUMERICHOST) == 0)
             ret = buff;
-        freeaddrinfo (head);
+        resolver_freeaddrinfo (head);
     }
 
     return ret;
@@ -205,6 +661,9 @@ void resolver_initialize()
     {
         _initialized = 1;
         thread_mutex_create (&_resolver_mutex);
+#if defined (HAVE_GETNAMEINFO) && defined (HAVE_GETADDRINFO) && !defined (NO_THREAD)
+        _threads_stop = 0;
+#endif
 
         /* keep dns connects (TCP) open */
 #ifdef HAVE_SETHOSTENT
@@ -217,6 +676,35 @@ void resolver_shutdown(void)
 {
     if (_initialized)
     {
+#if defined (HAVE_GETNAMEINFO) && defined (HAVE_GETADDRINFO)
+#ifndef NO_THREAD
+        /* let the lookups in progress finish, those not started fail */
+        pthread_mutex_lock (&_queue_mutex);
+        _threads_stop = 1;
+        pthread_cond_broadcast (&_queue_cond);
+        while (_threads)
+            pthread_cond_wait (&_queue_cond, &_queue_mutex);
+        while (_queue)
+        {
+            resolver_query *query = _queue;
+
+            _queue = query->next;
+            query->error = EAI_FAIL;
+            query->done = 1;
+            _query_release (query);
+        }
+        _queue_tail = &_queue;
+        pthread_mutex_unlock (&_queue_mutex);
+#endif
+        _cache_lock();
+        while (_cache)
+        {
+            resolver_entry *entry = _cache;
+            _cache = entry->next;
+            _free_entry (entry);
+        }
+        _cache_unlock();
+#endif
         thread_mutex_destroy(&_resolver_mutex);
         _initialized = 0;
 #ifdef HAVE_ENDHOSTENT
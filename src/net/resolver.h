@@ -25,14 +25,35 @@
 # define resolver_shutdown _mangle(resolver_shutdown)
 # define resolver_getname _mangle(resolver_getname)
 # define resolver_getip _mangle(resolver_getip)
+# define resolver_getaddrinfo _mangle(resolver_getaddrinfo)
+# define resolver_freeaddrinfo _mangle(resolver_freeaddrinfo)
+# define resolver_query_start _mangle(resolver_query_start)
+# define resolver_query_done _mangle(resolver_query_done)
+# define resolver_query_result _mangle(resolver_query_result)
+# define resolver_query_release _mangle(resolver_query_release)
 #endif
 
+struct addrinfo;
+typedef struct resolver_query resolver_query;
+
 void resolver_initialize(void);
 void resolver_shutdown(void);
 
 char *resolver_getname(const char *ip, char *buff, int len);
 char *resolver_getip(const char *name, char *buff, int len);
 
+/* cached getaddrinfo, result is freed with resolver_freeaddrinfo */
+int resolver_getaddrinfo (const char *name, const char *service,
+        const struct addrinfo *hints, struct addrinfo **res);
+void resolver_freeaddrinfo (struct addrinfo *ai);
+
+/* lookups run by the resolver threads, so that the caller does not block */
+resolver_query *resolver_query_start (const char *name, const char *service,
+        const struct addrinfo *hints);
+int  resolver_query_done (resolver_query *query);
+int  resolver_query_result (resolver_query *query, const struct addrinfo **res);
+void resolver_query_release (resolver_query *query);
+
 #endif
 
 
@@ -646,30 +646,41 @@ sock_t sock_connect_wto (const char *hostname, int port, int timeout)
     return sock_connect_wto_bind(hostname, port, NULL, timeout);
 }
 
-#ifdef HAVE_GETADDRINFO
-
 sock_t sock_connect_non_blocking (const char *hostname, unsigned port)
 {
-    int sock = SOCK_ERROR;
-    struct addrinfo *ai, *head, hints;
-    char service[8];
-
-    memset (&hints, 0, sizeof (hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    return sock_connect_non_blocking_bind (hostname, port, NULL);
+}
 
-    snprintf (service, sizeof (service), "%u", port);
+#ifdef HAVE_GETADDRINFO
 
-    if (getaddrinfo (hostname, service, &hints, &head))
-        return SOCK_ERROR;
+/* start a connect to the first usable address in head, optionally bound to
+ * an address of the same family from bnd. Names have already been looked up
+ * so this does not block. Use sock_connected to find out when it completes.
+ */
+sock_t sock_connect_non_blocking_ai (const struct addrinfo *head, const struct addrinfo *bnd)
+{
+    int sock = SOCK_ERROR;
+    const struct addrinfo *ai = head;
 
-    ai = head;
     while (ai)
     {
         if ((sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) 
                 > -1)
         {
             sock_set_blocking (sock, 0);
+            if (bnd)
+            {
+                const struct addrinfo *b = bnd;
+
+                while (b && b->ai_family != ai->ai_family)
+                    b = b->ai_next;
+                if (b == NULL || bind (sock, b->ai_addr, b->ai_addrlen) < 0)
+                {
+                    sock_close (sock);
+                    sock = SOCK_ERROR;
+                    break;
+                }
+            }
             if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 && 
                     !sock_connect_pending(sock_error()))
             {
@@ -681,8 +692,32 @@ sock_t sock_connect_non_blocking (const char *hostname, unsigned port)
         }
         ai = ai->ai_next;
     }
-    if (head) freeaddrinfo (head);
-    
+    return sock;
+}
+
+/* start a connect to hostname, optionally from the bnd address, but do not wait
+ * for it to complete. Use sock_connected to find out when it has. The name
+ * lookups may block.
+ */
+sock_t sock_connect_non_blocking_bind (const char *hostname, unsigned port, const char *bnd)
+{
+    int sock = SOCK_ERROR;
+    struct addrinfo *head, *b_head = NULL, hints;
+    char service[8];
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf (service, sizeof (service), "%u", port);
+
+    if (resolver_getaddrinfo (hostname, service, &hints, &head))
+        return SOCK_ERROR;
+    if (bnd == NULL || resolver_getaddrinfo (bnd, NULL, &hints, &b_head) == 0)
+        sock = sock_connect_non_blocking_ai (head, b_head);
+    resolver_freeaddrinfo (b_head);
+    resolver_freeaddrinfo (head);
+
     return sock;
 }
 
@@ -701,7 +736,7 @@ sock_t sock_connect_wto_bind (const char *hostname, int port, const char *bnd, i
     hints.ai_socktype = SOCK_STREAM;
     snprintf (service, sizeof (service), "%u", port);
 
-    if (getaddrinfo (hostname, service, &hints, &head))
+    if (resolver_getaddrinfo (hostname, service, &hints, &head))
         return SOCK_ERROR;
 
     ai = head;
@@ -719,7 +754,9 @@ sock_t sock_connect_wto_bind (const char *hostname, int port, const char *bnd, i
                 b_hints.ai_family = ai->ai_family;
                 b_hints.ai_socktype = ai->ai_socktype;
                 b_hints.ai_protocol = ai->ai_protocol;
-                if (getaddrinfo (bnd, NULL, &b_hints, &b_head) ||
+                resolver_freeaddrinfo (b_head);
+                b_head = NULL;
+                if (resolver_getaddrinfo (bnd, NULL, &b_hints, &b_head) ||
                         bind (sock, b_head->ai_addr, b_head->ai_addrlen) < 0)
                 {
                     sock_close (sock);
@@ -754,9 +791,8 @@ sock_t sock_connect_wto_bind (const char *hostname, int port, const char *bnd, i
         }
         ai = ai->ai_next;
     }
-    if (b_head)
-        freeaddrinfo (b_head);
-    freeaddrinfo (head);
+    resolver_freeaddrinfo (b_head);
+    resolver_freeaddrinfo (head);
 
     return sock;
 }
@@ -845,7 +881,7 @@ int sock_try_connection (sock_t sock, const char *hostname, unsigned int port)
     return connect(sock, (struct sockaddr *)&server, sizeof(server));
 }
 
-sock_t sock_connect_non_blocking (const char *hostname, unsigned port)
+sock_t sock_connect_non_blocking_bind (const char *hostname, unsigned port, const char *bnd)
 {
     sock_t sock;
 
@@ -853,6 +889,20 @@ sock_t sock_connect_non_blocking (const char *hostname, unsigned port)
     if (sock == SOCK_ERROR)
         return SOCK_ERROR;
 
+    if (bnd)
+    {
+        struct sockaddr_in sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+
+        if (inet_aton (bnd, &sa.sin_addr) == 0 ||
+            bind (sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+        {
+            sock_close (sock);
+            return SOCK_ERROR;
+        }
+    }
     sock_set_blocking (sock, 0);
     sock_try_connection (sock, hostname, port);
     
@@ -990,7 +1040,11 @@ sock_t sock_accept(sock_t serversock, char *ip, size_t len)
     socklen_t slen;
 
     slen = sizeof(sa);
+#ifdef HAVE_ACCEPT4
+    ret = accept4(serversock, (struct sockaddr *)&sa, &slen, SOCK_NONBLOCK);
+#else
     ret = accept(serversock, (struct sockaddr *)&sa, &slen);
+#endif
 
     if (ret != SOCK_ERROR)
     {
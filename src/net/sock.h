@@ -87,6 +87,8 @@ ssize_t sock_writev (sock_t sock, WSABUF *iov, size_t count);
 # define sock_connect_wto _mangle(sock_connect_wto)
 # define sock_connect_wto_bind _mangle(sock_connect_wto_bind)
 # define sock_connect_non_blocking _mangle(sock_connect_non_blocking)
+# define sock_connect_non_blocking_bind _mangle(sock_connect_non_blocking_bind)
+# define sock_connect_non_blocking_ai _mangle(sock_connect_non_blocking_ai)
 # define sock_connected _mangle(sock_connected)
 # define sock_write_bytes _mangle(sock_write_bytes)
 # define sock_write _mangle(sock_write)
@@ -124,6 +126,9 @@ int sock_create_pipe_emulation (int handles[2]);
 sock_t sock_connect_wto(const char *hostname, int port, int timeout);
 sock_t sock_connect_wto_bind(const char *hostname, int port, const char *bnd, int timeout);
 sock_t sock_connect_non_blocking(const char *host, unsigned port);
+sock_t sock_connect_non_blocking_bind(const char *host, unsigned port, const char *bnd);
+struct addrinfo;
+sock_t sock_connect_non_blocking_ai(const struct addrinfo *head, const struct addrinfo *bnd);
 int sock_connected(sock_t sock, int timeout);
 
 /* Socket write functions */
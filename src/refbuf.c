@@ -24,39 +24,281 @@
 #include <string.h>
 
 #include "refbuf.h"
+#include "compat.h"
 
 #define CATMODULE "refbuf"
 
 #include "logging.h"
 #include "global.h"
+#include "thread/thread.h"
+#include "stats.h"
+
+
+/* Pooled allocation of refbuf headers and the common data sizes.  Each thread
+ * keeps a small cache of free blocks, so most allocations and releases do not
+ * touch any shared state.  The caches spill to and refill from a shared pool
+ * per size, which is bounded so memory is returned after a busy period.
+ * Data sizes outside of the pooled sizes just use malloc.
+ */
+#define REFBUF_POOLS            5
+#define REFBUF_POOL_HEADER      (REFBUF_POOLS-1)
+#define REFBUF_CACHE_MAX        32
+#define REFBUF_POOL_BYTES       (4*1024*1024)
+
+typedef struct refbuf_free_tag
+{
+    struct refbuf_free_tag *next;
+} refbuf_free_t;
+
+typedef struct
+{
+    spin_t lock;
+    unsigned int size;
+    unsigned int count, max;
+    refbuf_free_t *free;
+} refbuf_pool_t;
+
+typedef struct
+{
+    refbuf_free_t *free [REFBUF_POOLS];
+    unsigned int count [REFBUF_POOLS];
+    long hits, misses, retained;    /* not yet added to the totals */
+} refbuf_cache_t;
+
+static refbuf_pool_t refbuf_pools [REFBUF_POOLS];
+static pthread_key_t refbuf_cache_key;
+static int refbuf_pooling;
+
+static long pool_hits, pool_misses, pool_retained;
+
+
+/* add the cache counts to the totals */
+static void refbuf_cache_totals (refbuf_cache_t *cache)
+{
+    if (cache->hits)     { atomic_add (&pool_hits, cache->hits);         cache->hits = 0; }
+    if (cache->misses)   { atomic_add (&pool_misses, cache->misses);     cache->misses = 0; }
+    if (cache->retained) { atomic_add (&pool_retained, cache->retained); cache->retained = 0; }
+}
+
+
+/* move up to count blocks from the cache to the shared pool, any that
+ * do not fit are freed */
+static void refbuf_cache_spill (refbuf_cache_t *cache, int i, unsigned int count)
+{
+    refbuf_pool_t *pool = &refbuf_pools[i];
+
+    thread_spin_lock (&pool->lock);
+    while (count && cache->free[i])
+    {
+        refbuf_free_t *blk = cache->free[i];
+
+        cache->free[i] = blk->next;
+        cache->count[i]--;
+        count--;
+        if (pool->count < pool->max)
+        {
+            blk->next = pool->free;
+            pool->free = blk;
+            pool->count++;
+        }
+        else
+        {
+            free (blk);
+            cache->retained -= pool->size;
+        }
+    }
+    thread_spin_unlock (&pool->lock);
+    refbuf_cache_totals (cache);
+}
+
+
+static void refbuf_cache_release (void *arg)
+{
+    refbuf_cache_t *cache = arg;
+    int i;
+
+    for (i = 0; i < REFBUF_POOLS; i++)
+        refbuf_cache_spill (cache, i, cache->count[i]);
+    free (cache);
+}
+
+
+static refbuf_cache_t *refbuf_cache (void)
+{
+    refbuf_cache_t *cache;
+
+    if (refbuf_pooling == 0)
+        return NULL;
+    cache = pthread_getspecific (refbuf_cache_key);
+    if (cache == NULL)
+    {
+        cache = calloc (1, sizeof (refbuf_cache_t));
+        if (cache == NULL)
+            abort();
+        pthread_setspecific (refbuf_cache_key, cache);
+    }
+    return cache;
+}
+
+
+/* the pool a block of size is taken from, -1 if not pooled. Sizes are only
+ * pooled if they use over half of the block */
+static int refbuf_pool_index (unsigned int size)
+{
+    int i;
+
+    for (i = 0; i < REFBUF_POOL_HEADER; i++)
+        if (size <= refbuf_pools[i].size)
+            return size > refbuf_pools[i].size/2 ? i : -1;
+    return -1;
+}
+
+
+static void *refbuf_pool_get (int i)
+{
+    refbuf_cache_t *cache = refbuf_cache ();
+    refbuf_pool_t *pool = &refbuf_pools[i];
+    refbuf_free_t *blk;
+
+    if (cache == NULL)
+        return malloc (pool->size);
+    if (cache->free[i] == NULL)
+    {
+        unsigned int count = REFBUF_CACHE_MAX/2;
+
+        /* take a batch from the shared pool */
+        thread_spin_lock (&pool->lock);
+        while (count && pool->free)
+        {
+            blk = pool->free;
+            pool->free = blk->next;
+            pool->count--;
+            blk->next = cache->free[i];
+            cache->free[i] = blk;
+            cache->count[i]++;
+            count--;
+        }
+        thread_spin_unlock (&pool->lock);
+        refbuf_cache_totals (cache);
+    }
+    blk = cache->free[i];
+    if (blk == NULL)
+    {
+        cache->misses++;
+        return malloc (pool->size);
+    }
+    cache->free[i] = blk->next;
+    cache->count[i]--;
+    cache->hits++;
+    cache->retained -= pool->size;
+    if (cache->hits + cache->misses > 100)
+        refbuf_cache_totals (cache);
+    return blk;
+}
+
+
+static void refbuf_pool_put (int i, void *p)
+{
+    refbuf_cache_t *cache = refbuf_cache ();
+    refbuf_free_t *blk = p;
+
+    if (cache == NULL)
+    {
+        free (p);
+        return;
+    }
+    blk->next = cache->free[i];
+    cache->free[i] = blk;
+    cache->count[i]++;
+    cache->retained += refbuf_pools[i].size;
+    if (cache->count[i] > REFBUF_CACHE_MAX)
+        refbuf_cache_spill (cache, i, REFBUF_CACHE_MAX/2);
+}
 
 
 void refbuf_initialize(void)
 {
+    int i;
+    unsigned int size = 2048;
+
+    for (i = 0; i < REFBUF_POOLS; i++, size <<= 1)
+    {
+        refbuf_pool_t *pool = &refbuf_pools[i];
+
+        pool->size = (i == REFBUF_POOL_HEADER) ? sizeof (refbuf_t) : size;
+        if (pool->size < sizeof (refbuf_free_t))
+            pool->size = sizeof (refbuf_free_t);
+        pool->max = REFBUF_POOL_BYTES / pool->size;
+        thread_spin_create (&pool->lock);
+    }
+    pthread_key_create (&refbuf_cache_key, refbuf_cache_release);
+    refbuf_pooling = 1;
 }
 
 void refbuf_shutdown(void)
 {
+    int i;
+    refbuf_cache_t *cache = pthread_getspecific (refbuf_cache_key);
+
+    if (refbuf_pooling == 0)
+        return;
+    if (cache)
+    {
+        pthread_setspecific (refbuf_cache_key, NULL);
+        refbuf_cache_release (cache);
+    }
+    refbuf_pooling = 0;
+    for (i = 0; i < REFBUF_POOLS; i++)
+    {
+        refbuf_pool_t *pool = &refbuf_pools[i];
+
+        while (pool->free)
+        {
+            refbuf_free_t *blk = pool->free;
+            pool->free = blk->next;
+            free (blk);
+        }
+        pool->count = 0;
+        thread_spin_destroy (&pool->lock);
+    }
+}
+
+
+void refbuf_stats (void)
+{
+    long hits = atomic_load (&pool_hits), misses = atomic_load (&pool_misses);
+
+    stats_event_args (NULL, "refbuf_pool_hits", "%ld", hits);
+    stats_event_args (NULL, "refbuf_pool_misses", "%ld", misses);
+    stats_event_args (NULL, "refbuf_pool_bytes", "%ld", atomic_load (&pool_retained));
 }
 
+
 refbuf_t *refbuf_new (unsigned int size)
 {
     refbuf_t *refbuf;
 
-    refbuf = (refbuf_t *)calloc(1, sizeof(refbuf_t));
+    refbuf = refbuf_pool_get (REFBUF_POOL_HEADER);
     if (refbuf == NULL)
         abort();
-    refbuf->data = NULL;
+    memset (refbuf, 0, sizeof (refbuf_t));
+    refbuf->_pool = -1;
     if (size)
     {
-        refbuf->data = malloc (size);
+        int i = refbuf_pool_index (size);
+
+        if (i < 0)
+            refbuf->data = malloc (size);
+        else
+        {
+            refbuf->data = refbuf->_pool_data = refbuf_pool_get (i);
+            refbuf->_pool = i;
+        }
         if (refbuf->data == NULL)
             abort();
     }
     refbuf->len = size;
     refbuf->_count = 1;
-    refbuf->next = NULL;
-    refbuf->associated = NULL;
 
     return refbuf;
 }
@@ -65,7 +307,57 @@ void refbuf_addref(refbuf_t *self)
 {
     if (self == NULL)
         return;
-    self->_count++;
+    atomic_add (&self->_count, 1);
+}
+
+
+/* a refbuf referring to part of the data of owner, which is kept until
+ * the slice is released. Used for sharing read-only content. */
+refbuf_t *refbuf_slice (refbuf_t *owner, unsigned int offset, unsigned int len)
+{
+    refbuf_t *refbuf = refbuf_new (0);
+
+    refbuf_addref (owner);
+    refbuf->_owner = owner;
+    refbuf->data = owner->data + offset;
+    refbuf->len = len;
+    refbuf->flags = REFBUF_SLICE;
+    return refbuf;
+}
+
+
+/* append next to self, the link holds a reference to next so anyone
+ * holding self can follow it without further locking.
+ */
+void refbuf_link (refbuf_t *self, refbuf_t *next)
+{
+    refbuf_addref (next);
+    atomic_store (&self->next, next);   /* next is complete before it becomes visible */
+}
+
+
+refbuf_t *refbuf_next (refbuf_t *self)
+{
+    return atomic_load (&self->next);
+}
+
+
+void refbuf_set_flags (refbuf_t *self, unsigned int flags)
+{
+    atomic_or (&self->flags, flags);
+}
+
+
+unsigned int refbuf_flags (refbuf_t *self)
+{
+    return atomic_load (&self->flags);
+}
+
+
+/* only meaningful to the caller if it holds the last reference, ie 1 */
+unsigned int refbuf_count (refbuf_t *self)
+{
+    return atomic_load (&self->_count);
 }
 
 refbuf_t *refbuf_copy(refbuf_t *orig)
@@ -92,7 +384,7 @@ static void refbuf_release_associated (refbuf_t *ref)
     {
         refbuf_t *to_go = ref;
         ref = to_go->next;
-        if (to_go->_count == 1)
+        if (refbuf_count (to_go) == 1)
             to_go->next = NULL;
         refbuf_release (to_go);
     }
@@ -100,16 +392,26 @@ static void refbuf_release_associated (refbuf_t *ref)
 
 void refbuf_release(refbuf_t *self)
 {
-    if (self == NULL)
-        return;
-    self->_count--;
-    if (self->_count == 0)
+    while (self)
     {
+        refbuf_t *next = NULL;
+
+        if (atomic_sub (&self->_count, 1) > 0)
+            return;
         refbuf_release_associated (self->associated);
-        if (self->next)
+        if (self->flags & REFBUF_LINKED)
+            next = self->next;  /* drop the reference held by the link */
+        else if (self->next)
             DEBUG0 ("next not null");
-        free(self->data);
-        free(self);
+        /* data may have been replaced so only pool what was allocated */
+        if (self->_owner)
+            refbuf_release (self->_owner);
+        else if (self->_pool >= 0 && self->data == self->_pool_data)
+            refbuf_pool_put (self->_pool, self->data);
+        else
+            free (self->data);
+        refbuf_pool_put (REFBUF_POOL_HEADER, self);
+        self = next;
     }
 }
 
@@ -20,6 +20,21 @@
 
 #include <sys/types.h>
 
+/* A refbuf can be shared between threads without a common lock, provided
+ * the following is kept to
+ *
+ * _count   only changed by refbuf_addref/refbuf_release, which are atomic.
+ *          the final release orders after every other holders release so
+ *          the memory can be freed.
+ * next     when REFBUF_LINKED, set once by refbuf_link after data, len and
+ *          flags are complete, read with refbuf_next.  A holder of a refbuf
+ *          can always follow the link as the link holds a reference.
+ * flags    once linked, bits are only added with refbuf_set_flags and
+ *          unlocked readers use refbuf_flags.  eg SOURCE_BLOCK_RELEASE
+ * data,len fixed once linked, except by callers holding the queue owner
+ *          lock.  data may be replaced by a malloc'd block, which is then
+ *          freed on release, but pooled data must not be resized in place.
+ */
 typedef struct _refbuf_tag
 {
     unsigned int flags;
@@ -29,20 +44,34 @@ typedef struct _refbuf_tag
     char *data;
     unsigned int len;
 
+    int _pool;          /* allocator details, data is pooled if unchanged */
+    void *_pool_data;
+    struct _refbuf_tag *_owner;     /* holder of the data for a slice */
 } refbuf_t;
 
 void refbuf_initialize(void);
 void refbuf_shutdown(void);
+void refbuf_stats (void);
 
 refbuf_t *refbuf_new(unsigned int size);
 void refbuf_addref(refbuf_t *self);
 void refbuf_release(refbuf_t *self);
 refbuf_t *refbuf_copy(refbuf_t *orig);
+refbuf_t *refbuf_slice (refbuf_t *owner, unsigned int offset, unsigned int len);
+void refbuf_link (refbuf_t *self, refbuf_t *next);
+refbuf_t *refbuf_next (refbuf_t *self);
+void refbuf_set_flags (refbuf_t *self, unsigned int flags);
+unsigned int refbuf_flags (refbuf_t *self);
+unsigned int refbuf_count (refbuf_t *self);
 
 
 #define PER_CLIENT_REFBUF_SIZE  4096
 
 #define WRITE_BLOCK_GENERIC     01000
+/* next is a counted reference, dropped when this refbuf is freed */
+#define REFBUF_LINKED           02000
+/* data is part of another refbuf, so must not be written to */
+#define REFBUF_SLICE            04000
 
 #endif  /* __REFBUF_H__ */
 
@@ -30,6 +30,7 @@
 #ifndef _WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #else
 #include <winsock2.h>
 #endif
@@ -46,6 +47,7 @@
 #include "thread/thread.h"
 #include "avl/avl.h"
 #include "net/sock.h"
+#include "net/resolver.h"
 #include "httpp/httpp.h"
 
 #include "cfgfile.h"
@@ -71,6 +73,7 @@ static redirect_host *find_slave_host (const char *server, int port);
 static int  relay_startup (client_t *client);
 static int  relay_initialise (client_t *client);
 static int  relay_read (client_t *client);
+static int  relay_connect (client_t *client);
 static void relay_release (client_t *client);
 
 int slave_running = 0;
@@ -109,6 +112,12 @@ struct _client_functions relay_init_ops =
     relay_release
 };
 
+struct _client_functions relay_connect_ops =
+{
+    relay_connect,
+    relay_release
+};
+
 
 relay_server *relay_copy (relay_server *r)
 {
@@ -285,287 +294,568 @@ int redirect_client (const char *mountpoint, client_t *client)
 }
 
 
-static http_parser_t *get_relay_response (connection_t *con, const char *mount,
-        const char *server, int ask_for_metadata, const char *auth_header, relay_server *relay)
+#if defined(HAVE_GETADDRINFO) && defined(HAVE_GETNAMEINFO)
+#define RELAY_LOOKUP_QUEUE
+#endif
+
+/* details kept while a relay connection is being set up, held in the relay
+ * client refbuf so that it is dropped along with the client queue
+ */
+typedef struct
 {
-    ice_config_t *config = config_get_config ();
-    char *server_id = strdup (relay->user_agent ? relay->user_agent : config->server_id);
-    http_parser_t *parser = NULL;
-    char response [4096];
+    relay_server_master *master;
+    resolver_query *lookup;         /* name lookups in progress, see */
+    resolver_query *bind_lookup;    /* relay_connect_resolved */
+    char *server;
+    char *mount;
+    char *auth_header;
+    int port;
+    int redirects;
+    int stage;
+    uint64_t timeout_ms;
+    unsigned int len;
+    unsigned int sent;
+    char buf [4096];
+} relay_connect_t;
 
-    config_release_config ();
+#define RELAY_CONNECTING    0
+#define RELAY_SENDING       1
+#define RELAY_READING       2
+#define RELAY_RESOLVING     3
 
-    /* At this point we may not know if we are relaying an mp3 or vorbis
-     * stream, but only send the icy-metadata header if the relay details
-     * state so (the typical case).  It's harmless in the vorbis case. If
-     * we don't send in this header then relay will not have mp3 metadata.
-     */
-    sock_write (con->sock, "GET %s HTTP/1.0\r\n"
-            "User-Agent: %s\r\n"
-            "Host: %s\r\n"
-            "%s"
-            "%s"
-            "\r\n",
-            mount,
-            server_id,
-            server,
-            ask_for_metadata ? "Icy-MetaData: 1\r\n" : "",
-            auth_header ? auth_header : "");
-
-    free (server_id);
-    memset (response, 0, sizeof(response));
-    if (util_read_header (con->sock, response, 4096, READ_ENTIRE_HEADER) == 0)
+/* connections are not waited on so allow a decent number at once */
+#define RELAY_CONNECTING_MAX    40
+
+
+static void relay_lookup_release (relay_connect_t *rc)
+{
+    resolver_query_release (rc->lookup);
+    resolver_query_release (rc->bind_lookup);
+    rc->lookup = rc->bind_lookup = NULL;
+}
+
+
+/* relay connection attempt is complete, either a master has been connected
+ * to and the source is ready or all masters failed. Called with the source
+ * locked, the client goes back to the relay read routine.
+ */
+static int relay_connect_done (client_t *client, int failed)
+{
+    relay_server *relay = client->shared_data;
+    source_t *src = relay->source;
+    relay_connect_t *rc = (relay_connect_t *)client->refbuf->data;
+
+    relay_lookup_release (rc);
+    free (rc->server);
+    free (rc->mount);
+    free (rc->auth_header);
+    client_set_queue (client, NULL);
+
+    client->ops = &relay_client_ops;
+    client->schedule_ms = client->worker->time_ms;
+
+    if (failed)
     {
-        INFO0 ("Header read failure");
-        return NULL;
+        /* failed to start any connection, better clean up and reset */
+        if (relay->on_demand)
+            src->flags &= ~SOURCE_ON_DEMAND;
+        else
+        {
+            yp_remove (relay->localmount);
+            src->yp_public = -1;
+        }
+
+        relay->in_use = NULL;
+        INFO2 ("listener count remaining on %s is %d", src->mount, src->listeners);
+        src->flags &= ~SOURCE_PAUSE_LISTENERS;
+        thread_mutex_unlock (&src->lock);
     }
-    parser = httpp_create_parser();
-    httpp_initialize (parser, NULL);
-    if (! httpp_parse_response (parser, response, strlen(response), mount))
+    else
     {
-        INFO0 ("problem parsing response from relay");
-        httpp_destroy (parser);
-        return NULL;
+        stats_event_inc (NULL, "source_relay_connections");
+        source_init (src);
     }
-    return parser;
+
+    thread_spin_lock (&relay_start_lock);
+    relays_connecting--;
+    thread_spin_unlock (&relay_start_lock);
+    return 0;
 }
 
 
-/* Actually open the connection and do some http parsing, handle any 302
- * responses within here.
+/* the connect has been issued on streamsock, the socket is checked later on
+ * for completion. returns -1 if the connect could not be started
  */
-static int open_relay_connection (client_t *client, relay_server *relay, relay_server_master *master)
+static int relay_connect_socket (client_t *client, relay_connect_t *rc, sock_t streamsock)
 {
-    int redirects = 0;
-    http_parser_t *parser = NULL;
     connection_t *con = &client->connection;
-    char *server = strdup (master->ip);
-    char *mount = strdup (master->mount);
-    int port = master->port, timeout = master->timeout, ask_for_metadata = relay->mp3metadata;
-    char *auth_header = NULL;
 
-    if (relay->username && relay->password)
+    if (connection_init (con, streamsock, rc->server) < 0)
     {
-        char *esc_authorisation;
-        unsigned len = strlen(relay->username) + strlen(relay->password) + 2;
-
-        DEBUG2 ("using username %s for %s", relay->username, relay->localmount);
-        auth_header = malloc (len);
-        snprintf (auth_header, len, "%s:%s", relay->username, relay->password);
-        esc_authorisation = util_base64_encode(auth_header);
-        free(auth_header);
-        len = strlen (esc_authorisation) + 24;
-        auth_header = malloc (len);
-        snprintf (auth_header, len,
-                "Authorization: Basic %s\r\n", esc_authorisation);
-        free(esc_authorisation);
+        WARN2 ("Failed to connect to %s:%d", rc->server, rc->port);
+        if (streamsock != SOCK_ERROR)
+            sock_close (streamsock);
+        return -1;
     }
+    rc->stage = RELAY_CONNECTING;
+    rc->timeout_ms = client->worker->time_ms + (rc->master->timeout * 1000);
+    /* wait for the socket to become writable */
+    con->send_blocked = 1;
+    client->schedule_ms = client->worker->time_ms + 50;
+    return 0;
+}
 
-    while (redirects < 10)
-    {
-        sock_t streamsock;
-        char *bind = NULL;
-
-        /* policy decision, we assume a source bind even after redirect, possible option */
-        if (master->bind)
-            bind = strdup (master->bind);
 
-        if (bind)
-            INFO4 ("connecting to %s:%d for %s, bound to %s", server, port, relay->localmount, bind);
-        else
-            INFO3 ("connecting to %s:%d for %s", server, port, relay->localmount);
+#ifdef RELAY_LOOKUP_QUEUE
+/* issue the connect once the names are looked up. Numeric and recently
+ * looked up names are known straight away, others are passed to the
+ * resolver threads so a slow or dead DNS server does not stall the worker.
+ * returns -1 if the lookup or connect failed
+ */
+static int relay_connect_resolved (client_t *client, relay_connect_t *rc)
+{
+    relay_server *relay = client->shared_data;
+    worker_t *worker = client->worker;
+    const struct addrinfo *ai, *bind_ai = NULL;
+    sock_t sock;
 
-        con->con_time = time (NULL);
-        relay->in_use = master;
-        streamsock = sock_connect_wto_bind (server, port, bind, timeout);
-        free (bind);
-        if (connection_init (con, streamsock, server) < 0)
+    if (resolver_query_done (rc->lookup) == 0 ||
+            (rc->bind_lookup && resolver_query_done (rc->bind_lookup) == 0))
+    {
+        if (worker->time_ms >= rc->timeout_ms)
         {
-            WARN2 ("Failed to connect to %s:%d", server, port);
-            break;
+            WARN2 ("Timed out looking up %s for %s", rc->server, relay->localmount);
+            return -1;
         }
+        rc->stage = RELAY_RESOLVING;
+        client->connection.send_blocked = 0;
+        client->schedule_ms = worker->time_ms + 50;
+        return 0;
+    }
+    if (resolver_query_result (rc->lookup, &ai) ||
+            (rc->bind_lookup && resolver_query_result (rc->bind_lookup, &bind_ai)))
+    {
+        WARN2 ("Failed to look up %s for %s", rc->server, relay->localmount);
+        return -1;
+    }
+    sock = sock_connect_non_blocking_ai (ai, bind_ai);
+    relay_lookup_release (rc);
+    return relay_connect_socket (client, rc, sock);
+}
+#endif
 
-        parser = get_relay_response (con, mount, server, ask_for_metadata, auth_header, relay);
-
-        if (parser == NULL)
-        {
-            ERROR4 ("Problem trying to start relay on %s (%s:%d%s)", relay->localmount,
-                    server, port, mount);
-            break;
-        }
-        if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
-        {
-            /* better retry the connection again but with different details */
-            const char *uri, *mountpoint;
-            int len;
 
-            uri = httpp_getvar (parser, "location");
-            INFO1 ("redirect received %s", uri);
-            if (strncmp (uri, "http://", 7) != 0)
-                break;
-            uri += 7;
-            mountpoint = strchr (uri, '/');
-            free (mount);
-            if (mountpoint)
-                mount = strdup (mountpoint);
-            else
-                mount = strdup ("/");
-
-            len = strcspn (uri, ":/");
-            port = 80;
-            if (uri [len] == ':')
-                port = atoi (uri+len+1);
-            free (server);
-            server = calloc (1, len+1);
-            strncpy (server, uri, len);
-            connection_close (con);
-            httpp_destroy (parser);
-            parser = NULL;
-        }
-        else
-        {
-            if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
-            {
-                ERROR2("Error from relay request: %s (%s)", relay->localmount,
-                        httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
-                client->parser = NULL;
-                break;
-            }
-            if (relay->stream_description) // override even if exists
-                httpp_setvar (parser, "icy-description", relay->stream_description);
-            if (relay->stream_name)
-                httpp_setvar (parser, "icy-name", relay->stream_name);
-            if (relay->stream_url)
-                httpp_setvar (parser, "icy-url", relay->stream_url);
-            if (relay->stream_genre)
-                httpp_setvar (parser, "icy-genre", relay->stream_genre);
-            sock_set_blocking (streamsock, 0);
-            thread_mutex_lock (&relay->source->lock);
-            client->parser = parser; // old parser will be free in the format clear
-            thread_mutex_unlock (&relay->source->lock);
-            client->connection.discon_time = 0;
-            client->connection.con_time = time (NULL);
-            client_set_queue (client, NULL);
-            free (server);
-            free (mount);
-            free (auth_header);
+/* start on the current server details, the connect is issued once the names
+ * are looked up. returns -1 if the connection could not be started
+ */
+static int relay_connect_server (client_t *client, relay_connect_t *rc)
+{
+    relay_server *relay = client->shared_data;
+    relay_server_master *master = rc->master;
+#ifdef RELAY_LOOKUP_QUEUE
+    struct addrinfo hints;
+    char service [8];
+#endif
 
-            return 0;
-        }
-        redirects++;
+    /* policy decision, we assume a source bind even after redirect, possible option */
+    if (master->bind)
+        INFO4 ("connecting to %s:%d for %s, bound to %s", rc->server, rc->port, relay->localmount, master->bind);
+    else
+        INFO3 ("connecting to %s:%d for %s", rc->server, rc->port, relay->localmount);
+
+    client->connection.con_time = client->worker->current_time.tv_sec;
+    relay->in_use = master;
+#ifdef RELAY_LOOKUP_QUEUE
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf (service, sizeof (service), "%u", (unsigned)rc->port);
+
+    relay_lookup_release (rc);
+    rc->lookup = resolver_query_start (rc->server, service, &hints);
+    if (master->bind)
+        rc->bind_lookup = resolver_query_start (master->bind, NULL, &hints);
+    if (rc->lookup == NULL || (master->bind && rc->bind_lookup == NULL))
+    {
+        WARN1 ("Unable to start lookup of %s", rc->server);
+        relay_lookup_release (rc);
+        return -1;
     }
-    /* failed, better clean up */
-    free (server);
-    free (mount);
-    free (auth_header);
-    if (parser)
-        httpp_destroy (parser);
-    connection_close (con);
-    con->con_time = time (NULL);
-    if (relay->in_use) relay->in_use->skip = 1;
-    return -1;
+    rc->timeout_ms = client->worker->time_ms + (master->timeout * 1000);
+    return relay_connect_resolved (client, rc);
+#else
+    return relay_connect_socket (client, rc,
+            sock_connect_non_blocking_bind (rc->server, rc->port, master->bind));
+#endif
 }
 
 
-/* This does the actual connection for a relay. A thread is
- * started off if a connection can be acquired
+/* start a connection on the current or next usable master, if none are left
+ * then the relay start has failed.
  */
-int open_relay (relay_server *relay)
+static int relay_connect_master (client_t *client, relay_connect_t *rc)
 {
-    source_t *src = relay->source;
-    relay_server_master *master = relay->masters;
-    client_t *client = src->client;
-    do
+    relay_server *relay = client->shared_data;
+
+    for (; rc->master && global.running == ICE_RUNNING; rc->master = rc->master->next)
     {
-        int ret;
+        relay_server_master *master = rc->master;
 
         if (master->skip)
         {
             INFO3 ("skipping %s:%d for %s", master->ip, master->port, relay->localmount);
             continue;
         }
-        thread_mutex_unlock (&src->lock);
-        ret = open_relay_connection (client, relay, master);
-        thread_mutex_lock (&src->lock);
+        free (rc->server);
+        free (rc->mount);
+        rc->server = strdup (master->ip);
+        rc->mount = strdup (master->mount);
+        rc->port = master->port;
+        rc->redirects = 0;
+        if (relay_connect_server (client, rc) == 0)
+            return 0;
+        connection_close (&client->connection);
+        master->skip = 1;
+    }
+    thread_mutex_lock (&relay->source->lock);
+    return relay_connect_done (client, 1);
+}
 
-        if (ret < 0)
-            continue;
 
-        if (connection_complete_source (src) < 0)
-        {
-            WARN1 ("Failed to complete initialisation on %s", relay->localmount);
-            continue;
-        }
-        return 1;
-    } while ((master = master->next) && global.running == ICE_RUNNING);
-    return -1;
+/* the current master has failed us, so drop the connection and move on */
+static int relay_connect_next (client_t *client, relay_connect_t *rc, int skip)
+{
+    connection_t *con = &client->connection;
+
+    connection_close (con);
+    con->con_time = client->worker->current_time.tv_sec;
+    if (skip)
+        rc->master->skip = 1;
+    rc->master = rc->master->next;
+    return relay_connect_master (client, rc);
 }
 
-static void *start_relay_stream (void *arg)
+
+/* a 302 from the master, retry the connection but with the new details */
+static int relay_connect_redirect (client_t *client, relay_connect_t *rc, const char *uri)
 {
-    client_t *client = arg;
-    relay_server *relay;
-    source_t *src;
-    int failed = 1, sources;
+    const char *mountpoint;
+    int len;
 
-    global_lock();
-    sources = ++global.sources;
-    stats_event_args (NULL, "sources", "%d", global.sources);
-    global_unlock();
-    /* set the start time, because we want to decrease the sources on all failures */
-    client->connection.con_time = time (NULL);
-    do
-    {
-        ice_config_t *config = config_get_config();
+    INFO1 ("redirect received %s", uri);
+    if (++rc->redirects >= 10 || strncmp (uri, "http://", 7) != 0)
+        return -1;
+    uri += 7;
+    mountpoint = strchr (uri, '/');
+    free (rc->mount);
+    rc->mount = strdup (mountpoint ? mountpoint : "/");
+
+    len = strcspn (uri, ":/");
+    rc->port = 80;
+    if (uri [len] == ':')
+        rc->port = atoi (uri+len+1);
+    free (rc->server);
+    rc->server = calloc (1, len+1);
+    strncpy (rc->server, uri, len);
+    connection_close (&client->connection);
+    return relay_connect_server (client, rc);
+}
 
-        relay = client->shared_data;
-        src = relay->source;
 
-        thread_mutex_lock (&src->lock);
-        src->flags |= SOURCE_PAUSE_LISTENERS;
-        if (sources > config->source_limit)
+/* fill in the request to send to the master
+ */
+static void relay_connect_request (client_t *client, relay_connect_t *rc)
+{
+    relay_server *relay = client->shared_data;
+    ice_config_t *config = config_get_config ();
+
+    /* At this point we may not know if we are relaying an mp3 or vorbis
+     * stream, but only send the icy-metadata header if the relay details
+     * state so (the typical case).  It's harmless in the vorbis case. If
+     * we don't send in this header then relay will not have mp3 metadata.
+     */
+    rc->len = snprintf (rc->buf, sizeof (rc->buf), "GET %s HTTP/1.0\r\n"
+            "User-Agent: %s\r\n"
+            "Host: %s\r\n"
+            "%s"
+            "%s"
+            "\r\n",
+            rc->mount,
+            relay->user_agent ? relay->user_agent : config->server_id,
+            rc->server,
+            relay->mp3metadata ? "Icy-MetaData: 1\r\n" : "",
+            rc->auth_header ? rc->auth_header : "");
+    config_release_config ();
+    if (rc->len >= sizeof (rc->buf))
+        rc->len = sizeof (rc->buf) - 1;
+    rc->sent = 0;
+    rc->stage = RELAY_SENDING;
+}
+
+
+/* pull in what is available of the response headers, only taking what is
+ * needed so that any stream content is left on the socket. returns 1 when
+ * the whole header is in, 0 to try later and -1 on failure
+ */
+static int relay_connect_read (client_t *client, relay_connect_t *rc)
+{
+    connection_t *con = &client->connection;
+    unsigned int i, end = 0, space = sizeof (rc->buf) - 1 - rc->len;
+    int ret;
+
+    if (space == 0)
+        return -1;
+    ret = recv (con->sock, rc->buf + rc->len, space, MSG_PEEK);
+    if (ret <= 0)
+    {
+        if (ret < 0 && sock_recoverable (sock_error()))
+            return 0;
+        return -1;
+    }
+    for (i = rc->len; i < rc->len + ret; i++)
+    {
+        int j = (int)i - 1;
+
+        if (rc->buf[i] != '\n')
+            continue;
+        if (j >= 0 && rc->buf[j] == '\r')
+            j--;
+        if (j >= 0 && rc->buf[j] == '\n')
         {
-            config_release_config();
-            WARN1 ("starting relayed mountpoint \"%s\" requires a higher sources limit", relay->localmount);
+            end = i + 1;
             break;
         }
-        config_release_config();
-        INFO1("Starting relayed source at mountpoint \"%s\"", relay->localmount);
+    }
+    if (end)
+        ret = end - rc->len;
+    if (sock_read_bytes (con->sock, rc->buf + rc->len, ret) != ret)
+        return -1;
+    rc->len += ret;
+    if (end == 0)
+        return 0;
+    rc->buf [rc->len] = '\0';
+    /* the parser expects plain newlines, as util_read_header provides */
+    for (i = 0, end = 0; i < rc->len; i++)
+        if (rc->buf[i] != '\r')
+            rc->buf [end++] = rc->buf[i];
+    rc->buf [end] = '\0';
+    rc->len = end;
+    return 1;
+}
+
+
+/* the response from the master is in, so see what it says. On a stream
+ * being available the source is set up ready to go.
+ */
+static int relay_connect_response (client_t *client, relay_connect_t *rc)
+{
+    relay_server *relay = client->shared_data;
+    source_t *src = relay->source;
+    http_parser_t *parser = httpp_create_parser();
+
+    httpp_initialize (parser, NULL);
+    if (! httpp_parse_response (parser, rc->buf, rc->len, rc->mount))
+    {
+        INFO0 ("problem parsing response from relay");
+        ERROR4 ("Problem trying to start relay on %s (%s:%d%s)", relay->localmount,
+                rc->server, rc->port, rc->mount);
+        httpp_destroy (parser);
+        return relay_connect_next (client, rc, 1);
+    }
+    if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
+    {
+        /* better retry the connection again but with different details */
+        int ret = relay_connect_redirect (client, rc, httpp_getvar (parser, "location"));
+
+        httpp_destroy (parser);
+        if (ret < 0)
+            return relay_connect_next (client, rc, 1);
+        return 0;
+    }
+    if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
+    {
+        ERROR2("Error from relay request: %s (%s)", relay->localmount,
+                httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
+        httpp_destroy (parser);
+        return relay_connect_next (client, rc, 1);
+    }
+    if (relay->stream_description) // override even if exists
+        httpp_setvar (parser, "icy-description", relay->stream_description);
+    if (relay->stream_name)
+        httpp_setvar (parser, "icy-name", relay->stream_name);
+    if (relay->stream_url)
+        httpp_setvar (parser, "icy-url", relay->stream_url);
+    if (relay->stream_genre)
+        httpp_setvar (parser, "icy-genre", relay->stream_genre);
+
+    thread_mutex_lock (&src->lock);
+    client->parser = parser; // old parser will be free in the format clear
+    client->connection.discon_time = 0;
+    client->connection.con_time = client->worker->current_time.tv_sec;
+
+    if (connection_complete_source (src) < 0)
+    {
+        WARN1 ("Failed to complete initialisation on %s", relay->localmount);
+        thread_mutex_unlock (&src->lock);
+        return relay_connect_next (client, rc, 0);
+    }
+    return relay_connect_done (client, 0);
+}
+
+
+/* client process routine while a relay is connecting, each stage of the
+ * connect, request and response is done without blocking the worker.
+ */
+static int relay_connect (client_t *client)
+{
+    relay_server *relay = client->shared_data;
+    relay_connect_t *rc = (relay_connect_t *)client->refbuf->data;
+    connection_t *con = &client->connection;
+    worker_t *worker = client->worker;
+    ice_config_t *config;
+    int ret;
 
-        if (open_relay (relay) < 0)
+    if (global.running != ICE_RUNNING || relay->running == 0 || relay->cleanup)
+    {
+        connection_close (con);
+        rc->master = NULL;
+        return relay_connect_master (client, rc);
+    }
+    switch (rc->stage)
+    {
+#ifdef RELAY_LOOKUP_QUEUE
+        case RELAY_RESOLVING:
+            if (relay_connect_resolved (client, rc) < 0)
+                return relay_connect_next (client, rc, 1);
+            return 0;
+#endif
+
+        case RELAY_CONNECTING:
+            ret = sock_connected (con->sock, 0);
+            if (ret == 1)
+            {
+                relay_connect_request (client, rc);
+                rc->timeout_ms = worker->time_ms + (rc->master->timeout * 1000);
+                break;
+            }
+            if (ret == SOCK_ERROR)
+            {
+                WARN2 ("Failed to connect to %s:%d", rc->server, rc->port);
+                return relay_connect_next (client, rc, 1);
+            }
+            if (worker->time_ms >= rc->timeout_ms)
+            {
+                WARN2 ("Timed out connecting to %s:%d", rc->server, rc->port);
+                return relay_connect_next (client, rc, 1);
+            }
+            con->send_blocked = 1;
+            client->schedule_ms = worker->time_ms + 50;
+            return 0;
+
+        case RELAY_SENDING:
             break;
-        stats_event_inc (NULL, "source_relay_connections");
-        source_init (src);
-        failed = 0;
-    } while (0);
 
-    client->ops = &relay_client_ops;
-    client->schedule_ms = timing_get_time();
+        case RELAY_READING:
+            ret = relay_connect_read (client, rc);
+            if (ret > 0)
+                return relay_connect_response (client, rc);
+            if (ret < 0 || worker->time_ms >= rc->timeout_ms)
+            {
+                INFO0 ("Header read failure");
+                ERROR4 ("Problem trying to start relay on %s (%s:%d%s)", relay->localmount,
+                        rc->server, rc->port, rc->mount);
+                return relay_connect_next (client, rc, 1);
+            }
+            client->schedule_ms = worker->time_ms + 50;
+            return 0;
+    }
 
-    if (failed)
+    /* sending the request */
+    ret = sock_write_bytes (con->sock, rc->buf + rc->sent, rc->len - rc->sent);
+    if (ret < 0 && sock_recoverable (sock_error()) == 0)
     {
-        /* failed to start any connection, better clean up and reset */
-        if (relay->on_demand)
-            src->flags &= ~SOURCE_ON_DEMAND;
-        else
+        WARN2 ("Failed to send request to %s:%d", rc->server, rc->port);
+        return relay_connect_next (client, rc, 1);
+    }
+    if (ret > 0)
+        rc->sent += ret;
+    if (rc->sent < rc->len)
+    {
+        if (worker->time_ms >= rc->timeout_ms)
         {
-            yp_remove (relay->localmount);
-            src->yp_public = -1;
+            WARN2 ("Timed out sending request to %s:%d", rc->server, rc->port);
+            return relay_connect_next (client, rc, 1);
         }
+        con->send_blocked = 1;
+        client->schedule_ms = worker->time_ms + 50;
+        return 0;
+    }
+    /* request sent, now wait for the response headers */
+    config = config_get_config();
+    rc->timeout_ms = worker->time_ms + (config->header_timeout * 1000);
+    config_release_config();
+    rc->stage = RELAY_READING;
+    rc->len = 0;
+    client->schedule_ms = worker->time_ms + 50;
+    return 0;
+}
 
-        relay->in_use = NULL;
-        INFO2 ("listener count remaining on %s is %d", src->mount, src->listeners);
-        src->flags &= ~SOURCE_PAUSE_LISTENERS;
-        thread_mutex_unlock (&src->lock);
+
+/* a relay is to be started, the source is marked as pending and the
+ * connection details are set up for the worker to drive the connection.
+ */
+static int relay_connect_start (client_t *client)
+{
+    relay_server *relay = client->shared_data;
+    source_t *src = relay->source;
+    relay_connect_t *rc;
+    ice_config_t *config;
+    int sources;
+
+    global_lock();
+    sources = ++global.sources;
+    stats_event_args (NULL, "sources", "%d", global.sources);
+    global_unlock();
+    /* set the start time, because we want to decrease the sources on all failures */
+    client->connection.con_time = client->worker->current_time.tv_sec;
+
+    client_set_queue (client, NULL);
+    client->refbuf = refbuf_new (sizeof (relay_connect_t));
+    rc = (relay_connect_t *)client->refbuf->data;
+    memset (rc, 0, sizeof (relay_connect_t));
+    rc->master = relay->masters;
+    client->ops = &relay_connect_ops;
+
+    thread_mutex_lock (&src->lock);
+    src->flags |= SOURCE_PAUSE_LISTENERS;
+    config = config_get_config();
+    if (sources > config->source_limit)
+    {
+        config_release_config();
+        WARN1 ("starting relayed mountpoint \"%s\" requires a higher sources limit", relay->localmount);
+        return relay_connect_done (client, 1);
     }
+    config_release_config();
+    thread_mutex_unlock (&src->lock);
+    INFO1("Starting relayed source at mountpoint \"%s\"", relay->localmount);
 
-    thread_spin_lock (&relay_start_lock);
-    relays_connecting--;
-    thread_spin_unlock (&relay_start_lock);
+    if (relay->username && relay->password)
+    {
+        char *esc_authorisation;
+        unsigned len = strlen(relay->username) + strlen(relay->password) + 2;
 
-    client->flags |= CLIENT_ACTIVE;
-    worker_wakeup (client->worker);
-    return NULL;
+        DEBUG2 ("using username %s for %s", relay->username, relay->localmount);
+        rc->auth_header = malloc (len);
+        snprintf (rc->auth_header, len, "%s:%s", relay->username, relay->password);
+        esc_authorisation = util_base64_encode(rc->auth_header);
+        free(rc->auth_header);
+        len = strlen (esc_authorisation) + 24;
+        rc->auth_header = malloc (len);
+        snprintf (rc->auth_header, len,
+                "Authorization: Basic %s\r\n", esc_authorisation);
+        free(esc_authorisation);
+    }
+    return relay_connect_master (client, rc);
 }
 
 
@@ -604,7 +894,7 @@ int relay_toggle (relay_server *relay)
     }
     relay->running = relay->running ? 0 : 1;
     client->schedule_ms = 0;
-    worker_wakeup (client->worker);
+    worker_wakeup_client (client);
     slave_update_all_mounts();
     return ret;
 }
@@ -673,7 +963,10 @@ update_relay_set (relay_server **current, relay_server *updated)
                     INFO1 ("relay details changed on \"%s\", restarting", new->localmount);
                     existing_relay->new_details = new;
                     if (source && source->client)
+                    {
                         source->client->schedule_ms = 0;
+                        worker_wakeup_client (source->client);
+                    }
                 }
                 *existing_p = existing_relay->next; /* leave client to free structure */
                 new->next = new_list;
@@ -705,7 +998,6 @@ update_relay_set (relay_server **current, relay_server *updated)
 static void update_relays (relay_server **relay_list, relay_server *new_relay_list)
 {
     relay_server *active_relays, *cleanup_relays = new_relay_list;
-    worker_t *worker = NULL;
 
     if (relay_list)
     {
@@ -725,15 +1017,10 @@ static void update_relays (relay_server **relay_list, relay_server *new_relay_li
         {
             INFO1 ("relay shutdown request on \"%s\"", to_release->localmount);
             source->client->schedule_ms = 0;
+            worker_wakeup_client (source->client);
         }
         to_release->cleanup = 1;
     }
-    worker = workers;
-    while (worker)
-    {
-        worker_wakeup (worker);
-        worker = worker->next;
-    }
 }
 
 
@@ -1078,7 +1365,7 @@ static void _slave_thread(void)
             global . schedule_config_reread = 0;
         }
 
-        global_add_bitrates (global.out_bitrate, 0L, THREAD_TIME_MS(&current));
+        global_update_bitrates (THREAD_TIME_MS(&current));
         if (global.new_connections_slowdown)
             global.new_connections_slowdown--;
         if (global.new_connections_slowdown > 30)
@@ -1113,6 +1400,7 @@ static void _slave_thread(void)
             }
         }
         stats_global_calc();
+        fserve_scan (current.tv_sec);
 
         /* allow for terminating icecast if no streams running */
         if (inactivity_timer)
@@ -1393,7 +1681,7 @@ static int relay_read (client_t *client)
             return 0; /* listeners may be paused, recheck and let them leave this stream */
         }
         INFO1 ("shutting down relay %s", relay->localmount);
-        stats_event_args (source->mount, "listeners", "%lu", source->listeners);
+        stats_counter_set (source->stats_listeners, source->listeners);
         thread_mutex_unlock (&source->lock);
         stats_event (relay->localmount, NULL, NULL);
         slave_update_all_mounts();
@@ -1565,7 +1853,7 @@ static int relay_startup (client_t *client)
 
     /* limit the number of relays starting up at the same time */
     thread_spin_lock (&relay_start_lock);
-    if (relays_connecting > 3)
+    if (relays_connecting >= RELAY_CONNECTING_MAX)
     {
         thread_spin_unlock (&relay_start_lock);
         client->schedule_ms = worker->time_ms + 200;
@@ -1576,8 +1864,6 @@ static int relay_startup (client_t *client)
     relays_connecting++;
     thread_spin_unlock (&relay_start_lock);
 
-    client->flags &= ~CLIENT_ACTIVE;
-    thread_create ("Relay Thread", start_relay_stream, client, THREAD_DETACHED);
-    return 0;
+    return relay_connect_start (client);
 }
 
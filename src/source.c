@@ -53,6 +53,7 @@
 #include "auth.h"
 #include "compat.h"
 #include "slave.h"
+#include "format_mp3.h"
 
 #undef CATMODULE
 #define CATMODULE "source"
@@ -69,6 +70,8 @@ static int  source_client_shutdown (client_t *client);
 static int  source_client_http_send (client_t *client);
 static int  send_to_listener (client_t *client);
 static int  send_listener (source_t *source, client_t *client);
+static int  send_listener_unlocked (source_t *source, client_t *client);
+static int  listener_check_queue (source_t *source, client_t *client, int ret);
 static int  wait_for_restart (client_t *client);
 static int  wait_for_other_listeners (client_t *client);
 
@@ -151,6 +154,7 @@ source_t *source_reserve (const char *mount, int ret_exist)
         /* make duplicates for strings or similar */
         src->mount = strdup (mount);
         src->listener_send_trigger = 10000;
+        src->send_batch_size = 2900;
         src->format = calloc (1, sizeof(format_plugin_t));
         src->clients = avl_tree_new (client_compare, NULL);
         src->stats = stats_handle (mount);
@@ -252,6 +256,7 @@ void source_clear_source (source_t *source)
     refbuf_t *p;
 
     DEBUG1 ("clearing source \"%s\"", source->mount);
+    source_wait_unlocked_senders (source);
 
     if (source->dumpfile)
     {
@@ -272,7 +277,6 @@ void source_clear_source (source_t *source)
     {
         refbuf_t *to_go = p;
         p = to_go->next;
-        to_go->next = NULL;
         // DEBUG1 ("queue refbuf count is %d", to_go->_count);
         if (do_twice || to_go == source->min_queue_point)
         { /* burst data is also counted */
@@ -284,6 +288,12 @@ void source_clear_source (source_t *source)
     source->min_queue_point = NULL;
     source->stream_data = NULL;
     source->stream_data_tail = NULL;
+    free (source->sync_points);
+    source->sync_points = NULL;
+    source->sync_alloc = 0;
+    source->sync_head = 0;
+    source->sync_count = 0;
+    source->queue_total = 0;
 
     source->min_queue_size = 0;
     source->min_queue_offset = 0;
@@ -302,11 +312,44 @@ void source_clear_source (source_t *source)
         fclose (source->intro_file);
         source->intro_file = NULL;
     }
+    refbuf_release (source->intro_cache);
+    source->intro_cache = NULL;
 }
 
 
 /* the internal free function. at this point we know the source is
  * not on the source tree */
+/* resolve the busy mount stats to slots, or just drop the slots held. The
+ * source lock should be held, and the source stats when resolving */
+static void source_stats_slots (source_t *source, int resolve)
+{
+    stats_counter_t listeners = source->stats_listeners,
+                    peak = source->stats_listener_peak,
+                    connections = source->stats_listener_connections,
+                    slow = source->stats_slow_listeners;
+
+    source->slots_stats = resolve ? source->stats : 0;
+    if (resolve && source->stats)
+    {
+        source->stats_listeners = stats_slot (source->stats, "listeners", STATS_PUBLIC);
+        source->stats_listener_peak = stats_slot (source->stats, "listener_peak", STATS_COUNTERS);
+        source->stats_listener_connections = stats_slot (source->stats, "listener_connections", STATS_COUNTERS);
+        source->stats_slow_listeners = stats_slot (source->stats, "slow_listeners", STATS_COUNTERS);
+    }
+    else
+    {
+        source->stats_listeners = NULL;
+        source->stats_listener_peak = NULL;
+        source->stats_listener_connections = NULL;
+        source->stats_slow_listeners = NULL;
+    }
+    stats_slot_release (listeners);
+    stats_slot_release (peak);
+    stats_slot_release (connections);
+    stats_slot_release (slow);
+}
+
+
 static int _free_source (void *p)
 {
     source_t *source = p;
@@ -326,6 +369,7 @@ static int _free_source (void *p)
     INFO1 ("freeing source \"%s\"", source->mount);
     format_plugin_clear (source->format, source->client);
     free (source->format);
+    source_stats_slots (source, 0);
     free (source->mount);
     free (source);
     return 1;
@@ -366,24 +410,37 @@ static void update_source_stats (source_t *source)
     unsigned long kbytes_read = source->bytes_read_since_update/1024;
 
     source->format->sent_bytes += kbytes_sent*1024;
-    source->stats = stats_lock (source->stats, source->mount);
-    stats_set_args (source->stats, "outgoing_kbitrate", "%ld",
+    /* the mount stats may have been dropped, eg by a fallback file of the same
+     * name finishing, so look them up again. If they have been made again then
+     * the slots refer to stats that are no longer shown */
+    source->stats = stats_handle (source->mount);
+    if (source->stats != source->slots_stats ||
+            stats_slot_stale (source->stats_listeners) ||
+            stats_slot_stale (source->stats_listener_peak) ||
+            stats_slot_stale (source->stats_listener_connections) ||
+            stats_slot_stale (source->stats_slow_listeners))
+    {
+        DEBUG1 ("stats for %s have changed, updating slots", source->mount);
+        source_stats_slots (source, 1);
+        stats_counter_set (source->stats_listeners, source->listeners);
+        stats_counter_set (source->stats_listener_peak, source->peak_listeners);
+    }
+    stats_set_count (source->stats, "outgoing_kbitrate",
             (long)(8 * rate_avg (source->format->out_bitrate))/1024);
-    stats_set_args (source->stats, "incoming_bitrate", "%ld", (8 * incoming_rate));
-    stats_set_args (source->stats, "total_bytes_read", "%"PRIu64, source->format->read_bytes);
-    stats_set_args (source->stats, "total_bytes_sent", "%"PRIu64, source->format->sent_bytes);
-    stats_set_args (source->stats, "total_mbytes_sent",
-            "%"PRIu64, source->format->sent_bytes/(1024*1024));
-    stats_set_args (source->stats, "queue_size", "%u", source->queue_size);
+    stats_set_count (source->stats, "incoming_bitrate", (8 * incoming_rate));
+    stats_set_count (source->stats, "total_bytes_read", source->format->read_bytes);
+    stats_set_count (source->stats, "total_bytes_sent", source->format->sent_bytes);
+    stats_set_count (source->stats, "total_mbytes_sent", source->format->sent_bytes/(1024*1024));
+    stats_set_count (source->stats, "queue_size", source->queue_size);
     if (source->client->connection.con_time)
     {
         worker_t *worker = source->client->worker;
-        stats_set_args (source->stats, "connected", "%"PRIu64,
-                (uint64_t)(worker->current_time.tv_sec - source->client->connection.con_time));
+        stats_set_count (source->stats, "connected",
+                (int64_t)(worker->current_time.tv_sec - source->client->connection.con_time));
     }
     stats_release (source->stats);
-    stats_event_add (NULL, "stream_kbytes_sent", kbytes_sent);
-    stats_event_add (NULL, "stream_kbytes_read", kbytes_read);
+    stats_counter_add (stats_counters.stream_kbytes_sent, kbytes_sent);
+    stats_counter_add (stats_counters.stream_kbytes_read, kbytes_read);
 
     source->bytes_sent_since_update %= 1024;
     source->bytes_read_since_update %= 1024;
@@ -391,6 +448,78 @@ static void update_source_stats (source_t *source)
 }
 
 
+/* listeners add to the sent byte count without holding the source lock,
+ * so collect that here for the outgoing rate and stats
+ */
+static void source_collect_sent (source_t *source, uint64_t now)
+{
+    unsigned long sent = source->bytes_sent_pending;
+
+    atomic_sub (&source->bytes_sent_pending, sent);
+    rate_add (source->format->out_bitrate, sent, now);
+    source->bytes_sent_since_update += sent;
+}
+
+
+/* record a sync block as it is added to the queue. The ring is kept in queue
+ * order so doubling it just needs the wrapped part moved to the end.
+ */
+static void source_sync_add (source_t *source, refbuf_t *refbuf, uint64_t offset, uint64_t now)
+{
+    struct source_sync_point *point;
+
+    if (source->sync_count == source->sync_alloc)
+    {
+        unsigned int alloc = source->sync_alloc ? source->sync_alloc * 2 : 64;
+        struct source_sync_point *p = realloc (source->sync_points, alloc * sizeof (*p));
+
+        if (p == NULL)
+            return;
+        if (source->sync_head)
+            memcpy (p + source->sync_alloc, p, source->sync_head * sizeof (*p));
+        source->sync_points = p;
+        source->sync_alloc = alloc;
+    }
+    point = &source->sync_points [(source->sync_head + source->sync_count) & (source->sync_alloc - 1)];
+    point->offset = offset;
+    point->time_ms = now;
+    point->refbuf = refbuf;
+    source->sync_count++;
+}
+
+
+/* the head of the queue is going, drop it from the sync index if it is there */
+static void source_sync_drop (source_t *source, refbuf_t *refbuf)
+{
+    if (source->sync_count && source->sync_points [source->sync_head].refbuf == refbuf)
+    {
+        source->sync_head = (source->sync_head + 1) & (source->sync_alloc - 1);
+        source->sync_count--;
+    }
+}
+
+
+/* find the oldest sync point at or after the queue offset and time given */
+static struct source_sync_point *source_sync_find (source_t *source, uint64_t offset, uint64_t time_ms)
+{
+    unsigned int low = 0, high = source->sync_count;
+
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        struct source_sync_point *point = &source->sync_points [(source->sync_head + mid) & (source->sync_alloc - 1)];
+
+        if (point->offset < offset || point->time_ms < time_ms)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == source->sync_count)
+        return NULL;
+    return &source->sync_points [(source->sync_head + low) & (source->sync_alloc - 1)];
+}
+
+
 /* get some data from the source. The stream data is placed in a refbuf
  * and sent back, however NULL is also valid as in the case of a short
  * timeout and there's no data pending.
@@ -429,17 +558,16 @@ int source_read (source_t *source)
             }
             source->flags &= ~SOURCE_LISTENERS_SYNC;
         }
-        if (source->listeners == 0)
-            rate_add (source->format->out_bitrate, 0, client->worker->time_ms);
+        source_collect_sent (source, client->worker->time_ms);
         if (source->prev_listeners != source->listeners)
         {
             INFO2("listener count on %s now %lu", source->mount, source->listeners);
             source->prev_listeners = source->listeners;
-            stats_event_args (source->mount, "listeners", "%lu", source->listeners);
+            stats_counter_set (source->stats_listeners, source->listeners);
             if (source->listeners > source->peak_listeners)
             {
                 source->peak_listeners = source->listeners;
-                stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
+                stats_counter_set (source->stats_listener_peak, source->peak_listeners);
             }
         }
         if (current >= source->client_stats_update)
@@ -495,7 +623,7 @@ int source_read (source_t *source)
             {
                 source->bytes_read_since_update += refbuf->len;
 
-                refbuf->flags |= SOURCE_QUEUE_BLOCK;
+                refbuf->flags |= (SOURCE_QUEUE_BLOCK|REFBUF_LINKED);
                 /* the latest refbuf is counted twice so that it stays */
                 refbuf_addref (refbuf);
 
@@ -513,11 +641,14 @@ int source_read (source_t *source)
                         ERROR3 ("queue oddity, stream %s, %d, %d", source->mount, source->min_queue_offset, source->min_queue_size);
                         source->flags &= ~SOURCE_RUNNING;
                     }
-                    source->stream_data_tail->next = refbuf;
+                    refbuf_link (source->stream_data_tail, refbuf);
                     refbuf_release (source->stream_data_tail);
                 }
                 source->stream_data_tail = refbuf;
                 source->queue_size += refbuf->len;
+                if (refbuf->flags & SOURCE_BLOCK_SYNC)
+                    source_sync_add (source, refbuf, source->queue_total, client->worker->time_ms);
+                source->queue_total += refbuf->len;
 
                 /* increase refcount for keeping burst data */
                 refbuf_addref (refbuf);
@@ -562,14 +693,15 @@ int source_read (source_t *source)
 
         /* lets see if we have too much data in the queue */
         while (source->queue_size > source->queue_size_limit ||
-                (source->stream_data && source->stream_data->_count == 1))
+                (source->stream_data && refbuf_count (source->stream_data) == 1))
         {
             refbuf_t *to_go = source->stream_data;
             source->stream_data = to_go->next;
             source->queue_size -= to_go->len;
-            to_go->next = NULL;
-            /* mark for delete to tell others holding it and release it ourselves */
-            to_go->flags |= SOURCE_BLOCK_RELEASE;
+            source_sync_drop (source, to_go);
+            /* mark for delete to tell others holding it and release it ourselves,
+             * the link to the next block goes when the last holder releases it */
+            refbuf_set_flags (to_go, SOURCE_BLOCK_RELEASE);
             refbuf_release (to_go);
         }
     } while (0);
@@ -578,11 +710,28 @@ int source_read (source_t *source)
         client->schedule_ms += (source->skip_duration | 0xF);
     else
         client->schedule_ms += 15;
+    atomic_store (&source->tail_pos, client->queue_pos);
+    atomic_store (&source->next_read_ms, client->schedule_ms);
+    source->reader = client->worker;
     thread_mutex_unlock (&source->lock);
     return 0;
 }
 
 
+/* listeners sending without the lock only start if the source is running,
+ * so once that is cleared, wait for any still sending before the format or
+ * queue are reset.
+ */
+void source_wait_unlocked_senders (source_t *source)
+{
+#ifdef HAVE_ATOMIC_OPS
+    atomic_barrier();
+    while (atomic_load (&source->unlocked_senders))
+        thread_sleep (1000);
+#endif
+}
+
+
 void source_listeners_wakeup (source_t *source)
 {
     client_t *s = source->client;
@@ -593,6 +742,7 @@ void source_listeners_wakeup (source_t *source)
         if (s->schedule_ms + 100 < client->schedule_ms)
             DEBUG2 ("listener on %s was ahead by %ld", source->mount, (long)(client->schedule_ms - s->schedule_ms));
         client->schedule_ms = 0;
+        worker_wakeup_client (client);
         node = avl_get_next (node);
     }
 }
@@ -661,7 +811,7 @@ static int source_client_read (client_t *client)
                 return 0;
             }
             INFO1 ("no more listeners on %s", source->mount);
-            stats_event_args (source->mount, "listeners", "%lu", source->listeners);
+            stats_counter_set (source->stats_listeners, source->listeners);
             client->connection.discon_time = 0;
             client->ops = &source_client_halt_ops;
             free (source->fallback.mount);
@@ -687,12 +837,14 @@ static int source_queue_advance (client_t *client)
     /* move to the next buffer if we have finished with the current one */
     if (client->pos >= refbuf->len)
     {
-        if (refbuf->next == NULL)
+        refbuf_t *next = refbuf_next (refbuf);
+
+        if (next == NULL)
         {
-            client->schedule_ms = source->client->schedule_ms + 5;
+            client->schedule_ms = atomic_load (&source->next_read_ms) + 5;
             return -1;
         }
-        client_set_queue (client, refbuf->next);
+        client_set_queue (client, next);
     }
     return source->format->write_buf_to_client (client);
 }
@@ -717,13 +869,55 @@ static int locate_start_on_queue (source_t *source, client_t *client)
     {
         const char *header = httpp_getvar (client->parser, "initial-burst");
         const char *arg = httpp_get_query_param (client->parser, "burst");
+        const char *msecs = httpp_get_query_param (client->parser, "burst-ms");
         size_t size = source->min_queue_size;
         off_t v = source->default_burst_size;
-        if (arg)
+        uint64_t time_ms = 0;
+
+        if (msecs == NULL)
+            msecs = httpp_getvar (client->parser, "initial-burst-ms");
+        if (msecs)
+        {
+            uint64_t ms = strtoull (msecs, NULL, 10);
+            if (ms < client->worker->time_ms)
+                time_ms = client->worker->time_ms - ms;
+            v = source->min_queue_offset;
+        }
+        else if (arg)
             v = atol (arg);
         else if (header)
             v = atol (header);
         v -= client->connection.sent_bytes; /* have we sent data already */
+        if (source->sync_count)
+        {
+            /* binary search the sync index, the burst cannot go back past the min queue point */
+            uint64_t start = source->queue_total - source->min_queue_offset;
+            struct source_sync_point *point;
+
+            if (v < 0)
+                v = 0;
+            if ((uint64_t)v < source->min_queue_offset)
+                start = source->queue_total - v;
+            point = source_sync_find (source, start, time_ms);
+            if (point == NULL)
+            {
+                /* nothing that recent, the latest block will do if it is a sync point */
+                point = &source->sync_points [(source->sync_head + source->sync_count - 1) & (source->sync_alloc - 1)];
+                if (point->refbuf != source->stream_data_tail)
+                    point = NULL;
+            }
+            if (point == NULL)
+            {
+                client->schedule_ms += 150;
+                return -1;
+            }
+            client_set_queue (client, point->refbuf);
+            client->intro_offset = -1;
+            client->pos = 0;
+            client->queue_pos = source->client->queue_pos - (source->queue_total - point->offset);
+            return 0;
+        }
+        /* nothing indexed, eg the format marks sync blocks after queueing, so walk the queue */
         refbuf = source->min_queue_point;
         lag = source->min_queue_offset;
         // DEBUG3 ("size %lld, v %lld, lag %ld", size, v, lag);
@@ -760,7 +954,7 @@ static int http_source_introfile (client_t *client)
     source_t *source = client->shared_data;
 
     //DEBUG2 ("client intro_pos is %ld, sent bytes is %ld", client->intro_offset, client->connection.sent_bytes);
-    if (format_file_read (client, source->format, source->intro_file) < 0)
+    if (format_file_read (client, source->format, source->intro_file, source->intro_cache) < 0)
     {
         if (source->stream_data_tail)
         {
@@ -827,7 +1021,7 @@ static int http_source_listener (client_t *client)
             ERROR0 ("internal problem, dropping client");
             return -1;
         }
-        stats_event_inc (source->mount, "listener_connections");
+        stats_counter_add (source->stats_listener_connections, 1);
     }
     ret = format_generic_write_to_client (client);
     if (client->pos == refbuf->len)
@@ -932,8 +1126,14 @@ static int send_to_listener (client_t *client)
 
     if (source == NULL)
         return -1;
+    ret = send_listener_unlocked (source, client);
+    if (ret == 0)
+        return 0;
     thread_mutex_lock (&source->lock);
-    ret = send_listener (source, client);
+    if (ret > 0)
+        ret = listener_check_queue (source, client, client->connection.error ? -1 : 0);
+    else
+        ret = send_listener (source, client);
     if (ret == 1)
         return 1; // client moved, and source unlocked
     if (ret < 0)
@@ -983,40 +1183,19 @@ int listener_waiting_on_source (source_t *source, client_t *client)
 }
 
 
-static int send_listener (source_t *source, client_t *client)
+/* send queued data to the listener. This may be called without the source
+ * lock, in which case the listener must already be on the queue, as the
+ * blocks are counted and linked so the source only appends to it.
+ */
+static int send_listener_queue (source_t *source, client_t *client, uint64_t source_pos)
 {
     int bytes;
     int loop = 12;   /* max number of iterations in one go */
     long total_written = 0, limiter = source->listener_send_trigger;
     int ret = 0, lag;
     worker_t *worker = client->worker;
-    time_t now = worker->current_time.tv_sec;
-
-    if (source->flags & SOURCE_LISTENERS_SYNC)
-        return listener_waiting_on_source (source, client);
-
-    if (client->connection.error)
-        return -1;
-
-    /* check for limited listener time */
-    if (client->connection.discon_time && now >= client->connection.discon_time)
-    {
-        INFO1 ("time limit reached for client #%lu", client->connection.id);
-        return -1;
-    }
-    if (source_running (source) == 0)
-    {
-        DEBUG0 ("source not running, listener will wait");
-        client->schedule_ms += 100;
-        return 0;
-    }
-
-    // do we migrate this listener to the same handler as the source client
-    if (source->client_stats_update-1 == now && source->client->worker != worker)
-        if (listener_change_worker (client, source))
-            return 1;
 
-    lag = source->client->queue_pos - client->queue_pos;
+    lag = source_pos - client->queue_pos;
 
     if (source->incoming_rate && lag < source->incoming_rate)
         limiter = source->incoming_rate/2;
@@ -1063,17 +1242,70 @@ static int send_listener (source_t *source, client_t *client)
         total_written += bytes;
         loop--;
     }
-    rate_add (source->format->out_bitrate, total_written, worker->time_ms);
-    global_add_bitrates (global.out_bitrate, total_written, worker->time_ms);
-    source->bytes_sent_since_update += total_written;
+    global_add_bitrates (worker, total_written);
+    atomic_add (&source->bytes_sent_pending, total_written);
+    return ret;
+}
+
 
-    /* the refbuf referenced at head (last in queue) may be marked for deletion
-     * if so, check to see if this client is still referring to it */
-    if (client->refbuf && (client->refbuf->flags & SOURCE_BLOCK_RELEASE))
+/* listeners streaming from the queue are sent to without the source lock.
+ * Anything else, such as intro content, a source not running, worker
+ * migration or a listener to be removed, is left for the locked path.
+ * returns 0 if the listener was handled, -1 if nothing was sent so the
+ * locked path should send, or 1 if data may have gone out but the listener
+ * is to be checked under the lock.
+ */
+static int send_listener_unlocked (source_t *source, client_t *client)
+{
+#ifdef HAVE_ATOMIC_OPS
+    refbuf_t *refbuf = client->refbuf;
+    time_t now = client->worker->current_time.tv_sec;
+    int ret;
+
+    if (client->check_buffer != source_queue_advance || refbuf == NULL ||
+            (refbuf_flags (refbuf) & (SOURCE_QUEUE_BLOCK|SOURCE_BLOCK_RELEASE)) != SOURCE_QUEUE_BLOCK)
+        return -1;
+    if (client->flags & CLIENT_WANTS_FLV)
+        return -1;  /* flv wrapping may alter the shared block */
+    if (client->connection.error ||
+            (client->connection.discon_time && now >= client->connection.discon_time))
+        return -1;
+    if (source->client_stats_update-1 == now && source->reader != client->worker)
+        return -1;
+
+    /* the count stops the format being reset while we send, see
+     * source_wait_unlocked_senders, so check the source state after it */
+    atomic_add (&source->unlocked_senders, 1);
+    atomic_barrier();
+    if ((source->flags & (SOURCE_RUNNING|SOURCE_LISTENERS_SYNC)) != SOURCE_RUNNING)
+    {
+        atomic_sub (&source->unlocked_senders, 1);
+        return -1;
+    }
+    ret = send_listener_queue (source, client, atomic_load (&source->tail_pos));
+    atomic_sub (&source->unlocked_senders, 1);
+
+    /* a listener that has failed or fallen behind is removed under the lock */
+    if (ret < 0 || (client->refbuf && (refbuf_flags (client->refbuf) & SOURCE_BLOCK_RELEASE)))
+        return 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+/* the refbuf referenced at head (last in queue) may be marked for deletion
+ * if so, check to see if this client is still referring to it. ret is from
+ * the send and is returned unless the client is to be removed.
+ */
+static int listener_check_queue (source_t *source, client_t *client, int ret)
+{
+    if (client->refbuf && (refbuf_flags (client->refbuf) & SOURCE_BLOCK_RELEASE))
     {
         INFO3 ("Client %lu (%s) has fallen too far behind on %s, removing",
                 client->connection.id, client->connection.ip, source->mount);
-        stats_event_inc (source->mount, "slow_listeners");
+        stats_counter_add (source->stats_slow_listeners, 1);
         client_set_queue (client, NULL);
         ret = -1;
     }
@@ -1081,6 +1313,41 @@ static int send_listener (source_t *source, client_t *client)
 }
 
 
+static int send_listener (source_t *source, client_t *client)
+{
+    int ret;
+    worker_t *worker = client->worker;
+    time_t now = worker->current_time.tv_sec;
+
+    if (source->flags & SOURCE_LISTENERS_SYNC)
+        return listener_waiting_on_source (source, client);
+
+    if (client->connection.error)
+        return -1;
+
+    /* check for limited listener time */
+    if (client->connection.discon_time && now >= client->connection.discon_time)
+    {
+        INFO1 ("time limit reached for client #%lu", client->connection.id);
+        return -1;
+    }
+    if (source_running (source) == 0)
+    {
+        DEBUG0 ("source not running, listener will wait");
+        client->schedule_ms += 100;
+        return 0;
+    }
+
+    // do we migrate this listener to the same handler as the source client
+    if (source->client_stats_update-1 == now && source->client->worker != worker)
+        if (listener_change_worker (client, source))
+            return 1;
+
+    ret = send_listener_queue (source, client, source->client->queue_pos);
+    return listener_check_queue (source, client, ret);
+}
+
+
 /* Perform any initialisation before the stream data is processed, the header
  * info is processed by now and the format details are setup
  */
@@ -1116,6 +1383,9 @@ void source_init (source_t *source)
     stats_event_flags (source->mount, "queue_size", "0", STATS_COUNTERS);
     stats_event_flags (source->mount, "connected", "0", STATS_COUNTERS);
     stats_event_flags (source->mount, "source_ip", source->client->connection.ip, STATS_COUNTERS);
+    source->stats = stats_lock (source->stats, source->mount);
+    source_stats_slots (source, 1);
+    stats_release (source->stats);
 
     source->last_read = time(NULL);
     source->prev_listeners = -1;
@@ -1495,6 +1765,8 @@ static void source_apply_mount (source_t *source, mount_proxy *mountinfo)
         fclose (source->intro_file);
         source->intro_file = NULL;
     }
+    refbuf_release (source->intro_cache);
+    source->intro_cache = NULL;
     if (mountinfo && mountinfo->intro_filename)
     {
         ice_config_t *config = config_get_config_unlocked ();
@@ -1510,7 +1782,10 @@ static void source_apply_mount (source_t *source, mount_proxy *mountinfo)
             DEBUG1 ("intro file is %s", mountinfo->intro_filename);
             f = fopen (path, "rb");
             if (f)
+            {
                 source->intro_file = f;
+                source->intro_cache = fserve_load_file (f, NULL);
+            }
             else
                 WARN2 ("Cannot open intro file \"%s\": %s", path, strerror(errno));
             free (path);
@@ -1552,12 +1827,16 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
     source->min_queue_size = config->min_queue_size;
     source->timeout = config->source_timeout;
     source->default_burst_size = config->burst_size;
+    source->send_batch_size = config->send_batch_size;
     source->stats = stats_handle (source->mount);
 
     len = strlen (config->hostname) + strlen(source->mount) + 16;
     listen_url = alloca (len);
     snprintf (listen_url, len, "http://%s:%d%s", config->hostname, config->port, source->mount);
     stats_set_flags (source->stats, "listenurl", listen_url, STATS_COUNTERS);
+    source_stats_slots (source, 1);
+    if (source->format)
+        format_reset_headers (source->format);
 
     source_apply_mount (source, mountinfo);
 
@@ -1849,7 +2128,7 @@ static int source_listener_release (source_t *source, client_t *client)
     if (source->listeners == 0)
         rate_reduce (source->format->out_bitrate, 1000);
 
-    stats_event_dec (NULL, "listeners");
+    stats_counter_add (stats_counters.listeners, -1);
     /* change of listener numbers, so reduce scope of global sampling */
     global_reduce_bitrate_sampling (global.out_bitrate);
 
@@ -1913,8 +2192,8 @@ int source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *cl
                     if (move_listener (client, &f) == 0)
                     {
                         /* source dead but fallback to file found */
-                        stats_event_inc (NULL, "listeners");
-                        stats_event_inc (NULL, "listener_connections");
+                        stats_counter_add (stats_counters.listeners, 1);
+                        stats_counter_add (stats_counters.listener_connections, 1);
                         return 0;
                     }
                 }
@@ -2012,13 +2291,13 @@ int source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *cl
     else
     {
         client->flags |= CLIENT_ACTIVE; // from an auth thread context
-        worker_wakeup (client->worker);
+        worker_wakeup_client (client);
     }
     thread_mutex_unlock (&source->lock);
     global_reduce_bitrate_sampling (global.out_bitrate);
 
-    stats_event_inc (NULL, "listeners");
-    stats_event_inc (NULL, "listener_connections");
+    stats_counter_add (stats_counters.listeners, 1);
+    stats_counter_add (stats_counters.listener_connections, 1);
 
     if (do_process) // send something back quickly
         return client->ops->process (client);
@@ -2052,7 +2331,7 @@ void source_setup_listener (source_t *source, client_t *client)
     {
         source->client->schedule_ms = 0;
         client->schedule_ms += 300;
-        worker_wakeup (source->client->worker);
+        worker_wakeup_client (source->client);
         DEBUG0 ("woke up relay");
     }
 }
@@ -2095,10 +2374,11 @@ static void source_swap_client (source_t *source, client_t *client)
 
     source->format->read_bytes = 0;
     source->format->parser = source->client->parser;
+    format_reset_headers (source->format);
     if (source->format->swap_client)
         source->format->swap_client (client, old_client);
 
-    worker_wakeup (old_client->worker);
+    worker_wakeup_client (old_client);
 }
 
 
@@ -2169,7 +2449,7 @@ int source_startup (client_t *client, const char *uri)
             thread_mutex_unlock (&source->lock);
         }
         client->flags |= CLIENT_ACTIVE;
-        worker_wakeup (client->worker);
+        worker_wakeup_client (client);
     }
     else
     {
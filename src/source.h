@@ -18,14 +18,23 @@
 #include "util.h"
 #include "format.h"
 #include "fserve.h"
+#include "stats.h"
 
 #include <stdio.h>
 
+struct source_sync_point
+{
+    uint64_t offset;    /* queue_total at the start of the block */
+    uint64_t time_ms;
+    refbuf_t *refbuf;
+};
+
 typedef struct source_tag
 {
     char *mount;
     unsigned int flags;
     int listener_send_trigger;
+    int send_batch_size;
 
     client_t *client;
     time_t client_stats_update;
@@ -39,6 +48,7 @@ typedef struct source_tag
 
     /* name of a file, whose contents are sent at listener connection */
     FILE *intro_file;
+    refbuf_t *intro_cache;
 
     char *dumpfilename; /* Name of a file to dump incoming stream to */
     FILE *dumpfile;
@@ -69,8 +79,16 @@ typedef struct source_tag
     unsigned timeout;  /* source timeout in seconds */
     unsigned long bytes_sent_since_update;
     unsigned long bytes_read_since_update;
+    unsigned long bytes_sent_pending;   /* added to by listeners, collected by the source */
+    unsigned int unlocked_senders;      /* listeners sending without the lock */
     int stats_interval;
     long stats;
+    /* frequently updated mount stats */
+    stats_counter_t stats_listeners;
+    stats_counter_t stats_listener_peak;
+    stats_counter_t stats_listener_connections;
+    stats_counter_t stats_slow_listeners;
+    long slots_stats;   /* the stats handle the slots were taken from */
 
     time_t last_read;
 
@@ -79,6 +97,18 @@ typedef struct source_tag
     refbuf_t *stream_data;
     refbuf_t *stream_data_tail;
 
+    /* ring of sync blocks on the queue, oldest first, for placing new listeners */
+    struct source_sync_point *sync_points;
+    unsigned int sync_alloc;
+    unsigned int sync_head;
+    unsigned int sync_count;
+    uint64_t queue_total;   /* bytes ever added to the queue */
+
+    /* copies of source client details for listeners sending without the lock */
+    uint64_t tail_pos;
+    uint64_t next_read_ms;
+    worker_t *reader;
+
 } source_t;
 
 #define SOURCE_RUNNING              1
@@ -112,6 +142,7 @@ void source_init (source_t *source);
 void source_shutdown (source_t *source, int with_fallback);
 void source_set_fallback (source_t *source, const char *dest_mount);
 void source_listeners_wakeup (source_t *source);
+void source_wait_unlocked_senders (source_t *source);
 
 #define SOURCE_BLOCK_SYNC           01
 #define SOURCE_BLOCK_RELEASE        02
@@ -40,6 +40,7 @@
 #include "xslt.h"
 #include "util.h"
 #include "fserve.h"
+#include "auth.h"
 #define CATMODULE "stats"
 #include "logging.h"
 
@@ -47,7 +48,7 @@
 #define atoll(nptr) strtoll(nptr, (char **)NULL, 10)
 #endif
 
-#define VAL_BUFSIZE 20
+#define VAL_BUFSIZE 24
 #define STATS_BLOCK_CONNECTION  01
 
 #define STATS_EVENT_SET     0
@@ -56,13 +57,22 @@
 #define STATS_EVENT_ADD     3
 #define STATS_EVENT_SUB     4
 #define STATS_EVENT_REMOVE  5
+#define STATS_EVENT_COUNT   6
 #define STATS_EVENT_HIDDEN  0x80
 
+#define STATS_EVENT_NUMERIC(A)  (((A) >= STATS_EVENT_INC && (A) <= STATS_EVENT_SUB) || (A) == STATS_EVENT_COUNT)
+
+/* a stat is held as text, or once it has been incremented or added to, as a
+ * number which is only formatted when it is sent out */
 typedef struct _stats_node_tag
 {
     char *name;
-    char *value;
+    char *value;        /* NULL for a numeric stat */
+    int64_t count;
+    int64_t sent;       /* last count sent out for a mount slot */
     int  flags;
+    int  refs;          /* the tree plus any slots */
+    int  removed;       /* no longer in the tree, slots are stale */
 } stats_node_t;
 
 typedef struct _stats_event_tag
@@ -70,6 +80,7 @@ typedef struct _stats_event_tag
     char *source;
     char *name;
     char *value;
+    int64_t count;      /* amount for numeric actions */
     int  flags;
     int  action;
 
@@ -105,6 +116,7 @@ typedef struct _stats_tag
     /* list of listeners for stats */
     event_listener_t *event_listeners;
     mutex_t listeners_lock;
+    spin_t slot_lock;
 
 } stats_t;
 
@@ -125,12 +137,15 @@ static void stats_listener_send (int flags, const char *fmt, ...);
 
 unsigned int throttle_sends;
 
+struct _stats_counters stats_counters;
+
 /* simple helper function for creating an event */
 static void build_event (stats_event_t *event, const char *source, const char *name, const char *value)
 {
     event->source = (char *)source;
     event->name = (char *)name;
     event->value = (char *)value;
+    event->count = 0;
     event->flags = STATS_PUBLIC;
     if (source) event->flags |= STATS_SLAVE;
     if (value)
@@ -151,6 +166,7 @@ void stats_initialize(void)
 
     _stats.event_listeners = NULL;
     thread_mutex_create (&_stats.listeners_lock);
+    thread_spin_create (&_stats.slot_lock);
 
     _stats_running = 1;
 
@@ -174,6 +190,17 @@ void stats_initialize(void)
     stats_event_flags (NULL, "outgoing_kbitrate", "0", STATS_COUNTERS|STATS_REGULAR);
     stats_event_flags (NULL, "stream_kbytes_sent", "0", STATS_COUNTERS|STATS_REGULAR);
     stats_event_flags (NULL, "stream_kbytes_read", "0", STATS_COUNTERS|STATS_REGULAR);
+
+    /* frequently updated, so sent out with the regular stats */
+    stats_counters.connections = stats_counter ("connections", STATS_COUNTERS);
+    stats_counters.client_connections = stats_counter ("client_connections", STATS_COUNTERS);
+    stats_counters.listener_connections = stats_counter ("listener_connections", STATS_COUNTERS);
+    stats_counters.file_connections = stats_counter ("file_connections", STATS_COUNTERS);
+    stats_counters.listeners = stats_counter ("listeners", STATS_PUBLIC);
+    stats_counters.stream_kbytes_sent = stats_counter ("stream_kbytes_sent", STATS_COUNTERS);
+    stats_counters.stream_kbytes_read = stats_counter ("stream_kbytes_read", STATS_COUNTERS);
+    stats_counters.auth_cache_hits = stats_counter ("auth_cache_hits", STATS_COUNTERS);
+    stats_counters.auth_cache_misses = stats_counter ("auth_cache_misses", STATS_COUNTERS);
 }
 
 void stats_shutdown(void)
@@ -182,10 +209,12 @@ void stats_shutdown(void)
         return;
 
     _stats_running = 0;
+    memset (&stats_counters, 0, sizeof (stats_counters));
 
     avl_tree_free(_stats.source_tree, _free_source_stats);
     avl_tree_free(_stats.global_tree, _free_stats);
     thread_mutex_destroy (&_stats.listeners_lock);
+    thread_spin_destroy (&_stats.slot_lock);
 }
 
 
@@ -269,6 +298,23 @@ void stats_event_args(const char *source, char *name, char *format, ...)
     stats_event(source, name, buf);
 }
 
+/* text of the stat, numeric ones are formatted into buf */
+static const char *stats_node_text (stats_node_t *node, char *buf)
+{
+    if (node->value)
+        return node->value;
+    snprintf (buf, VAL_BUFSIZE, "%" PRId64, (int64_t)atomic_load (&node->count));
+    return buf;
+}
+
+
+static char *stats_node_strdup (stats_node_t *node)
+{
+    char buf [VAL_BUFSIZE];
+    return strdup (stats_node_text (node, buf));
+}
+
+
 static char *_get_stats(const char *source, const char *name)
 {
     stats_node_t *stats = NULL;
@@ -278,7 +324,7 @@ static char *_get_stats(const char *source, const char *name)
     if (source == NULL) {
         avl_tree_rlock (_stats.global_tree);
         stats = _find_node(_stats.global_tree, name);
-        if (stats) value = (char *)strdup(stats->value);
+        if (stats) value = stats_node_strdup (stats);
         avl_tree_unlock (_stats.global_tree);
     } else {
         avl_tree_rlock (_stats.source_tree);
@@ -288,7 +334,7 @@ static char *_get_stats(const char *source, const char *name)
             avl_tree_rlock (src->stats_tree);
             avl_tree_unlock (_stats.source_tree);
             stats = _find_node(src->stats_tree, name);
-            if (stats) value = (char *)strdup(stats->value);
+            if (stats) value = stats_node_strdup (stats);
             avl_tree_unlock (src->stats_tree);
         }
         else
@@ -310,7 +356,7 @@ char *stats_retrieve (long handle, const char *name)
     stats_source_t *src_stats = (stats_source_t *)handle;
     stats_node_t *stats = _find_node (src_stats->stats_tree, name);
 
-    if (stats) v =  strdup (stats->value);
+    if (stats) v = stats_node_strdup (stats);
     return v;
 }
 
@@ -319,23 +365,22 @@ char *stats_retrieve (long handle, const char *name)
 void stats_event_inc(const char *source, const char *name)
 {
     stats_event_t event;
-    char buffer[VAL_BUFSIZE] = "1";
-    build_event (&event, source, name, buffer);
+    build_event (&event, source, name, NULL);
     /* DEBUG2("%s on %s", name, source==NULL?"global":source); */
     event.action = STATS_EVENT_INC;
+    event.count = 1;
     process_event (&event);
 }
 
 void stats_event_add(const char *source, const char *name, unsigned long value)
 {
     stats_event_t event;
-    char buffer [VAL_BUFSIZE];
 
     if (value == 0)
         return;
-    build_event (&event, source, name, buffer);
-    snprintf (buffer, VAL_BUFSIZE, "%ld", value);
+    build_event (&event, source, name, NULL);
     event.action = STATS_EVENT_ADD;
+    event.count = value;
     /* DEBUG2("%s on %s", name, source==NULL?"global":source); */
     process_event (&event);
 }
@@ -343,14 +388,13 @@ void stats_event_add(const char *source, const char *name, unsigned long value)
 void stats_event_sub(const char *source, const char *name, unsigned long value)
 {
     stats_event_t event;
-    char buffer[VAL_BUFSIZE];
 
     if (value == 0)
         return;
-    build_event (&event, source, name, buffer);
+    build_event (&event, source, name, NULL);
     /* DEBUG2("%s on %s", name, source==NULL?"global":source); */
-    snprintf (buffer, VAL_BUFSIZE, "%ld", value);
     event.action = STATS_EVENT_SUB;
+    event.count = -(int64_t)value;
     process_event (&event);
 }
 
@@ -358,10 +402,10 @@ void stats_event_sub(const char *source, const char *name, unsigned long value)
 void stats_event_dec(const char *source, const char *name)
 {
     stats_event_t event;
-    char buffer[VAL_BUFSIZE] = "0";
     /* DEBUG2("%s on %s", name, source==NULL?"global":source); */
-    build_event (&event, source, name, buffer);
+    build_event (&event, source, name, NULL);
     event.action = STATS_EVENT_DEC;
+    event.count = -1;
     process_event (&event);
 }
 
@@ -426,40 +470,55 @@ static void modify_node_event (stats_node_t *node, stats_event_t *event)
         return;
     if (event->action & STATS_EVENT_HIDDEN)
     {
-        node->flags = event->flags;
+        /* counters stay with the regular stats */
+        node->flags = event->flags | (node->flags & STATS_REGULAR);
         event->action &= ~STATS_EVENT_HIDDEN;
         if (event->value == NULL)
             return;
     }
-    if (event->action != STATS_EVENT_SET)
+    if (STATS_EVENT_NUMERIC (event->action))
     {
-        int64_t value = 0;
-
-        switch (event->action)
+        if (node->value)
         {
-            case STATS_EVENT_INC:
-                value = atoll (node->value)+1;
-                break;
-            case STATS_EVENT_DEC:
-                value = atoll (node->value)-1;
-                break;
-            case STATS_EVENT_ADD:
-                value = atoll (node->value) + atoll (event->value);
-                break;
-            case STATS_EVENT_SUB:
-                value = atoll (node->value) - atoll (event->value);
-                break;
-            default:
-                break;
+            /* from now on this stat is kept as a number */
+            atomic_store (&node->count, atoll (node->value));
+            free (node->value);
+            node->value = NULL;
         }
-        snprintf (event->value, VAL_BUFSIZE, "%" PRId64, value);
+        if (event->action == STATS_EVENT_COUNT)
+            atomic_store (&node->count, event->count);
+        else
+            atomic_add (&node->count, event->count);
+        return;
     }
     if (node->value)
     {
         free (node->value);
         node->value = strdup (event->value);
     }
-    DEBUG3 ("update \"%s\" %s (%s)", event->source?event->source:"global", node->name, node->value);
+    else
+        atomic_store (&node->count, atoll (event->value));
+    DEBUG3 ("update \"%s\" %s (%s)", event->source?event->source:"global", node->name, event->value);
+}
+
+
+/* create a new stats node for the event */
+static stats_node_t *stats_node_new (stats_event_t *event)
+{
+    stats_node_t *node = (stats_node_t *)calloc (1, sizeof(stats_node_t));
+
+    node->name = (char *)strdup (event->name);
+    if (STATS_EVENT_NUMERIC (event->action))
+    {
+        /* decrements of a missing stat start at 0 */
+        if (event->count > 0 || event->action == STATS_EVENT_COUNT)
+            node->count = event->count;
+    }
+    else
+        node->value = (char *)strdup (event->value);
+    node->flags = event->flags;
+    node->refs = 1;
+    return node;
 }
 
 
@@ -483,21 +542,17 @@ static void process_global_event (stats_event_t *event)
     }
     node = _find_node(_stats.global_tree, event->name);
     if (node)
-    {
         modify_node_event (node, event);
-        if ((node->flags & STATS_REGULAR) == 0)
-            stats_listener_send (node->flags, "EVENT global %s %s\n", node->name, node->value);
-    }
     else
     {
         /* add node */
-        node = (stats_node_t *)calloc(1, sizeof(stats_node_t));
-        node->name = (char *)strdup(event->name);
-        node->value = (char *)strdup(event->value);
-        node->flags = event->flags;
-
+        node = stats_node_new (event);
         avl_insert(_stats.global_tree, (void *)node);
-        stats_listener_send (node->flags, "EVENT global %s %s\n", event->name, event->value);
+    }
+    if ((node->flags & STATS_REGULAR) == 0)
+    {
+        char buf [VAL_BUFSIZE];
+        stats_listener_send (node->flags, "EVENT global %s %s\n", node->name, stats_node_text (node, buf));
     }
     avl_tree_unlock (_stats.global_tree);
 }
@@ -508,19 +563,18 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
     if (event->name)
     {
         stats_node_t *node = _find_node (src_stats->stats_tree, event->name);
+        char buf [VAL_BUFSIZE];
+
         if (node == NULL)
         {
             /* adding node */
-            if (event->action != STATS_EVENT_REMOVE && event->value)
+            if (event->value || STATS_EVENT_NUMERIC (event->action))
             {
-                DEBUG3 ("new node on %s \"%s\" (%s)", src_stats->source, event->name, event->value);
-                node = (stats_node_t *)calloc (1,sizeof(stats_node_t));
-                node->name = (char *)strdup (event->name);
-                node->value = (char *)strdup (event->value);
-                node->flags = event->flags;
+                node = stats_node_new (event);
+                DEBUG3 ("new node on %s \"%s\" (%s)", src_stats->source, event->name, stats_node_text (node, buf));
                 if (src_stats->flags & STATS_HIDDEN)
                     node->flags |= STATS_HIDDEN;
-                stats_listener_send (node->flags, "EVENT %s %s %s\n", src_stats->source, event->name, event->value);
+                stats_listener_send (node->flags, "EVENT %s %s %s\n", src_stats->source, event->name, stats_node_text (node, buf));
                 avl_insert (src_stats->stats_tree, (void *)node);
             }
             return;
@@ -533,7 +587,7 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
             return;
         }
         modify_node_event (node, event);
-        stats_listener_send (node->flags, "EVENT %s %s %s\n", src_stats->source, node->name, node->value);
+        stats_listener_send (node->flags, "EVENT %s %s %s\n", src_stats->source, node->name, stats_node_text (node, buf));
         return;
     }
     if (event->action == STATS_EVENT_REMOVE && event->name == NULL)
@@ -573,8 +627,9 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
             stats_node_t *stats = (stats_node_t*)node->key;
             if (visible)
             {
+                char buf [VAL_BUFSIZE];
                 stats->flags &= ~STATS_HIDDEN;
-                stats_listener_send (stats->flags, "EVENT %s %s %s\n", src_stats->source, stats->name, stats->value);
+                stats_listener_send (stats->flags, "EVENT %s %s %s\n", src_stats->source, stats->name, stats_node_text (stats, buf));
             }
             else
                 stats->flags |= STATS_HIDDEN;
@@ -854,6 +909,7 @@ static void _add_stats_to_stats_client (client_t *client, const char *fmt, va_li
     }
     _add_node_to_stats_client (client, r);
     client->schedule_ms = 0;
+    worker_wakeup_client (client);
 }
 
 
@@ -868,8 +924,9 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, const char *show_mount, i
     while (avlnode)
     {
         stats_node_t *stat = avlnode->key;
+        char buf [VAL_BUFSIZE];
         if (stat->flags & flags)
-            xmlNewTextChild (root, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
+            xmlNewTextChild (root, NULL, XMLSTR(stat->name), XMLSTR(stats_node_text (stat, buf)));
         avlnode = avl_get_next (avlnode);
     }
     avl_tree_unlock (_stats.global_tree);
@@ -893,8 +950,9 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, const char *show_mount, i
             while (avlnode2)
             {
                 stats_node_t *stat = avlnode2->key;
+                char buf [VAL_BUFSIZE];
                 if ((flags&STATS_HIDDEN) || (stat->flags&STATS_HIDDEN) == (flags&STATS_HIDDEN))
-                    xmlNewTextChild (xmlnode, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
+                    xmlNewTextChild (xmlnode, NULL, XMLSTR(stat->name), XMLSTR(stats_node_text (stat, buf)));
                 avlnode2 = avl_get_next (avlnode2);
             }
             avl_tree_unlock (source->stats_tree);
@@ -913,14 +971,11 @@ static void _register_listener (client_t *client)
 {
     event_listener_t *listener = client->shared_data;
     avl_node *node;
-    stats_event_t stats_count;
     refbuf_t *refbuf;
     size_t size = 8192;
-    char buffer[20];
+    char buffer [VAL_BUFSIZE];
 
-    build_event (&stats_count, NULL, "stats_connections", buffer);
-    stats_count.action = STATS_EVENT_INC;
-    process_event (&stats_count);
+    stats_event_inc (NULL, "stats_connections");
 
     /* first we fill our queue with the current stats */
     refbuf = refbuf_new (size);
@@ -935,7 +990,7 @@ static void _register_listener (client_t *client)
 
         if (stat->flags & listener->mask)
         {
-            if (_append_to_buffer (refbuf, size, "EVENT global %s %s\n", stat->name, stat->value) < 0)
+            if (_append_to_buffer (refbuf, size, "EVENT global %s %s\n", stat->name, stats_node_text (stat, buffer)) < 0)
             {
                 _add_node_to_stats_client (client, refbuf);
                 refbuf = refbuf_new (size);
@@ -979,7 +1034,7 @@ static void _register_listener (client_t *client)
                 metadata_stat = stat;
             else if (stat->flags & listener->mask)
             {
-                if (_append_to_buffer (refbuf, size, "EVENT %s %s %s\n", snode->source, stat->name, stat->value) < 0)
+                if (_append_to_buffer (refbuf, size, "EVENT %s %s %s\n", snode->source, stat->name, stats_node_text (stat, buffer)) < 0)
                 {
                     _add_node_to_stats_client (client, refbuf);
                     refbuf = refbuf_new (size);
@@ -991,7 +1046,7 @@ static void _register_listener (client_t *client)
         }
         while (metadata_stat)
         {
-            if (_append_to_buffer (refbuf, size, "EVENT %s %s %s\n", snode->source, metadata_stat->name, metadata_stat->value) < 0)
+            if (_append_to_buffer (refbuf, size, "EVENT %s %s %s\n", snode->source, metadata_stat->name, stats_node_text (metadata_stat, buffer)) < 0)
             {
                 _add_node_to_stats_client (client, refbuf);
                 refbuf = refbuf_new (size);
@@ -1150,13 +1205,27 @@ static int _compare_source_stats(void *arg, void *a, void *b)
     return strcmp(nodea->source, nodeb->source);
 }
 
-static int _free_stats(void *key)
+/* drop a reference to the node, either from the tree or a slot */
+static void stats_node_release (stats_node_t *node, int from_tree)
 {
-    stats_node_t *node = (stats_node_t *)key;
+    int refs;
+
+    thread_spin_lock (&_stats.slot_lock);
+    refs = --node->refs;
+    if (from_tree)
+        node->removed = 1;
+    thread_spin_unlock (&_stats.slot_lock);
+    if (refs)
+        return;
     free(node->value);
     free(node->name);
     free(node);
-    
+}
+
+static int _free_stats(void *key)
+{
+    /* a slot may still refer to it */
+    stats_node_release ((stats_node_t *)key, 1);
     return 1;
 }
 
@@ -1268,6 +1337,7 @@ void stats_global_calc (void)
     char buffer [VAL_BUFSIZE];
 
     connection_stats ();
+    refbuf_stats ();
     avl_tree_rlock (_stats.global_tree);
     anode = avl_get_first(_stats.global_tree);
     while (anode)
@@ -1275,10 +1345,39 @@ void stats_global_calc (void)
         stats_node_t *node = (stats_node_t *)anode->key;
 
         if (node->flags & STATS_REGULAR)
-            stats_listener_send (node->flags, "EVENT global %s %s\n", node->name, node->value);
+            stats_listener_send (node->flags, "EVENT global %s %s\n", node->name, stats_node_text (node, buffer));
         anode = avl_get_next (anode);
     }
     avl_tree_unlock (_stats.global_tree);
+    if (_stats.event_listeners)
+    {
+        /* mount slots that have changed */
+        avl_tree_rlock (_stats.source_tree);
+        anode = avl_get_first (_stats.source_tree);
+        while (anode)
+        {
+            stats_source_t *src_stats = (stats_source_t *)anode->key;
+            avl_node *snode;
+
+            avl_tree_rlock (src_stats->stats_tree);
+            snode = avl_get_first (src_stats->stats_tree);
+            while (snode)
+            {
+                stats_node_t *node = (stats_node_t *)snode->key;
+                int64_t count = atomic_load (&node->count);
+
+                if ((node->flags & STATS_REGULAR) && node->value == NULL && node->sent != count)
+                {
+                    node->sent = count;
+                    stats_listener_send (node->flags, "EVENT %s %s %" PRId64 "\n", src_stats->source, node->name, count);
+                }
+                snode = avl_get_next (snode);
+            }
+            avl_tree_unlock (src_stats->stats_tree);
+            anode = avl_get_next (anode);
+        }
+        avl_tree_unlock (_stats.source_tree);
+    }
     build_event (&event, NULL, "outgoing_kbitrate", buffer);
     event.flags = STATS_COUNTERS|STATS_HIDDEN;
 
@@ -1348,6 +1447,123 @@ void stats_set (long handle, const char *name, const char *value)
 }
 
 
+/* numeric stat, only formatted when sent to stats clients.
+ * assume source stats are write locked */
+void stats_set_count (long handle, const char *name, int64_t value)
+{
+    if (handle)
+    {
+        stats_source_t *src_stats = (stats_source_t *)handle;
+        stats_event_t event;
+
+        build_event (&event, src_stats->source, name, NULL);
+        event.action = STATS_EVENT_COUNT;
+        event.count = value;
+        process_source_stat (src_stats, &event);
+    }
+}
+
+
+/* return a global numeric stat, created if needed, for updating with
+ * stats_counter_add without looking it up or taking the stats lock. As they
+ * change often, counters are sent to stats clients with the regular stats.
+ */
+stats_counter_t stats_counter (const char *name, int flags)
+{
+    stats_event_t event;
+    stats_node_t *node;
+
+    build_event (&event, NULL, name, NULL);
+    event.action = STATS_EVENT_ADD;
+    event.flags = flags | STATS_REGULAR;
+    avl_tree_wlock (_stats.global_tree);
+    node = _find_node (_stats.global_tree, name);
+    if (node)
+        modify_node_event (node, &event);
+    else
+    {
+        node = stats_node_new (&event);
+        avl_insert (_stats.global_tree, (void *)node);
+    }
+    node->flags = event.flags;
+    avl_tree_unlock (_stats.global_tree);
+    return node;
+}
+
+
+/* resolve a numeric stat on a mount to a slot, updated later with
+ * stats_counter_add/stats_counter_set without a lookup or the stats lock.
+ * Changes are sent to stats clients with the regular stats. The slot
+ * remains usable, even if the stat is removed, until stats_slot_release.
+ * assume source stats are write locked */
+stats_counter_t stats_slot (long handle, const char *name, int flags)
+{
+    stats_source_t *src_stats = (stats_source_t *)handle;
+    stats_node_t *node;
+    stats_event_t event;
+
+    if (src_stats == NULL)
+        return NULL;
+    /* creates it, or turns an existing stat into a number */
+    build_event (&event, src_stats->source, name, NULL);
+    event.action = STATS_EVENT_ADD;
+    event.flags = flags;
+    process_source_stat (src_stats, &event);
+
+    node = _find_node (src_stats->stats_tree, name);
+    node->flags |= STATS_REGULAR;
+    node->sent = node->count;
+    thread_spin_lock (&_stats.slot_lock);
+    node->refs++;
+    thread_spin_unlock (&_stats.slot_lock);
+    return node;
+}
+
+
+void stats_slot_release (stats_counter_t slot)
+{
+    if (slot && _stats_running)
+        stats_node_release (slot, 0);
+}
+
+
+/* true if the stat has been removed since the slot was taken, updates to it
+ * are no longer seen so the slot should be taken again */
+int stats_slot_stale (stats_counter_t slot)
+{
+    int removed;
+
+    if (slot == NULL)
+        return 0;
+    thread_spin_lock (&_stats.slot_lock);
+    removed = slot->removed;
+    thread_spin_unlock (&_stats.slot_lock);
+    return removed;
+}
+
+
+void stats_counter_set (stats_counter_t counter, int64_t value)
+{
+    if (counter == NULL)
+        return;
+    atomic_store (&counter->count, value);
+}
+
+
+void stats_counter_add (stats_counter_t counter, int64_t value)
+{
+    if (counter == NULL || value == 0)
+        return;
+#ifdef HAVE_ATOMIC_OPS
+    atomic_add (&counter->count, value);
+#else
+    avl_tree_wlock (_stats.global_tree);
+    counter->count += value;
+    avl_tree_unlock (_stats.global_tree);
+#endif
+}
+
+
 void stats_set_args (long handle, const char *name, const char *format, ...)
 {
     va_list val;
@@ -29,6 +29,24 @@
 #define STATS_REGULAR   01000
 #define STATS_ALL      ~0
 
+typedef struct _stats_node_tag *stats_counter_t;
+
+/* frequently updated global stats */
+struct _stats_counters
+{
+    stats_counter_t connections;
+    stats_counter_t client_connections;
+    stats_counter_t listener_connections;
+    stats_counter_t file_connections;
+    stats_counter_t listeners;
+    stats_counter_t stream_kbytes_sent;
+    stats_counter_t stream_kbytes_read;
+    stats_counter_t auth_cache_hits;
+    stats_counter_t auth_cache_misses;
+};
+
+extern struct _stats_counters stats_counters;
+
 void stats_initialize(void);
 void stats_shutdown(void);
 
@@ -48,6 +66,10 @@ void stats_event_dec(const char *source, const char *name);
 void stats_event_flags (const char *source, const char *name, const char *value, int flags);
 void stats_event_time (const char *mount, const char *name, int flags);
 
+stats_counter_t stats_counter (const char *name, int flags);
+void stats_counter_add (stats_counter_t counter, int64_t value);
+void stats_counter_set (stats_counter_t counter, int64_t value);
+
 void *stats_connection(void *arg);
 void stats_add_listener (client_t *client, int hidden_level);
 void stats_global_calc(void);
@@ -62,6 +84,10 @@ long stats_lock (long handle, const char *mount);
 void stats_release (long handle);
 void stats_set (long handle, const char *name, const char *value);
 void stats_set_args (long handle, const char *name, const char *format, ...);
+void stats_set_count (long handle, const char *name, int64_t value);
+stats_counter_t stats_slot (long handle, const char *name, int flags);
+void stats_slot_release (stats_counter_t slot);
+int  stats_slot_stale (stats_counter_t slot);
 void stats_set_flags (long handle, const char *name, const char *value, int flags);
 void stats_set_conv (long handle, const char *name, const char *value, const char *charset);
 void stats_set_time (long handle, const char *name, int flags, time_t tm);
@@ -47,20 +47,28 @@
 
 #include "logging.h"
 
-struct rate_calc_node
+/* samples are totalled into buckets covering a fraction of ssec each */
+#define RATE_BUCKETS_PER_SSEC   10
+
+struct rate_calc_bucket
 {
-    int64_t index;
+    uint64_t start;
     uint64_t value;
-    struct rate_calc_node *next;
 };
 
 struct rate_calc
 {
     int64_t total;
-    struct rate_calc_node *current;
+    uint64_t last;
+    uint64_t next;
+    struct rate_calc_bucket *buckets;
+    unsigned int count;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int used;
     unsigned int samples;
     unsigned int ssec;
-    unsigned int blocks;
+    unsigned int width;
 };
 
 
@@ -702,35 +710,39 @@ char *util_conv_string (const char *string, const char *in_charset, const char *
  */
 struct rate_calc *rate_setup (unsigned int samples, unsigned int ssec)
 {
-    struct rate_calc *calc = calloc (1, sizeof (struct rate_calc));
+    struct rate_calc *calc;
+    unsigned int width, count;
 
-    if (calc == NULL || samples < 2 || ssec == 0)
-    {
-        free (calc);
+    if (samples < 2 || ssec == 0)
         return NULL;
-    }
+    width = ssec / RATE_BUCKETS_PER_SSEC;
+    if (width > samples / 2)
+        width = samples / 2;
+    if (width == 0)
+        width = 1;
+    count = samples / width + 2;
+    calc = calloc (1, sizeof (struct rate_calc) + count * sizeof (struct rate_calc_bucket));
+    if (calc == NULL)
+        return NULL;
+    calc->buckets = (struct rate_calc_bucket *)(calc + 1);
+    calc->count = count;
     calc->samples = samples;
     calc->ssec = ssec;
+    calc->width = width;
     return calc;
 }
 
+/* drop the oldest buckets started at or before the cutoff, the most recent
+ * is always kept */
 static void rate_purge_entries (struct rate_calc *calc, uint64_t cutoff)
 {
-    struct rate_calc_node *node = calc->current->next;
-    int count = calc->blocks;
-
-    while (count && node->index <= cutoff)
+    while (calc->used > 1 && calc->buckets [calc->tail].start <= cutoff)
     {
-        struct rate_calc_node *to_go = node;
-        if (node == NULL || node->next == NULL)
-            abort();
-        node = node->next;
-        calc->current->next = node;
-        calc->total -= to_go->value;
-        free (to_go);
-        count--;
+        calc->total -= calc->buckets [calc->tail].value;
+        if (++calc->tail == calc->count)
+            calc->tail = 0;
+        calc->used--;
     }
-    calc->blocks = count;
 }
 
 /* add a value to sampled data, t is used to determine which sample
@@ -738,88 +750,70 @@ static void rate_purge_entries (struct rate_calc *calc, uint64_t cutoff)
  */
 void rate_add (struct rate_calc *calc, long value, uint64_t sid) 
 {
-    uint64_t cutoff = sid - calc->samples;
+    struct rate_calc_bucket *bucket = &calc->buckets [calc->head];
 
-    if (value == 0 && calc->current && calc->current->value == 0)
+    if (calc->used == 0 || sid >= calc->next)
     {
-        calc->current->index = sid; /* update the timestamp if 0 already present */
-        rate_purge_entries (calc, cutoff);
-        return;
-    }
-    calc->total += value;
-    if (calc->current == NULL || sid != calc->current->index)
-    {
-        struct rate_calc_node *node = calc->current ? calc->current->next : NULL;
-        if (node == NULL || node->index > cutoff)
+        if (calc->used && value == 0 && bucket->value == 0)
+            bucket->start = sid; /* update the timestamp if 0 already present */
+        else
         {
-            node = calloc (1, sizeof (*node));
-
-            node->index = sid;
-            node->value = value;
-            calc->blocks++;
-            if (calc->current)
+            if (calc->used == 0)
+                calc->used = 1;
+            else
             {
-                node->next = calc->current->next;
-                calc->current->next = node;
+                if (++calc->head == calc->count)
+                    calc->head = 0;
+                bucket = &calc->buckets [calc->head];
+                if (calc->used == calc->count)
+                {
+                    calc->total -= bucket->value;  /* oldest is overwritten */
+                    if (++calc->tail == calc->count)
+                        calc->tail = 0;
+                }
+                else
+                    calc->used++;
             }
-            else
-                node->next = node;
-            calc->current = node;
-        }
-        else
-        {
-            calc->total -= node->value;
-            node->index = sid;
-            node->value = value;
-            calc->current = node;
+            bucket->start = sid;
+            bucket->value = 0;
         }
-        rate_purge_entries (calc, cutoff);
-        return;
+        calc->next = (sid / calc->width + 1) * calc->width;
     }
-    calc->current->value += value;
+    bucket->value += value;
+    calc->total += value;
+    if (sid > calc->last)
+        calc->last = sid;
+    rate_purge_entries (calc, sid > calc->samples ? sid - calc->samples : 0);
 }
 
-/* return the average sample value over all the blocks except the 
- * current one, as that may be incomplete
+/* return the average sample value over the range of samples held
  */
 float rate_avg (struct rate_calc *calc)
 {
+    uint64_t oldest;
     float range;
 
-    if (calc == NULL || calc->blocks < 2)
+    if (calc == NULL || calc->used == 0)
         return 0;
-    range = (calc->current->index - calc->current->next->index) + 1;
-    if (range < 1)
-        range = 1;
+    oldest = calc->buckets [calc->tail].start;
+    if (calc->last <= oldest)
+        return 0;
+    range = (calc->last - oldest) + 1;
     return calc->total / range * calc->ssec;
 }
 
 /* reduce the samples used to calculate average */
 void rate_reduce (struct rate_calc *calc, unsigned int range)
 {
-    if (calc && range && calc->blocks > 1)
+    if (calc && range && calc->used > 1 && calc->last > range)
     {
-        rate_purge_entries (calc, calc->current->index - range);
+        rate_purge_entries (calc, calc->last - range);
     }
 }
 
 
 void rate_free (struct rate_calc *calc)
 {
-    struct rate_calc_node *endoflist;
-
-    if (calc == NULL)
-        return;
-    endoflist = calc->current;
-    while (calc->current)
-    {
-        struct rate_calc_node *to_go = calc->current;
-        if (to_go->next == endoflist)
-            calc->current = NULL;
-        else
-            calc->current = to_go->next;
-        free (to_go);
-    }
     free (calc);
 }
 
@@ -839,7 +839,7 @@ static void *yp_update_thread(void *arg)
     /* DEBUG0("YP thread shutdown"); */
 
     ypclient.flags |= CLIENT_ACTIVE;
-    worker_wakeup (ypclient.worker);
+    worker_wakeup_client (&ypclient);
 
     return NULL;
 }
@@ -1083,12 +1083,11 @@ void yp_shutdown (void)
 
 void yp_stop (void)
 {
-    worker_t *w = ypclient.worker;
-    if (w)
+    if (ypclient.worker)
     {
         ypclient.connection.error = 1;
         ypclient.schedule_ms = 0;
-        worker_wakeup(w);
+        worker_wakeup_client (&ypclient);
         DEBUG0 ("YP client is now stopped");
     }
 }